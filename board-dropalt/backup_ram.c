@@ -1,8 +1,10 @@
-#include <stdarg.h>             // for va_start(), va_end()
+#include <stdarg.h>             // for va_copy(), va_end()
+#include <stdbool.h>            // for bool
 #include <stdio.h>              // for vsnprintf()
+#include <string.h>             // for strnlen()
 #include "assert.h"
 #include "backup_ram.h"
-#include "compiler_hints.h"     // for likely()
+#include "board.h"              // for _sfixed, _efixed
 
 
 
@@ -10,22 +12,24 @@
 // Note that "used" preserves the allocation order within the section.
 struct backup_t backup __attribute__((section(".backup.noinit"), used));
 
-// Buffer that holds the concatenated big string. Sized to fill the remaining backup RAM.
+// Buffer that holds the log records. Sized to fill the remaining backup RAM.
 static char buffer[BACKUP_RAM_LEN - sizeof(backup)]
-    __attribute__((section(".backup.noinit"), used));
+    __attribute__((section(".backup.noinit"), used, aligned(4)));
 
 // Note that if there is another variable allocated in the backup ram, the linker will
 // detect an overflow. Since we are allocating the entire backup ram here, _sbrk_r() in
 // riot/sys/newlib_syscalls_default/syscalls.c will not configure a heap on this region
 // even if NUM_HEAPS is set to 2 in riot/cpu/sam0_common/include/cpu_conf.h.
 
+// A single record may take up to a quarter of the buffer; longer lines are truncated.
+#define MAX_RECORD_SIZE     (sizeof(buffer) / 4 & ~3u)
+
 void backup_ram_init(void)
 {
     backup.write_offset = 0;
     backup.size_limited = 0;
-
-    // Safe guard for backup_ram_read() to not return a too long C-string.
-    buffer[sizeof(buffer) - 1] = 0;
+    backup.read_offset = 0;
+    backup.log_format = BACKUP_LOG_FORMAT;
 }
 
 // A variant of vsnprintf() that appends a newline after the formatted output. Returns
@@ -47,35 +51,199 @@ int vsnprintf_nl(char* buffer, size_t size, const char* format, va_list args)
     return len;
 }
 
-const char* backup_ram_write(const char* format, va_list args)
+static size_t put_u32(uint8_t* out, size_t size, uint32_t value)
+{
+    if ( out )
+        __builtin_memcpy(out + size, &value, sizeof(value));
+    return size + sizeof(value);
+}
+
+static size_t put_u64(uint8_t* out, size_t size, uint64_t value)
 {
+    if ( out )
+        __builtin_memcpy(out + size, &value, sizeof(value));
+    return size + sizeof(value);
+}
+
+static bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+// Store the arguments following the format into `out` as described in log_record_t, or
+// just measure their size if `out` is NULL. Returns the size in bytes.
+// Note: ./dalogdecode parses the format in the same way to decode the arguments.
+static size_t encode_args(uint8_t* out, const char* format, va_list args)
+{
+    size_t size = 0;
+    const char* p = format;
+
+    while ( (p = __builtin_strchr(p, '%')) != NULL ) {
+        p++;
+        while ( *p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0' )
+            p++;
+
+        // Width and precision, each of which may be given as an int argument ('*').
+        if ( *p == '*' ) {
+            size = put_u32(out, size, va_arg(args, int));
+            p++;
+        }
+        else
+            while ( is_digit(*p) ) p++;
+        if ( *p == '.' ) {
+            if ( *++p == '*' ) {
+                size = put_u32(out, size, va_arg(args, int));
+                p++;
+            }
+            else
+                while ( is_digit(*p) ) p++;
+        }
+
+        // Length modifiers; only "ll" and 'j' change the argument size on ARM32.
+        bool is_64bit = false;
+        if ( p[0] == 'l' && p[1] == 'l' ) {
+            is_64bit = true;
+            p += 2;
+        }
+        else if ( *p == 'j' ) {
+            is_64bit = true;
+            p++;
+        }
+        else
+            while ( *p == 'h' || *p == 'l' || *p == 'z' || *p == 't' || *p == 'L' )
+                p++;
+
+        switch ( *p ) {
+            case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+                size = is_64bit
+                    ? put_u64(out, size, va_arg(args, unsigned long long))
+                    : put_u32(out, size, va_arg(args, unsigned));
+                break;
+
+            case 'c':
+                size = put_u32(out, size, va_arg(args, int));
+                break;
+
+            case 'p': case 'n':
+                size = put_u32(out, size, (uintptr_t)va_arg(args, void*));
+                break;
+
+            case 'a': case 'A': case 'e': case 'E':
+            case 'f': case 'F': case 'g': case 'G': {
+                const double number = va_arg(args, double);
+                uint64_t bits;
+                __builtin_memcpy(&bits, &number, sizeof(bits));
+                size = put_u64(out, size, bits);
+                break;
+            }
+
+            case 's': {
+                const char* s = va_arg(args, const char*);
+                if ( s == NULL )
+                    s = "(null)";
+                const size_t len = strnlen(s, UINT8_MAX);
+                if ( out ) {
+                    out[size] = len;
+                    __builtin_memcpy(out + size + 1, s, len);
+                }
+                size += 1 + len;
+                break;
+            }
+
+            case '\0':  // Incomplete specification at the end
+                return size;
+
+            default:  // "%%" or an unknown conversion, taking no argument
+                break;
+        }
+        p++;
+    }
+
+    return size;
+}
+
+static char* alloc_record(size_t size)
+{
+    for (;;) {
+        if ( backup.size_limited == 0 ) {
+            if ( backup.write_offset + size <= sizeof(buffer) )
+                break;
+            // Roll over, leaving the records in [read_offset, size_limited) to be
+            // overwritten from the oldest.
+            backup.size_limited = backup.write_offset;
+            backup.write_offset = 0;
+        }
+
+        if ( backup.write_offset + size <= backup.read_offset )
+            break;
+
+        // Drop the oldest record.
+        const log_record_t* const oldest =
+            (const log_record_t*)&buffer[backup.read_offset];
+        assert( oldest->size >= sizeof(log_record_t) && (oldest->size & 3) == 0 );
+        backup.read_offset += oldest->size;
+        if ( backup.read_offset >= backup.size_limited ) {
+            backup.read_offset = 0;
+            backup.size_limited = 0;
+        }
+    }
+
+    char* const record = &buffer[backup.write_offset];
+    backup.write_offset += size;
+    return record;
+}
+
+const log_record_t* backup_ram_write(
+    unsigned level, uint8_t thread, uint32_t timestamp,
+    const char* format, va_list args)
+{
+    // Only the format strings in the firmware image can be resolved on the host, using
+    // the format table built from the ELF file.
+    bool is_binary =
+        format >= (const char*)&_sfixed && format < (const char*)&_efixed;
+
     va_list args_copy;
-    va_copy(args_copy, args);
+    size_t size;
+    if ( is_binary ) {
+        va_copy(args_copy, args);
+        size = sizeof(log_record_t) + encode_args(NULL, format, args_copy);
+        va_end(args_copy);
+        // Too many long strings; store it as a (truncated) text record instead.
+        is_binary = size <= MAX_RECORD_SIZE;
+    }
+    if ( !is_binary ) {
+        // encode_args() has consumed the copy above, so take a fresh one.
+        va_copy(args_copy, args);
+        const int len = vsnprintf(NULL, 0, format, args_copy);
+        va_end(args_copy);
+        // Include the trailing '\n' and the null terminator.
+        size = sizeof(log_record_t) + (len > 0 ? len : 0) + 2;
+    }
+
+    size = (size + 3) & ~3u;
+    if ( size > MAX_RECORD_SIZE )
+        size = MAX_RECORD_SIZE;
 
-    // Note: vsnprintf() returns the total number of characters (excluding the
-    // terminating null byte) which was written successfully or would have been written
-    // if not limited by the buffer size.
-    int n = vsnprintf_nl(
-        buffer + backup.write_offset, sizeof(buffer) - backup.write_offset, format, args);
-    assert( n >= 0 && (size_t)n < sizeof(buffer) );  // n excludes the null terminator.
+    log_record_t* const record = (log_record_t*)alloc_record(size);
+    ((uint32_t*)record)[size / 4 - 1] = 0;  // Clear the padding.
+    record->size = size;
+    record->thread = thread;
+    record->level = level;
+    record->timestamp = timestamp;
 
-    if ( likely(backup.write_offset + (size_t)n < sizeof(buffer)) )
-        backup.write_offset += n;
+    if ( is_binary ) {
+        record->format = (uintptr_t)format;
+        encode_args((uint8_t*)(record + 1), format, args);
+    }
     else {
-        // The buffer overflowed. We are overwriting it from the beginning now.
-        // Note that size_limited will get > 0 below, indicating an overflow has occurred,
-        // since the previous vsnprintf() would have written at least one non-overflowing
-        // string into the buffer.
-
-        // Note that this second vsnprintf() should not overflow the buffer, as it was
-        // already verified at the first vsnprintf() call.
-        n = vsnprintf_nl(buffer, sizeof(buffer), format, args_copy);
-        backup.size_limited = backup.write_offset;
-        backup.write_offset = n;
+        char* const text = (char*)(record + 1);
+        const size_t text_size = size - sizeof(log_record_t);
+        record->format = 0;
+        if ( (size_t)vsnprintf_nl(text, text_size, format, args) >= text_size ) {
+            // Truncated; keep the trailing '\n'.
+            text[text_size - 2] = '\n';
+            text[text_size - 1] = '\0';
+        }
     }
 
-    va_end(args_copy);
-    return buffer + (backup.write_offset - n);
+    return record;
 }
 
 static void reverse_memory(char* begin, char* end)
@@ -87,19 +255,20 @@ static void reverse_memory(char* begin, char* end)
     }
 }
 
-const char* backup_ram_read(void)
+const uint8_t* backup_ram_read(size_t* size)
 {
-    // Remaining string that was not overwritten
-    const uint16_t remainder = backup.write_offset + 1;  // Include the null terminator.
-
-    // Flatten the log buffer.
-    if ( remainder < backup.size_limited ) {  // Also checks if size_limited > 0.
-        reverse_memory(buffer, buffer + remainder);
-        reverse_memory(buffer + remainder, buffer + backup.size_limited);
+    // Flatten the log buffer, rotating it so that the oldest record comes first.
+    if ( backup.size_limited > 0 ) {
+        const size_t rotation = backup.read_offset;
+        reverse_memory(buffer, buffer + rotation);
+        reverse_memory(buffer + rotation, buffer + backup.size_limited);
         reverse_memory(buffer, buffer + backup.size_limited);
-        backup.write_offset = backup.size_limited - 1;
+        // [read_offset, size_limited) now comes first, followed by [0, write_offset).
+        backup.write_offset += backup.size_limited - rotation;
         backup.size_limited = 0;
+        backup.read_offset = 0;
     }
 
-    return buffer;
+    *size = backup.write_offset - backup.read_offset;
+    return (const uint8_t*)&buffer[backup.read_offset];
 }
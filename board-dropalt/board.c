@@ -1,4 +1,4 @@
-#include "backup_ram.h"         // for backup_ram_init()
+#include "backup_ram.h"         // for backup_ram_init(), BACKUP_LOG_FORMAT
 #include "board.h"
 #include "log.h"
 #include "mpu.h"                // for mpu_configure(), mpu_enable(), ...
@@ -112,8 +112,10 @@ void pre_startup(void)
 #endif
 
     // Initialize backup RAM and clear the logs.
-    // Note that backup RAM persists across resets, except for a power-on reset.
-    if ( (RSTC->RCAUSE.reg & (RSTC_RCAUSE_NVM | RSTC_RCAUSE_POR)) != 0 )
+    // Note that backup RAM persists across resets, except for a power-on reset. The logs
+    // are also cleared if they were written by a firmware using another log format.
+    if ( (RSTC->RCAUSE.reg & (RSTC_RCAUSE_NVM | RSTC_RCAUSE_POR)) != 0
+      || backup.log_format != BACKUP_LOG_FORMAT )
         backup_ram_init();
 }
 
@@ -175,6 +177,11 @@ void board_init(void)
     );
     mpu_enable();
 
+    // Enable the DWT cycle counter for get_cycle_count().
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
 #ifdef DEVELHELP
     wdt_setup_reboot(0u, WDT_TIMEOUT_MS);
     wdt_start();
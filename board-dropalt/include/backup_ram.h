@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdarg.h>             // va_list
+#include <stddef.h>             // for size_t
 #include <stdint.h>             // for uint8_t, uint16_t
 
 
@@ -22,17 +23,45 @@ extern struct backup_t {
     // Tracks the currently active USB host port.
     uint8_t current_host_port;
 
+    // Format of the logs in log_buffer. Logs of any other format are cleared at boot.
+    uint8_t log_format;
+
+    // Indicates the offset in log_buffer of the oldest log record.
+    uint16_t read_offset;
+
     // Add new members here.
 } backup;
 
+// Current value of backup.log_format
+#define BACKUP_LOG_FORMAT       1
+
+// Binary log record stored in the backup ram (See ./dalogdecode for the host decoder).
+// The header is followed by the arguments, in the order and with the sizes after the
+// default argument promotions: 4 bytes for integers, chars and pointers, 8 bytes for
+// doubles and long longs, and strings (%s) inline as a 1-byte length followed by the
+// characters. Records are padded to a multiple of 4 bytes.
+//
+// If the format string does not reside in the firmware image (e.g. a Lua string), the
+// host cannot resolve it. Then `format` is 0 and the record holds the formatted line
+// instead, as a C-string including the trailing '\n'.
+typedef struct __attribute__((packed)) {
+    uint16_t size;              // record size in bytes, including this header
+    uint8_t thread;             // priority of the logging thread, or 0xff if none
+    uint8_t level;
+    uint32_t timestamp;         // in ms, or 0 during boot
+    uint32_t format;            // address of the format string
+} log_record_t;
+
 void backup_ram_init(void);
 
-// Build a string from the given parameters, store it in the backup ram, and return
-// it as a C-string.
-const char* backup_ram_write(const char* format, va_list args);
+// Store a log record in the backup ram and return it.
+const log_record_t* backup_ram_write(
+    unsigned level, uint8_t thread, uint32_t timestamp,
+    const char* format, va_list args);
 
-// Return the stored log strings as a single concatenated C-string.
-const char* backup_ram_read(void);
+// Return the stored log records, oldest first, as a contiguous byte array, storing its
+// size in *size.
+const uint8_t* backup_ram_read(size_t* size);
 
 #ifdef __cplusplus
 }
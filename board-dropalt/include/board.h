@@ -216,6 +216,17 @@ static inline void ztimer_irq_enable(void)
 }
 
 
+/**
+ * @brief   Read the free-running CPU cycle counter (DWT->CYCCNT) enabled in
+ *          board_init(). It wraps around every ~36 seconds at 120 MHz, so only use it
+ *          to measure short intervals.
+ */
+static inline uint32_t get_cycle_count(void)
+{
+    return DWT->CYCCNT;
+}
+
+
 /**
  * @brief   Retrieve the product serial number "..HMM.*" in the USER page of the device.
  *          Return NULL if not found.
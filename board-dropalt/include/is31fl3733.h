@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdbool.h>            // for bool
+#include <stddef.h>             // for size_t
+#include <stdint.h>             // for uint8_t, uint32_t
 
 #include "led_conf.h"           // for is31_led_t, ...
 
@@ -28,7 +30,69 @@ void is31_enable_led(is31_led_t, bool enable);
 void is31_enable_all_leds(bool enable);
 
 void is31_set_color(is31_led_t, uint8_t red, uint8_t green, uint8_t blue);
-void is31_refresh_colors(void);
+
+// Callback of is31_refresh_colors_async(), called in the context of is31_thread
+typedef void (*is31_refresh_cb_t)(void* arg);
+
+// Write out the colors changed by is31_set_color() without waiting for the I2C
+// transfer, which is31_thread performs in the background. The colors changed so far are
+// snapshotted when the transfer starts, so the next frame can be set meanwhile. Calls
+// made while a transfer is in progress are coalesced into the next one. `cb`, if not NULL, is called
+// when the transfer serving this call completes; among the calls coalesced together,
+// only the last callback given is called.
+void is31_refresh_colors_async(is31_refresh_cb_t cb, void* arg);
+
+// Counters of the PWM register refreshes
+typedef struct {
+    uint32_t refreshes;     // Refreshes that wrote anything
+    uint32_t transactions;  // I2C write transactions
+    uint32_t bus_bytes;     // Bytes sent, including the address and register bytes
+    uint32_t busy_us;       // Time taken by the refreshes
+} is31_pwm_stats_t;
+
+// Get the counters accumulated since boot.
+void is31_get_pwm_stats(is31_pwm_stats_t* stats);
+
+// Rewrite the PWM registers flagged in need_update[] (a bitmap per driver, as kept for
+// is31_set_color()) with their current values, with or without coalescing the runs of
+// them, and add the cost to `stats`. The colors do not change.
+void is31_benchmark_pwm_refresh(
+    const uint8_t need_update[][PWM_REGISTER_COUNT / 8], bool coalesce,
+    is31_pwm_stats_t* stats);
+
+// Auto breath modes (ABM). An LED assigned to ABM-1, ABM-2 or ABM-3 breathes by itself,
+// ramping between off and the color in its PWM registers with the timing of the ABM,
+// with no further I2C traffic. IS31_ABM_NONE makes it follow the PWM registers again.
+typedef enum {
+    IS31_ABM_NONE = 0,
+    IS31_ABM_1,
+    IS31_ABM_2,
+    IS31_ABM_3
+} is31_abm_t;
+
+// Timing of an ABM, in codes for 0.21 s × 2^n:
+//  - t1_rise and t3_fall: 0-7 for 0.21 s × 2^code (0.21 s to 26.88 s)
+//  - t2_on and t4_off: 0 for none, or 1-8 for 0.21 s × 2^(code - 1)
+typedef struct {
+    uint8_t t1_rise;
+    uint8_t t2_on;
+    uint8_t t3_fall;
+    uint8_t t4_off;
+    uint16_t loops;         // Number of breaths (up to 0xFFF), or 0 for endless
+    bool end_on;            // Stay on after the last breath; otherwise off.
+} is31_abm_timing_t;
+
+// Set the timing of an ABM, which takes effect at is31_abm_start().
+void is31_abm_configure(is31_abm_t abm, const is31_abm_timing_t* timing);
+
+// Assign the LEDs to an ABM, or back to PWM control with IS31_ABM_NONE.
+void is31_abm_assign(const is31_led_t leds[], size_t n, is31_abm_t abm);
+
+// (Re)start all ABMs from T1 together.
+void is31_abm_start(void);
+
+// Return all LEDs to PWM control and disable the auto breath mode, if it was used.
+void is31_abm_reset(void);
 
 // Set GCR (0–255) to control overall LED brightness.
 void is31_set_gcr(uint8_t gcr);
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <stdbool.h>            // for bool
+#include <stddef.h>             // for size_t
+#include <stdint.h>             // for uint8_t, uint16_t, uint32_t
+
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Streaming writer into the NVM main array, used for DFU_DNLOAD in place of
+// riotboot_flashwrite, which writes and erases synchronously as the bytes come in.
+//
+// The writer drives NVMCTRL directly in manual write mode without waiting for commands
+// to complete, so that the NVM programs one page while the next page is received into
+// RAM, and erases the next block ahead of time while it has nothing else to do. This is
+// possible because the target region always resides in the opposite bank (bank B) of
+// the running firmware, which supports read-while-write.
+
+#define NVM_STREAM_PAGE_SIZE    512     // NVM page, the unit of Write Page (WP)
+#define NVM_STREAM_BLOCK_SIZE   8192    // NVM block, the unit of Erase Block (EB)
+#define NVM_STREAM_QWORD_SIZE   16      // the unit of Write Quad Word (WQW)
+
+// Size of the buffer given to nvm_stream_begin_diff(): the first block, which is held
+// until the end, and two blocks alternately receiving the others.
+#define NVM_STREAM_DIFF_BUF_SIZE    (3 * NVM_STREAM_BLOCK_SIZE)
+
+// A block found to differ, to be erased and then written page by page (diffing only)
+typedef struct {
+    const uint8_t* src;         // new contents of the block
+    uint32_t addr;              // address of the next page to write
+    uint32_t end;               // end of the pages to write, or 0 if done
+    bool erase;                 // true if the block is yet to be erased
+} nvm_stream_job_t;
+
+typedef struct {
+    uint32_t start;             // start address of the target region
+    uint32_t end;               // end address of the target region, or 0 if inactive
+    uint32_t addr;              // address of the page (or block, if diffing) being
+                                // buffered
+    uint32_t erased_end;        // end of the region erased (or being erased) so far
+    uint32_t size;              // number of bytes written so far
+    uint32_t cmd_start;         // cycle count when the last command was issued
+    uint16_t cmd;               // last issued NVMCTRL command
+    uint16_t ctrla;             // NVMCTRL->CTRLA to be restored at the end
+    uint16_t fill;              // number of bytes buffered for the page (or block)
+    uint16_t skipped;           // number of pages skipped as unchanged (diffing only)
+    bool is_held;               // true until nvm_stream_start_diff(), issuing no command
+
+    // Diffing
+    uint8_t* diff_buf;          // NVM_STREAM_DIFF_BUF_SIZE bytes, or NULL if not diffing
+    nvm_stream_job_t jobs[2];   // for odd and even blocks respectively
+    bool is_changed;            // true once any block is found to differ
+    bool erase_first;           // true if the first block is yet to be erased
+
+    uint32_t first_qword[NVM_STREAM_QWORD_SIZE / sizeof(uint32_t)];
+    uint32_t page_buf[NVM_STREAM_PAGE_SIZE / sizeof(uint32_t)];
+} nvm_stream_t;
+
+// Start writing into the region [start, start + size), which must be aligned to
+// NVM_STREAM_BLOCK_SIZE. Erasing the first block begins immediately.
+void nvm_stream_begin(nvm_stream_t* stream, uint32_t start, size_t size);
+
+// Same as nvm_stream_begin(), but compare each block with the current contents of the
+// region, and skip erasing and writing the blocks that are unchanged. `buf` must hold
+// NVM_STREAM_DIFF_BUF_SIZE bytes, aligned to 4 bytes, until the end.
+//
+// Note that the comparison is made per block, since a page cannot be rewritten without
+// erasing the whole block it belongs to. The last block is compared in whole as well,
+// and found unchanged only if the rest of it past the image is blank. Also, the first
+// block is erased as soon as any block is found to differ and written back at the end,
+// keeping an interrupted update from leaving a valid slot header (or reset vector) in
+// front of a half-written image.
+void nvm_stream_begin_diff(nvm_stream_t* stream, uint32_t start, size_t size,
+    void* buf);
+
+// Same as nvm_stream_begin_diff(), but before the buffer is available: leave the NVM
+// untouched until nvm_stream_start_diff() gives the buffer, holding up to
+// NVM_STREAM_PAGE_SIZE bytes in RAM meanwhile. This is for the first DFU_DNLOAD block,
+// which arrives while Lua still runs its bytecode in place from the region (and
+// occupies the memory to borrow for the buffer).
+void nvm_stream_begin_held(nvm_stream_t* stream, uint32_t start, size_t size);
+
+// Give the buffer to the writer started by nvm_stream_begin_held(), which then compares
+// all the blocks, including the bytes held so far. Does nothing for the other writers.
+void nvm_stream_start_diff(nvm_stream_t* stream, void* buf);
+
+// Append the bytes to the region. This blocks only if the buffer in RAM is full and
+// the NVM is still busy with the previous page (or block). Return 0 on success, or -1
+// if the region (or the RAM of a held writer) overflows or the NVM reports an error.
+int nvm_stream_write(nvm_stream_t* stream, const uint8_t* data, size_t len);
+
+// Issue the next NVM command, if the NVM is ready, without waiting for its completion.
+// Return -1 if the NVM reported an error.
+int nvm_stream_poll(nvm_stream_t* stream);
+
+// Return true if nvm_stream_write() of `len` bytes would wait for the NVM, which
+// should be avoided while the keyboard is in use (See usbus_hid_rawhid.cpp). Only for
+// the writer started by nvm_stream_begin(). Call it after nvm_stream_poll().
+bool nvm_stream_would_block(const nvm_stream_t* stream, size_t len);
+
+// Return the estimated time in ms until the writer can accept more bytes, or 0 if it can
+// accept them now. Call it after nvm_stream_poll().
+uint32_t nvm_stream_busy_ms(const nvm_stream_t* stream);
+
+// Write out the remaining bytes and then the first quad-word of the region, which is
+// deferred until the end so that an incomplete image never looks valid (i.e. has neither
+// the magic number of a slot header nor the reset vector of a firmware image). Return 0
+// on success.
+int nvm_stream_finish(nvm_stream_t* stream);
+
+// Same as nvm_stream_finish(), but verify the CRC-32 (as zlib.crc32()) of the image read
+// back from the flash before writing the first quad-word, which is left unwritten if the
+// CRC does not match.
+int nvm_stream_finish_crc(nvm_stream_t* stream, uint32_t crc);
+
+// Same as nvm_stream_finish(), but in two steps for the caller to verify the image
+// piecemeal in between: nvm_stream_flush() writes out the remaining bytes except for
+// the first quad-word, which stays in first_qword (0xff in the flash) until
+// nvm_stream_commit() writes it. Return 0 on success; nvm_stream_flush() aborts the
+// writer on failure.
+int nvm_stream_flush(nvm_stream_t* stream);
+int nvm_stream_commit(nvm_stream_t* stream);
+
+// Update the CRC-32 (IEEE 802.3, compatible with zlib.crc32()) with the bytes. Start
+// with crc = 0.
+uint32_t nvm_stream_crc32(uint32_t crc, const void* data, size_t len);
+
+// Stop writing, leaving the region incomplete.
+void nvm_stream_abort(nvm_stream_t* stream);
+
+// Number of bytes written so far
+static inline size_t nvm_stream_size(const nvm_stream_t* stream) {
+    return stream->size;
+}
+
+// Number of pages written so far, including the pages skipped
+static inline size_t nvm_stream_pages(const nvm_stream_t* stream) {
+    return (stream->size + NVM_STREAM_PAGE_SIZE - 1) / NVM_STREAM_PAGE_SIZE;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,7 +1,13 @@
-#include "board.h"              // for DRIVER_COUNT, DRIVER_ADDR, ...
+#include "board.h"              // for DRIVER_COUNT, DRIVER_ADDR, get_cycle_count(), ...
+#include "compiler_hints.h"     // for NORETURN
+#include "irq.h"                // for irq_disable(), irq_restore()
 #include "is31fl3733.h"
 #include "periph/i2c.h"         // for i2c_write_bytes(), i2c_read_bytes(), ...
+#include "periph_conf.h"        // for CLOCK_CORECLOCK
 #include "sr_exp.h"             // for sr_exp_writedata()
+#include "thread.h"             // for thread_create(), thread_get_unchecked()
+#include "thread_flags.h"       // for thread_flags_set(), thread_flags_wait_any()
+#include "time_units.h"         // for US_PER_SEC
 #include "ztimer.h"             // for ztimer_sleep()
 
 
@@ -22,15 +28,23 @@
 
 #define PG3_CONFIGURATION           0x00
 #define PG3_GLOBAL_CURRENT          0x01
+#define PG3_ABM_CONTROL(abm)        (0x02 + 4 * ((abm) - 1))  // 4 registers per ABM
+#define PG3_TIME_UPDATE             0x0E
 #define PG3_SW_PULL_UP              0x0F
 #define PG3_CS_PULL_DOWN            0x10
 #define PG3_RESET                   0x11
 
+#define CONFIGURATION_B_EN          0x02  // Enable auto breath mode.
+#define CONFIGURATION_SSD           0x01  // Normal operation if set; otherwise shutdown
+
 
 
 // Power-up default state for command register is 0.
 uint8_t g_command_register[DRIVER_COUNT];
 
+// Bits of the PG3 Configuration register other than SYNC, which is fixed per driver
+static uint8_t _configuration;
+
 // PG0 LED on/off registers (initialized with all 0's)
 uint8_t g_led_on_off_registers[DRIVER_COUNT][LED_CONTROL_REGISTER_COUNT];
 
@@ -42,6 +56,26 @@ uint8_t g_pwm_registers_need_update[DRIVER_COUNT][PWM_REGISTER_COUNT / 8]
 static_assert( PWM_REGISTER_COUNT % 8 == 0 );
 static_assert( sizeof(g_pwm_registers_need_update) % sizeof(uint32_t) == 0 );
 
+// Snapshot of the PWM registers and their update flags, which the refresh thread takes
+// at the start of each transfer for is31_refresh_colors_async(), with IRQs disabled as
+// is31_set_color() updates them
+static uint8_t _pwm_snapshot[DRIVER_COUNT][PWM_REGISTER_COUNT];
+static uint8_t _pwm_snapshot_need_update[DRIVER_COUNT][PWM_REGISTER_COUNT / 8]
+    __attribute__((aligned(sizeof(uint32_t))));
+
+// Counters of the refreshes, accumulated since boot
+static is31_pwm_stats_t _pwm_stats;
+
+#define FLAG_REFRESH                0x0001
+
+static thread_t* _refresh_pthread;
+static char _refresh_thread_stack[IS31_STACKSIZE] __attribute__((aligned(8)));
+static NORETURN void* _refresh_thread_entry(void* arg);
+
+// Callback for the next transfer, given by is31_refresh_colors_async()
+static is31_refresh_cb_t _refresh_cb;
+static void* _refresh_cb_arg;
+
 
 
 // If transfer fails function returns false.
@@ -85,56 +119,77 @@ static void _is31_write_led_on_off_registers(unsigned driver)
         0, g_led_on_off_registers[driver], sizeof(g_led_on_off_registers[0]));
 }
 
-static void _is31_write_pwm_registers(unsigned driver)
+// Cost of an I2C write transaction apart from its data, in units of a byte on the bus:
+// the START and STOP, the address and register bytes, and setting up the two
+// i2c_write_bytes() calls with DMA (~10 us, or ~1 byte at 1 MHz).
+#define TXN_OVERHEAD_BYTES          5
+
+typedef struct {
+    uint8_t start;
+    uint8_t count;
+} pwm_run_t;
+
+// Plan the runs of PWM registers to write for the flags in need_update[], returning
+// the number of runs. With `coalesce`, a run is extended over the clean registers up to
+// the next one if rewriting them costs less than a new transaction. As the cost adds up
+// gap by gap, this also yields a single burst (up to all PWM_REGISTER_COUNT registers)
+// whenever that is the cheapest.
+static unsigned _plan_pwm_runs(
+    const uint8_t need_update[], bool coalesce, pwm_run_t runs[])
 {
-#ifndef MODULE_PERIPH_DMA
-#   error _is31_write_pwm_registers() is implemented only with MODULE_PERIPH_DMA enabled.
-#endif
-    _is31_set_command_register(driver, SEL_PG1_PWM);
-
-    const uint8_t addr = DRIVER_ADDR[driver];
-    unsigned reg_start = 0;       // Starting register index for batch write
-    unsigned reg_count = 0;       // Number of consecutive pwm registers to update
-    bool needs_new_block = true;  // Indicates if a new block should begin
+    const unsigned max_gap = coalesce ? TXN_OVERHEAD_BYTES - 1 : 0;
+    unsigned n = 0;
 
     // Process 32-bit flag blocks.
-    for ( unsigned i = 0 ; i < sizeof(g_pwm_registers_need_update[0]) ; i += 4 ) {
-        uint32_t flags = *(uint32_t*)(void*)&g_pwm_registers_need_update[driver][i];
-        *(uint32_t*)(void*)&g_pwm_registers_need_update[driver][i] = 0;
-
-        unsigned bits = 0;  // Number of bits processed in this chunk
+    for ( unsigned i = 0 ; i < PWM_REGISTER_COUNT / 8 ; i += 4 ) {
+        uint32_t flags = *(const uint32_t*)(const void*)&need_update[i];
+        unsigned reg = i * 8;
         while ( flags ) {
             // Skip zeros.
             const unsigned zeros = __builtin_ctz(flags);
             flags >>= zeros;
-            bits += zeros;
-
-            if ( zeros > 0 || needs_new_block ) {
-                // Start of a new block — write the previous block first.
-                if ( reg_count > 0 ) {
-                    _is31_write_registers(addr,
-                        reg_start, &g_pwm_registers[driver][reg_start], reg_count);
-                    reg_count = 0;
-                }
-                reg_start = i * 8 + bits;
-            }
+            reg += zeros;
 
             // Count consecutive '1's.
             const unsigned ones = unlikely(flags == ~0u) ? 32 : __builtin_ctz(~flags);
-            flags >>= ones;
-            bits += ones;
-            reg_count += ones;
+            flags = ones < 32 ? flags >> ones : 0;
+
+            // Runs adjacent across the blocks are always joined.
+            if ( n > 0 && reg - (runs[n - 1].start + runs[n - 1].count) <= max_gap )
+                runs[n - 1].count = reg + ones - runs[n - 1].start;
+            else
+                runs[n++] = (pwm_run_t){ reg, ones };
+            reg += ones;
         }
-
-        // If we exited early (not all 32 bits were processed), a new block is needed
-        // next.
-        needs_new_block = (bits < 32);
     }
+    return n;
+}
+
+// Write out the PWM registers flagged in need_update[], clearing the flags. They are
+// either the live g_pwm_registers[] or the snapshot of them.
+static void _is31_write_pwm_registers(unsigned driver,
+    const uint8_t pwm_registers[], uint8_t need_update[], bool coalesce,
+    is31_pwm_stats_t* stats)
+{
+#ifndef MODULE_PERIPH_DMA
+#   error _is31_write_pwm_registers() is implemented only with MODULE_PERIPH_DMA enabled.
+#endif
+    // At most one run for every other register
+    pwm_run_t runs[PWM_REGISTER_COUNT / 2];
+    const unsigned n = _plan_pwm_runs(need_update, coalesce, runs);
+    __builtin_memset(need_update, 0, PWM_REGISTER_COUNT / 8);
+    if ( n == 0 )
+        return;
+
+    _is31_set_command_register(driver, SEL_PG1_PWM);
 
-    // Handle any remaining unwritten block at the end.
-    if ( reg_count > 0 )
+    const uint8_t addr = DRIVER_ADDR[driver];
+    for ( unsigned i = 0 ; i < n ; i++ ) {
         _is31_write_registers(addr,
-            reg_start, &g_pwm_registers[driver][reg_start], reg_count);
+            runs[i].start, &pwm_registers[runs[i].start], runs[i].count);
+        stats->bus_bytes += 2 + runs[i].count;  // The address and register bytes first
+    }
+    stats->transactions += n;
 }
 
 // Read reset register to intialize all registers to their default values, so Control
@@ -146,6 +201,7 @@ static void _is31_reset_registers(unsigned driver)
     _is31_read_register(DRIVER_ADDR[driver], PG3_RESET, &tmp);
 
     g_command_register[driver] = SEL_PG0_LED_CONTROL;  // power-up default
+    _configuration = 0;
     __builtin_memset(g_led_on_off_registers[driver], 0,
         sizeof(g_led_on_off_registers[0]));
     __builtin_memset(g_pwm_registers[driver], 0, sizeof(g_pwm_registers[0]));
@@ -188,22 +244,36 @@ void is31_init(void)
 
     // Wait 1 ms to ensure the device has woken up.
     // ztimer_sleep(ZTIMER_MSEC, 1);
+
+    _refresh_pthread = thread_get_unchecked( thread_create(
+        _refresh_thread_stack, sizeof(_refresh_thread_stack),
+        THREAD_PRIO_IS31,
+        THREAD_CREATE_STACKTEST,
+        _refresh_thread_entry, NULL, "is31_thread") );
 }
 
-void is31_set_ssd_lock(bool enable)
+// Write _configuration into the Configuration registers. Called with I2C acquired.
+static void _is31_write_configuration(void)
 {
-    const bool ssd_bit = !enable;
-    i2c_acquire(I2C);
     for ( unsigned driver = 0 ; driver < DRIVER_COUNT ; driver++ ) {
         _is31_set_command_register(driver, SEL_PG3_FUNCTION);
-
-        // If the SSD bit in the PG3 Configuration Register is set to 0, the IS31FL3733
-        // enters Software Shutdown mode. Set the SSD bit to 1 for normal operation.
         _is31_write_register(DRIVER_ADDR[driver], PG3_CONFIGURATION,
             // Use sync = 1 (master clock mode) for DRIVER_ADDR[0], or 2 (clock slave
             // mode) otherwise.
-            ((uint8_t)(1 + (driver != 0)) << 6) | ssd_bit);
+            ((uint8_t)(1 + (driver != 0)) << 6) | _configuration);
     }
+}
+
+void is31_set_ssd_lock(bool enable)
+{
+    i2c_acquire(I2C);
+    // If the SSD bit in the PG3 Configuration Register is set to 0, the IS31FL3733
+    // enters Software Shutdown mode. Set the SSD bit to 1 for normal operation.
+    if ( enable )
+        _configuration &= ~CONFIGURATION_SSD;
+    else
+        _configuration |= CONFIGURATION_SSD;
+    _is31_write_configuration();
     i2c_release(I2C);
 }
 
@@ -239,6 +309,73 @@ void is31_enable_all_leds(bool enable)
     i2c_release(I2C);
 }
 
+void is31_abm_configure(is31_abm_t abm, const is31_abm_timing_t* timing)
+{
+    assert( abm >= IS31_ABM_1 && abm <= IS31_ABM_3 );
+    assert( timing->t1_rise <= 7 && timing->t2_on <= 8 );
+    assert( timing->t3_fall <= 7 && timing->t4_off <= 8 );
+    assert( timing->loops <= 0xFFF );
+
+    uint8_t control[] = {
+        (uint8_t)(timing->t1_rise << 5 | timing->t2_on << 1),
+        (uint8_t)(timing->t3_fall << 5 | timing->t4_off << 1),
+        // LE (loop end) is 1 to stop at the end of T2, or 0 at the end of T4.
+        (uint8_t)((timing->end_on ? 0x10 : 0) | timing->loops >> 8),
+        (uint8_t)timing->loops
+    };
+
+    i2c_acquire(I2C);
+    if ( !(_configuration & CONFIGURATION_B_EN) ) {
+        // The LEDs not assigned to an ABM keep following their PWM registers.
+        _configuration |= CONFIGURATION_B_EN;
+        _is31_write_configuration();
+    }
+    for ( unsigned driver = 0 ; driver < DRIVER_COUNT ; driver++ ) {
+        _is31_set_command_register(driver, SEL_PG3_FUNCTION);
+        _is31_write_registers(DRIVER_ADDR[driver],
+            PG3_ABM_CONTROL(abm), control, sizeof(control));
+    }
+    i2c_release(I2C);
+}
+
+void is31_abm_assign(const is31_led_t leds[], size_t n, is31_abm_t abm)
+{
+    i2c_acquire(I2C);
+    for ( size_t i = 0 ; i < n ; i++ ) {
+        const unsigned driver = leds[i].driver;
+        _is31_set_command_register(driver, SEL_PG2_AUTO_BREATH);
+
+        // PG2 registers are laid out as PG1 (PWM) registers, one per dot.
+        uint8_t reg = leds[i].reg_g;
+        for ( int j = 0 ; j < 3 ; j++, reg += CS_LINE_COUNT )  // Traverse reg_g/r/b.
+            _is31_write_register(DRIVER_ADDR[driver], reg, abm);
+    }
+    i2c_release(I2C);
+}
+
+void is31_abm_start(void)
+{
+    i2c_acquire(I2C);
+    for ( unsigned driver = 0 ; driver < DRIVER_COUNT ; driver++ ) {
+        _is31_set_command_register(driver, SEL_PG3_FUNCTION);
+        _is31_write_register(DRIVER_ADDR[driver], PG3_TIME_UPDATE, 0);
+    }
+    i2c_release(I2C);
+}
+
+void is31_abm_reset(void)
+{
+    // Nothing to do unless is31_abm_configure() has been called.
+    if ( !(_configuration & CONFIGURATION_B_EN) )
+        return;
+
+    is31_abm_assign(IS31_LEDS, ALL_LED_COUNT, IS31_ABM_NONE);
+    i2c_acquire(I2C);
+    _configuration &= ~CONFIGURATION_B_EN;
+    _is31_write_configuration();
+    i2c_release(I2C);
+}
+
 static void _update_g_pwm_register(unsigned driver, uint8_t reg, uint8_t data)
 {
     if ( g_pwm_registers[driver][reg] != data ) {
@@ -254,17 +391,81 @@ void is31_set_color(is31_led_t led, uint8_t red, uint8_t green, uint8_t blue)
     const uint8_t reg_r = reg_g + CS_LINE_COUNT;
     const uint8_t reg_b = reg_r + CS_LINE_COUNT;
 
+    // is31_thread, at a higher priority than the callers, must not snapshot the LED
+    // halfway.
+    unsigned state = irq_disable();
     _update_g_pwm_register(driver, reg_g, green);
     _update_g_pwm_register(driver, reg_r, red);
     _update_g_pwm_register(driver, reg_b, blue);
+    irq_restore(state);
 }
 
-void is31_refresh_colors(void)
+// Write out the flagged PWM registers of both drivers, updating the counters. Called
+// with I2C acquired.
+static void _is31_refresh(uint8_t pwm_registers[][PWM_REGISTER_COUNT],
+    uint8_t need_update[][PWM_REGISTER_COUNT / 8], bool coalesce,
+    is31_pwm_stats_t* stats)
 {
-    i2c_acquire(I2C);
+    const uint32_t transactions = stats->transactions;
+    const uint32_t start = get_cycle_count();
     for ( unsigned driver = 0 ; driver < DRIVER_COUNT ; driver++ )
-        _is31_write_pwm_registers(driver);
-    i2c_release(I2C);
+        _is31_write_pwm_registers(driver,
+            pwm_registers[driver], need_update[driver], coalesce, stats);
+
+    if ( stats->transactions != transactions ) {
+        stats->refreshes++;
+        stats->busy_us += (get_cycle_count() - start) / (CLOCK_CORECLOCK / US_PER_SEC);
+    }
+}
+
+void is31_refresh_colors_async(is31_refresh_cb_t cb, void* arg)
+{
+    if ( cb != NULL ) {
+        unsigned state = irq_disable();
+        _refresh_cb = cb;
+        _refresh_cb_arg = arg;
+        irq_restore(state);
+    }
+
+    // If a transfer is in progress, the flag stays set until it completes, so that all
+    // calls made meanwhile are served by a single next transfer.
+    thread_flags_set(_refresh_pthread, FLAG_REFRESH);
+}
+
+static NORETURN void* _refresh_thread_entry(void* arg)
+{
+    (void)arg;
+
+    while ( true ) {
+        thread_flags_wait_any(FLAG_REFRESH);  // Zzz
+
+        unsigned state = irq_disable();
+        const is31_refresh_cb_t cb = _refresh_cb;
+        void* const cb_arg = _refresh_cb_arg;
+        _refresh_cb = NULL;
+        irq_restore(state);
+
+        i2c_acquire(I2C);
+
+        // Take the snapshot. A call to is31_set_color() that this thread preempted
+        // holds off the snapshot until it returns, so it reflects whole calls only.
+        state = irq_disable();
+        __builtin_memcpy(_pwm_snapshot_need_update, g_pwm_registers_need_update,
+            sizeof(_pwm_snapshot_need_update));
+        __builtin_memset(g_pwm_registers_need_update, 0,
+            sizeof(g_pwm_registers_need_update));
+        __builtin_memcpy(_pwm_snapshot, g_pwm_registers, sizeof(_pwm_snapshot));
+        irq_restore(state);
+
+        // The transactions (page select, then the runs of flagged registers) go out
+        // back to back, while this thread sleeps on each DMA transfer.
+        _is31_refresh(_pwm_snapshot, _pwm_snapshot_need_update, true, &_pwm_stats);
+
+        i2c_release(I2C);
+
+        if ( cb != NULL )
+            cb(cb_arg);
+    }
 }
 
 void is31_set_gcr(uint8_t gcr)
@@ -276,3 +477,24 @@ void is31_set_gcr(uint8_t gcr)
     }
     i2c_release(I2C);
 }
+
+void is31_get_pwm_stats(is31_pwm_stats_t* stats)
+{
+    unsigned state = irq_disable();
+    *stats = _pwm_stats;
+    irq_restore(state);
+}
+
+void is31_benchmark_pwm_refresh(
+    const uint8_t need_update[][PWM_REGISTER_COUNT / 8], bool coalesce,
+    is31_pwm_stats_t* stats)
+{
+    uint8_t flags[DRIVER_COUNT][PWM_REGISTER_COUNT / 8]
+        __attribute__((aligned(sizeof(uint32_t))));
+    __builtin_memcpy(flags, need_update, sizeof(flags));
+
+    // Rewriting the current values does not change the colors.
+    i2c_acquire(I2C);
+    _is31_refresh(g_pwm_registers, flags, coalesce, stats);
+    i2c_release(I2C);
+}
@@ -0,0 +1,505 @@
+#include "assert.h"
+#include "board.h"              // for get_cycle_count(), CLOCK_CORECLOCK
+#include "nvm_stream.h"
+#include "time_units.h"         // for US_PER_SEC, US_PER_MS
+
+
+
+// Rough durations of NVM commands, used only to tell the host how long to wait before
+// asking again. They are taken on the low side, since the host simply asks again if the
+// NVM is still busy, whereas an overestimate would stall the download.
+#define PAGE_WRITE_US           1000
+#define BLOCK_ERASE_US          10000
+
+#define NVM_ERRORS  (NVMCTRL_INTFLAG_ADDRE | NVMCTRL_INTFLAG_PROGE \
+                   | NVMCTRL_INTFLAG_LOCKE | NVMCTRL_INTFLAG_NVME)
+
+#define PAGE_WORDS              (NVM_STREAM_PAGE_SIZE / sizeof(uint32_t))
+#define QWORD_WORDS             (NVM_STREAM_QWORD_SIZE / sizeof(uint32_t))
+
+
+
+static inline bool _is_ready(void)
+{
+    return NVMCTRL->STATUS.bit.READY;
+}
+
+static inline void _wait_ready(void)
+{
+    while ( !NVMCTRL->STATUS.bit.READY ) {}
+}
+
+static inline uint32_t _block_of(uint32_t addr)
+{
+    return addr & ~(NVM_STREAM_BLOCK_SIZE - 1);
+}
+
+// Unlike NVMCTRL_CMD() in seeprom.c, this returns without waiting for the command to
+// complete.
+static void _issue(nvm_stream_t* stream, uint16_t cmd, uint32_t addr)
+{
+    // Clear the PAC write lock on NVMCTRL (See NVMCTRL_CMD() in seeprom.c).
+    PAC->WRCTRL.reg = (PAC_WRCTRL_KEY_CLR | ID_NVMCTRL);
+
+    NVMCTRL->ADDR.reg = addr;
+    NVMCTRL->INTFLAG.reg = NVMCTRL_INTFLAG_DONE;
+    NVMCTRL->CTRLB.reg = cmd | NVMCTRL_CTRLB_CMDEX_KEY;
+    stream->cmd = cmd;
+    stream->cmd_start = get_cycle_count();
+}
+
+// In manual write mode, writes to the NVM address space fill the page buffer instead.
+static void _load_page_buffer(uint32_t addr, const uint32_t* words, size_t count)
+{
+    volatile uint32_t* const p = (volatile uint32_t*)addr;
+    for ( size_t i = 0 ; i < count ; i++ )
+        p[i] = words[i];
+}
+
+// Program the page at `addr` with the words. The NVM should be ready and the page
+// erased.
+static void _program_page(nvm_stream_t* stream, uint32_t addr, const uint32_t* words)
+{
+    if ( addr == stream->start ) {
+        // Keep the first quad-word for nvm_stream_finish(), and write the rest of the
+        // first page quad-word by quad-word, since a quad-word cannot be programmed
+        // twice. This blocks, but only for the first page.
+        __builtin_memcpy(stream->first_qword, words, NVM_STREAM_QWORD_SIZE);
+        for ( size_t i = QWORD_WORDS ; i < PAGE_WORDS ; i += QWORD_WORDS ) {
+            _wait_ready();
+            _load_page_buffer(addr + i * sizeof(uint32_t), &words[i], QWORD_WORDS);
+            _issue(stream, NVMCTRL_CTRLB_CMD_WQW, addr + i * sizeof(uint32_t));
+        }
+    }
+    else {
+        _load_page_buffer(addr, words, PAGE_WORDS);
+        _issue(stream, NVMCTRL_CTRLB_CMD_WP, addr);
+    }
+}
+
+static bool _is_blank(const uint32_t* words)
+{
+    for ( size_t i = 0 ; i < PAGE_WORDS ; i++ )
+        if ( words[i] != 0xffffffff )
+            return false;
+    return true;
+}
+
+// Estimated time in us for the NVM command in progress to complete
+static uint32_t _remaining_us(const nvm_stream_t* stream)
+{
+    if ( _is_ready() )
+        return 0;
+
+    const uint32_t expected_us =
+        stream->cmd == NVMCTRL_CTRLB_CMD_EB ? BLOCK_ERASE_US : PAGE_WRITE_US;
+    const uint32_t elapsed_us =
+        (get_cycle_count() - stream->cmd_start) / (CLOCK_CORECLOCK / US_PER_SEC);
+    return elapsed_us < expected_us ? expected_us - elapsed_us : 0;
+}
+
+static void _start(nvm_stream_t* stream, uint32_t start, size_t size)
+{
+    assert( start % NVM_STREAM_BLOCK_SIZE == 0 && size % NVM_STREAM_BLOCK_SIZE == 0 );
+
+    __builtin_memset(stream, 0, sizeof(nvm_stream_t));
+    stream->start = start;
+    stream->end = start + size;
+    stream->addr = start;
+    stream->erased_end = start;
+    __builtin_memset(stream->first_qword, 0xff, sizeof(stream->first_qword));
+
+    _wait_ready();
+    PAC->WRCTRL.reg = (PAC_WRCTRL_KEY_CLR | ID_NVMCTRL);
+    stream->ctrla = NVMCTRL->CTRLA.reg;
+    NVMCTRL->CTRLA.reg = (stream->ctrla & ~NVMCTRL_CTRLA_WMODE_Msk)
+                       | NVMCTRL_CTRLA_WMODE_MAN;
+    NVMCTRL->INTFLAG.reg = NVM_ERRORS;
+}
+
+// The cache may still hold the old contents of the region.
+static void _invalidate_cache(void)
+{
+    if ( CMCC->SR.bit.CSTS ) {
+        CMCC->CTRL.bit.CEN = 0;
+        while ( CMCC->SR.bit.CSTS ) {}
+        CMCC->MAINT0.bit.INVALL = 1;
+        CMCC->CTRL.bit.CEN = 1;
+    }
+}
+
+static void _end(nvm_stream_t* stream)
+{
+    _wait_ready();
+    PAC->WRCTRL.reg = (PAC_WRCTRL_KEY_CLR | ID_NVMCTRL);
+    NVMCTRL->CTRLA.reg = stream->ctrla;
+    stream->end = 0;
+    stream->is_held = false;
+    _invalidate_cache();
+}
+
+// Table-driven, 4 bits at a time, trading speed for a 64-byte table.
+uint32_t nvm_stream_crc32(uint32_t crc, const void* data, size_t len)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+        0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+    };
+
+    const uint8_t* p = (const uint8_t*)data;
+    crc = ~crc;
+    while ( len-- > 0 ) {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ table[crc & 0x0f];
+        crc = (crc >> 4) ^ table[crc & 0x0f];
+    }
+    return ~crc;
+}
+
+
+
+// Diffing ------------------------------------------------------------------------------
+
+// The first block goes to the first buffer, and the others alternate between the other
+// two buffers, each paired with a job.
+
+static inline size_t _block_index(const nvm_stream_t* stream, uint32_t addr)
+{
+    return (addr - stream->start) / NVM_STREAM_BLOCK_SIZE;
+}
+
+static uint8_t* _block_buf(const nvm_stream_t* stream, uint32_t addr)
+{
+    const size_t index = _block_index(stream, addr);
+    return &stream->diff_buf[index == 0 ? 0 : (1 + (index & 1)) * NVM_STREAM_BLOCK_SIZE];
+}
+
+// Compare the block just received with the flash, and schedule its writing if changed.
+static void _close_block(nvm_stream_t* stream)
+{
+    uint8_t* const buf = _block_buf(stream, stream->addr);
+    const size_t size = (stream->fill + NVM_STREAM_PAGE_SIZE - 1)
+                      & ~(NVM_STREAM_PAGE_SIZE - 1);
+
+    // Pad the last block as it would be after erasing, so that the old contents past
+    // the end of the image do not survive in an unchanged block.
+    __builtin_memset(&buf[stream->fill], 0xff, NVM_STREAM_BLOCK_SIZE - stream->fill);
+
+    // Reading the bank while the NVM is busy would stall the bus, holding off
+    // interrupts as well.
+    _wait_ready();
+    if ( __builtin_memcmp(buf, (const void*)stream->addr, NVM_STREAM_BLOCK_SIZE) == 0 )
+        stream->skipped += size / NVM_STREAM_PAGE_SIZE;
+
+    else {
+        // Invalidate the image first (See nvm_stream_begin_diff()).
+        if ( !stream->is_changed ) {
+            stream->is_changed = true;
+            stream->erase_first = true;
+            // The first block, found unchanged, is rewritten after all.
+            if ( stream->addr != stream->start )
+                stream->skipped -= NVM_STREAM_BLOCK_SIZE / NVM_STREAM_PAGE_SIZE;
+        }
+
+        // The first block is written by nvm_stream_finish().
+        if ( stream->addr != stream->start ) {
+            nvm_stream_job_t* const job =
+                &stream->jobs[_block_index(stream, stream->addr) & 1];
+            job->src = buf;
+            job->addr = stream->addr;
+            job->end = stream->addr + size;
+            job->erase = true;
+        }
+    }
+
+    stream->addr += NVM_STREAM_BLOCK_SIZE;
+    stream->fill = 0;
+}
+
+static void _poll_diff(nvm_stream_t* stream)
+{
+    if ( stream->erase_first ) {
+        _issue(stream, NVMCTRL_CTRLB_CMD_EB, stream->start);
+        stream->erase_first = false;
+        return;
+    }
+
+    // Take the older job first.
+    nvm_stream_job_t* job = &stream->jobs[0];
+    if ( job->end == 0 || (stream->jobs[1].end != 0 && stream->jobs[1].addr < job->addr) )
+        job = &stream->jobs[1];
+
+    while ( job->end != 0 ) {
+        if ( job->erase ) {
+            _issue(stream, NVMCTRL_CTRLB_CMD_EB, job->addr);
+            job->erase = false;
+            return;
+        }
+
+        const uint32_t* const words = (const uint32_t*)
+            &job->src[job->addr & (NVM_STREAM_BLOCK_SIZE - 1)];
+        const uint32_t addr = job->addr;
+        job->addr += NVM_STREAM_PAGE_SIZE;
+        if ( job->addr >= job->end )
+            job->end = 0;
+
+        // Erased pages are left as they are.
+        if ( !_is_blank(words) ) {
+            _program_page(stream, addr, words);
+            return;
+        }
+    }
+}
+
+
+
+// Streaming ----------------------------------------------------------------------------
+
+void nvm_stream_begin(nvm_stream_t* stream, uint32_t start, size_t size)
+{
+    _start(stream, start, size);
+    nvm_stream_poll(stream);  // Start erasing the first block.
+}
+
+void nvm_stream_begin_diff(nvm_stream_t* stream, uint32_t start, size_t size,
+    void* buf)
+{
+    _start(stream, start, size);
+    stream->diff_buf = (uint8_t*)buf;
+}
+
+void nvm_stream_begin_held(nvm_stream_t* stream, uint32_t start, size_t size)
+{
+    _start(stream, start, size);
+    stream->is_held = true;
+}
+
+void nvm_stream_start_diff(nvm_stream_t* stream, void* buf)
+{
+    if ( stream->is_held ) {
+        // The bytes held are within the first page, and thus the first block.
+        __builtin_memcpy(buf, stream->page_buf, stream->fill);
+        stream->diff_buf = (uint8_t*)buf;
+        stream->is_held = false;
+    }
+}
+
+int nvm_stream_poll(nvm_stream_t* stream)
+{
+    if ( stream->is_held || !_is_ready() )
+        return 0;
+    if ( NVMCTRL->INTFLAG.reg & NVM_ERRORS )
+        return -1;
+
+    if ( stream->diff_buf )
+        _poll_diff(stream);
+
+    // The page in RAM comes first, as the host may be waiting for it to be written.
+    else if ( stream->fill == NVM_STREAM_PAGE_SIZE
+      && stream->addr + NVM_STREAM_PAGE_SIZE <= stream->erased_end ) {
+        _program_page(stream, stream->addr, stream->page_buf);
+        stream->addr += NVM_STREAM_PAGE_SIZE;
+        stream->fill = 0;
+    }
+
+    // Otherwise, erase ahead so that the block following the current one is ready by
+    // the time the pages reach it.
+    else if ( stream->erased_end < stream->end
+      && stream->erased_end < _block_of(stream->addr) + 2 * NVM_STREAM_BLOCK_SIZE ) {
+        _issue(stream, NVMCTRL_CTRLB_CMD_EB, stream->erased_end);
+        stream->erased_end += NVM_STREAM_BLOCK_SIZE;
+    }
+
+    return 0;
+}
+
+// Return true if the writer cannot accept bytes until the NVM makes progress.
+static bool _is_full(const nvm_stream_t* stream)
+{
+    if ( stream->diff_buf )
+        // The buffer for the next block may still be in use by its job.
+        return stream->fill == 0 && stream->addr != stream->start
+            && stream->jobs[_block_index(stream, stream->addr) & 1].end != 0;
+    return stream->fill == NVM_STREAM_PAGE_SIZE;
+}
+
+int nvm_stream_write(nvm_stream_t* stream, const uint8_t* data, size_t len)
+{
+    const size_t buf_size =
+        stream->diff_buf ? NVM_STREAM_BLOCK_SIZE : NVM_STREAM_PAGE_SIZE;
+
+    while ( len > 0 ) {
+        while ( _is_full(stream) )
+            if ( stream->is_held || nvm_stream_poll(stream) != 0 )
+                return -1;
+
+        if ( stream->addr >= stream->end )
+            return -1;
+
+        uint8_t* const buf = stream->diff_buf
+            ? _block_buf(stream, stream->addr) : (uint8_t*)stream->page_buf;
+        size_t size = buf_size - stream->fill;
+        if ( size > len )
+            size = len;
+        __builtin_memcpy(&buf[stream->fill], data, size);
+        stream->fill += size;
+        stream->size += size;
+        data += size;
+        len -= size;
+
+        if ( stream->diff_buf && stream->fill == NVM_STREAM_BLOCK_SIZE )
+            _close_block(stream);
+    }
+
+    return nvm_stream_poll(stream);
+}
+
+bool nvm_stream_would_block(const nvm_stream_t* stream, size_t len)
+{
+    assert( stream->diff_buf == NULL );
+
+    // The bytes fit in the page buffer, or the full page can be handed over to the NVM
+    // right away.
+    return _is_full(stream) || (stream->fill + len > NVM_STREAM_PAGE_SIZE
+        && (!_is_ready() || stream->addr + NVM_STREAM_PAGE_SIZE > stream->erased_end));
+}
+
+uint32_t nvm_stream_busy_ms(const nvm_stream_t* stream)
+{
+    if ( !_is_full(stream) )
+        return 0;
+
+    // The buffer is waiting for the command in progress, or for the pages left in the
+    // job if diffing.
+    uint32_t us = _remaining_us(stream);
+    if ( stream->diff_buf ) {
+        const nvm_stream_job_t* const job =
+            &stream->jobs[_block_index(stream, stream->addr) & 1];
+        us += (job->end - job->addr) / NVM_STREAM_PAGE_SIZE * PAGE_WRITE_US;
+        if ( job->erase )
+            us += BLOCK_ERASE_US;
+    }
+    return us == 0 ? 1 : (us + US_PER_MS - 1) / US_PER_MS;
+}
+
+// Write out the remaining bytes, except for the first quad-word.
+static int _flush(nvm_stream_t* stream)
+{
+    if ( stream->is_held )
+        return -1;
+
+    if ( stream->diff_buf ) {
+        if ( stream->fill > 0 )
+            _close_block(stream);
+        while ( stream->erase_first || stream->jobs[0].end || stream->jobs[1].end )
+            if ( nvm_stream_poll(stream) != 0 )
+                return -1;
+
+        // Write the first block, which was erased when the first change was found.
+        if ( stream->is_changed ) {
+            const uint32_t end = stream->start + (stream->size < NVM_STREAM_BLOCK_SIZE
+                ? stream->size : NVM_STREAM_BLOCK_SIZE);
+            for ( uint32_t addr = stream->start ; addr < end ;
+                  addr += NVM_STREAM_PAGE_SIZE ) {
+                const uint32_t* const words =
+                    (const uint32_t*)&stream->diff_buf[addr - stream->start];
+                _wait_ready();
+                if ( !_is_blank(words) )
+                    _program_page(stream, addr, words);
+            }
+        }
+    }
+
+    // Write the last page, padded with 0xff.
+    else if ( stream->fill > 0 ) {
+        __builtin_memset((uint8_t*)stream->page_buf + stream->fill, 0xff,
+            NVM_STREAM_PAGE_SIZE - stream->fill);
+        stream->fill = NVM_STREAM_PAGE_SIZE;
+        while ( stream->fill == NVM_STREAM_PAGE_SIZE )
+            if ( nvm_stream_poll(stream) != 0 )
+                return -1;
+    }
+
+    _wait_ready();
+    _invalidate_cache();
+    return (NVMCTRL->INTFLAG.reg & NVM_ERRORS) ? -1 : 0;
+}
+
+// The first quad-word is yet to be written, unless the first block is unchanged.
+static bool _is_first_pending(const nvm_stream_t* stream)
+{
+    return stream->size > 0 && (!stream->diff_buf || stream->is_changed);
+}
+
+// Write the first quad-word, completing the image.
+static int _commit(nvm_stream_t* stream)
+{
+    if ( _is_first_pending(stream) ) {
+        _load_page_buffer(stream->start, stream->first_qword, QWORD_WORDS);
+        _issue(stream, NVMCTRL_CTRLB_CMD_WQW, stream->start);
+        _wait_ready();
+    }
+    return (NVMCTRL->INTFLAG.reg & NVM_ERRORS) ? -1 : 0;
+}
+
+static int _finish(nvm_stream_t* stream, const uint32_t* crc)
+{
+    if ( stream->end == 0 )
+        return -1;
+
+    int result = _flush(stream);
+
+    // Verify the image read back from the flash, before completing it.
+    if ( result == 0 && crc ) {
+        const size_t head = stream->size < NVM_STREAM_QWORD_SIZE
+            ? stream->size : NVM_STREAM_QWORD_SIZE;
+        const uint8_t* const flash = (const uint8_t*)stream->start;
+        uint32_t actual = nvm_stream_crc32(0, _is_first_pending(stream)
+            ? (const uint8_t*)stream->first_qword : flash, head);
+        actual = nvm_stream_crc32(actual, flash + head, stream->size - head);
+        if ( actual != *crc )
+            result = -1;
+    }
+
+    if ( result == 0 )
+        result = _commit(stream);
+
+    _end(stream);
+    return result;
+}
+
+int nvm_stream_finish(nvm_stream_t* stream)
+{
+    return _finish(stream, NULL);
+}
+
+int nvm_stream_finish_crc(nvm_stream_t* stream, uint32_t crc)
+{
+    return _finish(stream, &crc);
+}
+
+int nvm_stream_flush(nvm_stream_t* stream)
+{
+    if ( stream->end == 0 || _flush(stream) != 0 ) {
+        nvm_stream_abort(stream);
+        return -1;
+    }
+    return 0;
+}
+
+int nvm_stream_commit(nvm_stream_t* stream)
+{
+    if ( stream->end == 0 )
+        return -1;
+    const int result = _commit(stream);
+    _end(stream);
+    return result;
+}
+
+void nvm_stream_abort(nvm_stream_t* stream)
+{
+    if ( stream->end != 0 )
+        _end(stream);
+}
@@ -21,9 +21,28 @@ static_assert( !ENABLE_LUA_REPL || ENABLE_CDC_ACM );
 
 constexpr bool ENABLE_NKRO = true;
 
+// Vendor-defined raw HID interface (64-byte reports) serving the RPC protocol for host
+// tooling (see ./darpc). It works without CDC ACM drivers on the host.
+constexpr bool ENABLE_RAW_HID = true;
+
+// Polling interval of the raw HID endpoints, giving one RPC round trip per this period.
+constexpr uint8_t RAW_HID_INTERVAL_MS = 1;
+
+// The raw HID upload of Lua bytecode is given up if no request arrives for this period
+// (e.g. the host tool died), since the keyboard cannot be used during the upload.
+constexpr uint32_t RAW_HID_UPLOAD_TIMEOUT_MS = 2000;
+
 // Enable RGB LEDs. Note that `false` will also disable keyboard indicator lamps.
 constexpr bool ENABLE_RGB_LED = true;
 
+// Enable the native LED effects (See effects/effects.cpp) rendered in effects_thread at
+// this frame period, which Lua starts with fw.effect_start().
+constexpr bool ENABLE_NATIVE_EFFECTS = true;
+constexpr uint32_t EFFECTS_FRAME_PERIOD_MS = 17;  // ~60 fps
+
+// ENABLE_NATIVE_EFFECTS requires ENABLE_RGB_LED.
+static_assert( !ENABLE_NATIVE_EFFECTS || ENABLE_RGB_LED );
+
 // Periodic interval for reporting keyboard state change to the host. Updates occur at
 // this rate (recommended range: 1–10 ms). In Boot protocol mode, this setting is
 // overridden and set to 10 ms.
@@ -64,6 +83,49 @@ constexpr uint8_t RGB_LED_GCR_MAX = 255;
 // GCR changes slowly and gracefully, changing 1 GCR per this time period.
 constexpr uint32_t RGB_GCR_CHANGE_PERIOD_MS = 32;
 
+// wTransferSize of DFU: the maximum number of bytes the device can accept per Control
+// transfer (1-65535). Larger transfers take fewer round trips of DFU_DNLOAD and
+// DFU_GETSTATUS, speeding up `./daflash` and `./dadownload`. However, the first block
+// arrives while Lua still runs from the slot being written, and is held in the page
+// buffer of nvm_stream until DFU mode, so this is limited to NVM_STREAM_PAGE_SIZE.
+constexpr uint16_t DFU_TRANSFER_SIZE = 512;
+
+// Plain keymap (without layers) used while a firmware image is being staged into the
+// opposite bank, where the Lua keymap resides (See `./darpc stage`). Each entry is the
+// key name of the slot in order, or "" for none.
+inline constexpr const char* FALLBACK_KEYMAP[] = {
+    "ESC", "1", "2", "3", "4", "5", "6", "7", "8", "9", "0", "-", "=", "BKSP", "DEL",
+    "TAB", "Q", "W", "E", "R", "T", "Y", "U", "I", "O", "P", "[", "]", "\\", "HOME",
+    "CAPSLOCK", "A", "S", "D", "F", "G", "H", "J", "K", "L", ";", "'", "ENTER", "PGUP",
+    "LSHFT", "Z", "X", "C", "V", "B", "N", "M", ",", ".", "/", "RSHFT", "UP", "PGDN",
+    "LCTRL", "LGUI", "LALT", "SPACE", "", "RALT", "LEFT", "DOWN", "RIGHT"
+};
+
+// Store each `fw.*` function into the fw table on its first use, so that later uses find
+// it there without calling the fw.__index metamethod. This costs a Lua hash node (~24
+// bytes) per function used.
+constexpr bool CACHE_FW_FUNCTIONS = false;
+
+// Stop the automatic garbage collection of Lua and have main_thread run it in increments
+// while the keyboard is idle, keeping the GC pauses out of key event handling.
+constexpr bool ENABLE_LUA_IDLE_GC = true;
+
+// Time spent on each increment of the idle-time collection
+constexpr uint32_t LUA_GC_STEP_BUDGET_US = 500;
+
+// A new collection cycle starts once the Lua heap has grown by this much since the last.
+constexpr int LUA_GC_IDLE_THRESHOLD_KB = 4;
+
+// Usage of the Lua heap (in percent of LUA_MEM_SIZE) at which a full collection runs
+// without waiting for the keyboard to be idle.
+constexpr unsigned LUA_GC_EMERGENCY_PERCENT = 85;
+
+// Capacity of the ring of pending calls from fw.execute_later() (must be a power of 2)
+// and the number of arguments each call can store without allocating on the Lua heap.
+// Calls beyond these are still accepted, but are packed into Lua tables.
+constexpr unsigned EXECUTE_LATER_QUEUE_SIZE = 8;
+constexpr unsigned EXECUTE_LATER_INLINE_ARGS = 2;
+
 // NVM (SmartEEPROM) is delayed to write for this period.
 constexpr uint32_t NVM_WRITE_DELAY_MS = 1000;
 
@@ -0,0 +1,187 @@
+#include <algorithm>            // for std::max(), std::min()
+#include <cstdlib>              // for std::abs()
+#include <iterator>             // for std::size()
+#include "led_conf.h"           // for KEY_LED_COUNT
+
+#include "effects.hpp"
+#include "hsv.hpp"              // for HSV_HUE_STEPS
+
+
+
+// Horizontal center of each key LED (slot_index - 1) on the Drop ALT layout in units of
+// 1/4 key width, and the last slot_index of each row
+static constexpr uint8_t KEY_X[] = {
+    2, 6, 10, 14, 18, 22, 26, 30, 34, 38, 42, 46, 50, 56, 62,    // Esc ... Del
+    3, 8, 12, 16, 20, 24, 28, 32, 36, 40, 44, 48, 52, 57, 62,    // Tab ... Home
+    3, 9, 13, 17, 21, 25, 29, 33, 37, 41, 45, 49, 55, 62,        // Caps ... PgUp
+    4, 11, 15, 19, 23, 27, 31, 35, 39, 43, 47, 52, 58, 62,       // LShft ... PgDn
+    2, 7, 12, 27, 42, 47, 54, 58, 62                             // LCtrl ... Right
+};
+
+static constexpr unsigned ROW_END[] = { 15, 30, 44, 58, 67 };
+
+static_assert( std::size(KEY_X) == KEY_LED_COUNT );
+static_assert( ROW_END[std::size(ROW_END) - 1] == KEY_LED_COUNT );
+
+static unsigned _key_row(unsigned slot_index)
+{
+    unsigned row = 0;
+    while ( slot_index > ROW_END[row] )
+        row++;
+    return row;
+}
+
+// Approximate distance between two key LEDs in units of 1/4 key width
+static unsigned _key_distance(unsigned slot1, unsigned slot2)
+{
+    const unsigned dx = std::abs(KEY_X[slot1 - 1] - KEY_X[slot2 - 1]);
+    const unsigned dy = 4 * std::abs(int(_key_row(slot1)) - int(_key_row(slot2)));
+    // Octagonal approximation of the Euclidean distance
+    return std::max(dx, dy) + std::min(dx, dy) / 2;
+}
+
+static constexpr hsv_t BLACK = { 0, 0, 0 };
+
+static constexpr unsigned MAX_RIPPLES = 6;
+
+// State of the effects, reset by their start()
+static union {
+    struct {
+        uint32_t release_ms[KEY_LED_COUNT + 1];
+        bool is_pressed[KEY_LED_COUNT + 1];
+        bool is_fading[KEY_LED_COUNT + 1];
+    } trace;
+
+    struct {
+        struct { uint8_t slot_index; uint32_t start_ms; } ripples[MAX_RIPPLES];
+        unsigned next;
+    } ripple;
+} _state;
+
+static void _reset_state(const effect_params_t&)
+{
+    __builtin_memset(&_state, 0, sizeof(_state));
+}
+
+
+
+// "solid": all key LEDs in the color
+static hsv_t _solid_render(const effect_params_t& params, unsigned, uint32_t)
+{
+    return params.color;
+}
+
+// "breathing": brightness rising and falling over the period (arg) in ms
+static hsv_t _breathing_render(const effect_params_t& params, unsigned, uint32_t now_ms)
+{
+    // Triangle wave from 0 to 255 and back
+    const unsigned phase = uint64_t(now_ms % params.arg) * 512 / params.arg;
+    const unsigned level = phase < 256 ? phase : 511 - phase;
+    hsv_t color = params.color;
+    color.v = color.v * level / 255;
+    return color;
+}
+
+// "rainbow": a full hue cycle across the keyboard, shifting over the period (arg) in ms
+// and starting from the hue of the color
+static hsv_t _rainbow_render(const effect_params_t& params, unsigned slot_index,
+    uint32_t now_ms)
+{
+    constexpr unsigned WIDTH = 64;  // of the keyboard, in units of 1/4 key width
+    const unsigned shift = uint64_t(now_ms % params.arg) * HSV_HUE_STEPS / params.arg;
+    hsv_t color = params.color;
+    color.h = (color.h + KEY_X[slot_index - 1] * HSV_HUE_STEPS / WIDTH + shift)
+        % HSV_HUE_STEPS;
+    return color;
+}
+
+// "trace": same as FingerTracer in effect.lua; a key LED goes off while pressed, and
+// then fades back in over the time (arg) in ms after released.
+static void _trace_key_event(const effect_params_t&, unsigned slot_index,
+    bool is_press, uint32_t now_ms)
+{
+    if ( slot_index > KEY_LED_COUNT )
+        return;
+    _state.trace.is_pressed[slot_index] = is_press;
+    _state.trace.is_fading[slot_index] = !is_press;
+    _state.trace.release_ms[slot_index] = now_ms;
+}
+
+static hsv_t _trace_render(const effect_params_t& params, unsigned slot_index,
+    uint32_t now_ms)
+{
+    hsv_t color = params.color;
+    if ( _state.trace.is_pressed[slot_index] )
+        color.v = 0;
+    else if ( _state.trace.is_fading[slot_index] ) {
+        const uint32_t dt = now_ms - _state.trace.release_ms[slot_index];
+        if ( dt < params.arg )
+            color.v = uint64_t(color.v) * dt / params.arg;
+        else
+            _state.trace.is_fading[slot_index] = false;
+    }
+    return color;
+}
+
+// "ripple": rings spreading out from the pressed keys at the speed (arg) in key widths
+// per second, on a dark background
+static void _ripple_key_event(const effect_params_t&, unsigned slot_index,
+    bool is_press, uint32_t now_ms)
+{
+    if ( !is_press || slot_index > KEY_LED_COUNT )
+        return;
+    auto& ripple = _state.ripple.ripples[_state.ripple.next];
+    ripple.slot_index = slot_index;
+    ripple.start_ms = now_ms;
+    _state.ripple.next = (_state.ripple.next + 1) % std::size(_state.ripple.ripples);
+}
+
+static hsv_t _ripple_render(const effect_params_t& params, unsigned slot_index,
+    uint32_t now_ms)
+{
+    constexpr unsigned RING_WIDTH = 4;   // in units of 1/4 key width
+    constexpr unsigned MAX_RADIUS = 64;
+
+    unsigned level = 0;  // 0 to 255
+    for ( auto& ripple : _state.ripple.ripples ) {
+        if ( ripple.slot_index == 0 )
+            continue;
+        const unsigned radius = (now_ms - ripple.start_ms) * 4 * params.arg / 1000;
+        if ( radius >= MAX_RADIUS ) {
+            ripple.slot_index = 0;  // Expired
+            continue;
+        }
+        const unsigned d = _key_distance(slot_index, ripple.slot_index);
+        const unsigned gap = d > radius ? d - radius : radius - d;
+        if ( gap < RING_WIDTH ) {
+            // Brightest at the ring, fading as it spreads out
+            const unsigned l = (RING_WIDTH - gap) * (MAX_RADIUS - radius)
+                * 255 / (RING_WIDTH * MAX_RADIUS);
+            level = std::max(level, l);
+        }
+    }
+
+    if ( level == 0 )
+        return BLACK;
+    hsv_t color = params.color;
+    color.v = color.v * level / 255;
+    return color;
+}
+
+
+
+static constexpr effect_t EFFECTS[] = {
+    { "breathing", 4000, _reset_state, nullptr, _breathing_render },
+    { "rainbow", 8000, _reset_state, nullptr, _rainbow_render },
+    { "ripple", 16, _reset_state, _ripple_key_event, _ripple_render },
+    { "solid", 0, _reset_state, nullptr, _solid_render },
+    { "trace", 8000, _reset_state, _trace_key_event, _trace_render },
+};
+
+const effect_t* find_effect(const char* name)
+{
+    for ( const effect_t& effect : EFFECTS )
+        if ( __builtin_strcmp(effect.name, name) == 0 )
+            return &effect;
+    return nullptr;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>              // for uint32_t
+
+#include "hsv.hpp"              // for hsv_t
+
+
+
+// Parameters of an effect given from Lua: the base color and one more whose meaning
+// depends on the effect (e.g. a period)
+struct effect_params_t {
+    hsv_t color;
+    uint32_t arg;
+};
+
+// Interface for the native effects rendered by effects_thread. The effects compute in
+// fixed point, and keep their state in static storage shared among them, which is
+// reset by start(). All functions run in effects_thread.
+struct effect_t {
+    const char* name;
+
+    // Value of `arg` when not given
+    uint32_t default_arg;
+
+    // Called when the effect is selected.
+    void (*start)(const effect_params_t& params);
+
+    // Called for each key event, or nullptr if the effect does not react to keys.
+    void (*key_event)(const effect_params_t& params, unsigned slot_index, bool is_press,
+        uint32_t now_ms);
+
+    // Return the color of the key LED at the time, called for each frame and for each
+    // slot_index from 1 to KEY_LED_COUNT.
+    hsv_t (*render)(const effect_params_t& params, unsigned slot_index, uint32_t now_ms);
+};
+
+// Return the effect with the given name, or nullptr if not found.
+const effect_t* find_effect(const char* name);
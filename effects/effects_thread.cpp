@@ -0,0 +1,178 @@
+#include <algorithm>            // for std::min()
+#include "board.h"              // for THREAD_PRIO_EFFECTS
+#include "irq.h"                // for irq_disable(), irq_restore()
+#include "is31fl3733.h"         // for is31_set_color(), is31_refresh_colors_async(), ...
+#include "thread.h"             // for thread_create(), thread_get_unchecked()
+#include "thread_flags.h"       // for thread_flags_wait_any()
+#include "ztimer.h"             // for ztimer_set_timeout_flag(), ztimer_remove(), ...
+
+#include "config.hpp"           // for EFFECTS_FRAME_PERIOD_MS
+#include "effects_thread.hpp"
+#include "hsv.hpp"              // for hsv2rgb_batch()
+#include "rgb_gcr.hpp"          // for rgb_gcr::is_enabled()
+
+
+
+thread_t* effects_thread::m_pthread = nullptr;
+
+alignas(8) char effects_thread::m_thread_stack[EFFECTS_STACKSIZE];
+
+ztimer_t effects_thread::m_frame_timer;
+
+const effect_t* volatile effects_thread::m_effect = nullptr;
+effect_params_t effects_thread::m_params;
+
+const effect_t* effects_thread::m_pending_effect = nullptr;
+effect_params_t effects_thread::m_pending_params;
+
+uint8_t effects_thread::m_key_events[KEY_EVENT_RING_SIZE];
+unsigned effects_thread::m_key_event_head = 0;
+unsigned effects_thread::m_key_event_tail = 0;
+
+effects_thread::override_t effects_thread::m_overrides[MAX_OVERRIDES] = {};
+
+void effects_thread::init()
+{
+    m_pthread = thread_get_unchecked( thread_create(
+        m_thread_stack, sizeof(m_thread_stack),
+        THREAD_PRIO_EFFECTS,
+        THREAD_CREATE_STACKTEST,
+        _thread_entry, nullptr, "effects_thread") );
+}
+
+void effects_thread::select(const effect_t* effect, const effect_params_t& params)
+{
+    unsigned state = irq_disable();
+    m_pending_effect = effect;
+    m_pending_params = params;
+    irq_restore(state);
+    thread_flags_set(m_pthread, FLAG_SELECT);
+}
+
+void effects_thread::stop()
+{
+    select(nullptr, {});
+    unsigned state = irq_disable();
+    for ( override_t& entry : m_overrides )
+        entry.slot_index = 0;
+    irq_restore(state);
+}
+
+void effects_thread::signal_key_event(unsigned slot_index, bool is_press)
+{
+    if ( !is_running() )
+        return;
+
+    const unsigned head = m_key_event_head;
+    if ( head - __atomic_load_n(&m_key_event_tail, __ATOMIC_ACQUIRE)
+            == KEY_EVENT_RING_SIZE )
+        return;  // The ring is full; drop the event, which is only for visuals.
+
+    m_key_events[head % KEY_EVENT_RING_SIZE] = slot_index | (is_press ? 0x80 : 0);
+    __atomic_store_n(&m_key_event_head, head + 1, __ATOMIC_RELEASE);
+}
+
+void effects_thread::override(unsigned slot_index, const hsv_t* color)
+{
+    unsigned state = irq_disable();
+    override_t* free_entry = nullptr;
+    for ( override_t& entry : m_overrides ) {
+        if ( entry.slot_index == slot_index ) {
+            if ( color )
+                entry.color = *color;
+            else
+                entry.slot_index = 0;
+            irq_restore(state);
+            return;
+        }
+        if ( entry.slot_index == 0 && free_entry == nullptr )
+            free_entry = &entry;
+    }
+
+    // If all entries are in use, the new override is ignored.
+    if ( color && free_entry )
+        *free_entry = { uint8_t(slot_index), *color };
+    irq_restore(state);
+}
+
+void effects_thread::_draw_frame(uint32_t now_ms)
+{
+    const effect_t* const effect = m_effect;
+
+    // Pass the key events queued since the last frame.
+    const unsigned head = __atomic_load_n(&m_key_event_head, __ATOMIC_ACQUIRE);
+    unsigned tail = m_key_event_tail;
+    for ( ; tail != head ; tail++ ) {
+        const uint8_t key_event = m_key_events[tail % KEY_EVENT_RING_SIZE];
+        if ( effect->key_event )
+            effect->key_event(m_params, key_event & 0x7f, key_event & 0x80, now_ms);
+    }
+    __atomic_store_n(&m_key_event_tail, tail, __ATOMIC_RELEASE);
+
+    // Nothing would be visible.
+    if ( !rgb_gcr::is_enabled() )
+        return;
+
+    override_t overrides[MAX_OVERRIDES];
+    unsigned state = irq_disable();
+    __builtin_memcpy(overrides, m_overrides, sizeof(overrides));
+    irq_restore(state);
+
+    // Render the LEDs in batches, converting each batch into RGB at once.
+    constexpr unsigned BATCH_SIZE = 16;
+    hsv_t colors[BATCH_SIZE];
+    uint32_t rgb[BATCH_SIZE];
+    for ( unsigned first = 1 ; first <= ALL_LED_COUNT ; first += BATCH_SIZE ) {
+        const unsigned n = std::min(ALL_LED_COUNT + 1 - first, BATCH_SIZE);
+        for ( unsigned i = 0 ; i < n ; i++ ) {
+            const unsigned slot_index = first + i;
+            // Underglow LEDs stay off unless overridden.
+            colors[i] = slot_index <= KEY_LED_COUNT
+                ? effect->render(m_params, slot_index, now_ms) : hsv_t { 0, 0, 0 };
+        }
+
+        for ( const override_t& entry : overrides )
+            if ( entry.slot_index >= first && entry.slot_index < first + n )
+                colors[entry.slot_index - first] = entry.color;
+
+        hsv2rgb_batch(colors, rgb, n);
+        for ( unsigned i = 0 ; i < n ; i++ )
+            is31_set_color(IS31_LEDS[first - 1 + i], rgb[i] >> 16, rgb[i] >> 8, rgb[i]);
+    }
+
+    // Only the LEDs whose colors changed are written out, in the background.
+    is31_refresh_colors_async(nullptr, nullptr);
+}
+
+NORETURN void* effects_thread::_thread_entry(void*)
+{
+    while ( true ) {
+        // Zzz
+        thread_flags_t flags = thread_flags_wait_any(FLAG_SELECT | FLAG_TIMEOUT);
+
+        if ( flags & FLAG_SELECT ) {
+            ztimer_remove(ZTIMER_MSEC, &m_frame_timer);
+
+            unsigned state = irq_disable();
+            const effect_t* const effect = m_pending_effect;
+            m_params = m_pending_params;
+            irq_restore(state);
+
+            // Discard the key events for the previous effect.
+            __atomic_store_n(&m_key_event_tail,
+                __atomic_load_n(&m_key_event_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+
+            if ( effect ) {
+                effect->start(m_params);
+                flags |= FLAG_TIMEOUT;  // Draw the first frame now.
+            }
+            m_effect = effect;
+        }
+
+        if ( (flags & FLAG_TIMEOUT) && m_effect ) {
+            // Set the timer first so that drawing time does not drift the frame rate.
+            ztimer_set_timeout_flag(ZTIMER_MSEC, &m_frame_timer, EFFECTS_FRAME_PERIOD_MS);
+            _draw_frame(ztimer_now(ZTIMER_MSEC));
+        }
+    }
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "thread.h"             // for thread_t
+#include "thread_flags.h"       // for thread_flags_set()
+#include "ztimer.h"             // for ztimer_t
+
+#include "effects.hpp"          // for effect_t, effect_params_t, hsv_t
+
+
+
+// Thread rendering a native effect (See effects.cpp) on the key LEDs at a fixed frame
+// rate, given only its parameters from Lua. While an effect is running, the RGB LEDs
+// belong to this thread, and Lua can color individual LEDs (e.g. lamps) only through
+// override().
+class effects_thread {
+public:
+    static void init();
+
+    // Start the effect, replacing the current one if any. Can be called from any thread.
+    static void select(const effect_t* effect, const effect_params_t& params);
+
+    // Stop the current effect, leaving the LEDs as they are, and drop all overrides.
+    static void stop();
+
+    static bool is_running() { return m_effect != nullptr; }
+
+    // Pass a key event to the running effect. Called from matrix_thread.
+    static void signal_key_event(unsigned slot_index, bool is_press);
+
+    // Draw the LED in the color on top of the effect, or stop doing it if `color` is
+    // nullptr.
+    static void override(unsigned slot_index, const hsv_t* color);
+
+private:
+    constexpr effects_thread() =delete;  // Ensure a static class
+
+    enum : thread_flags_t {
+        FLAG_SELECT             = 0x0001,
+        FLAG_TIMEOUT            = THREAD_FLAG_TIMEOUT  // (1u << 14)
+    };
+
+    static thread_t* m_pthread;
+
+    static char m_thread_stack[];
+
+    static ztimer_t m_frame_timer;
+
+    // Current effect, accessed only by this thread except for is_running()
+    static const effect_t* volatile m_effect;
+    static effect_params_t m_params;
+
+    // Effect to start, passed from select() under irq_disable()
+    static const effect_t* m_pending_effect;
+    static effect_params_t m_pending_params;
+
+    // Single-producer (matrix_thread) single-consumer ring of key events, each as
+    // slot_index with the bit 7 set for a press
+    static constexpr unsigned KEY_EVENT_RING_SIZE = 16;
+    static_assert( (KEY_EVENT_RING_SIZE & (KEY_EVENT_RING_SIZE - 1)) == 0 );
+    static uint8_t m_key_events[KEY_EVENT_RING_SIZE];
+    static unsigned m_key_event_head;
+    static unsigned m_key_event_tail;
+
+    static constexpr unsigned MAX_OVERRIDES = 8;
+    static struct override_t {
+        uint8_t slot_index;  // 0 if unused
+        hsv_t color;
+    } m_overrides[MAX_OVERRIDES];
+
+    static void _draw_frame(uint32_t now_ms);
+
+    static void* _thread_entry(void* arg);
+};
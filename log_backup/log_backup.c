@@ -1,11 +1,15 @@
 #include <stdarg.h>             // for va_start(), va_end()
+#include <stdbool.h>            // for bool
+#include <stdio.h>              // for vsnprintf()
 
-#include "backup_ram.h"         // for backup_ram_write()
+#include "assert.h"             // for static_assert()
+#include "backup_ram.h"         // for backup_ram_write(), log_record_t
 #include "irq.h"                // for irq_disable(), irq_restore()
 #include "log.h"                // for LOG_ERROR, LOG_WARNING, ...
 #include "log_module.h"
 #include "stdio_base.h"         // for stdio_write()
 #include "thread.h"             // for thread_get_active(), thread_get_priority()
+#include "ztimer.h"             // for ztimer_set(), ztimer_remove(), ...
 
 
 
@@ -19,6 +23,144 @@ static const char* COLOR_CODE[] = {
 
 static uint8_t log_mask = 0xff;
 
+// If set, the log records are written to CDC ACM as they are stored in backup RAM,
+// instead of formatted lines, each prefixed with LOG_BINARY_SYNC for the host to find
+// the record boundaries.
+static bool log_binary = false;
+static const char LOG_BINARY_SYNC[2] = { '\x1e', '\x1e' };  // ASCII record separators
+
+// Ring buffer of deferred logs, each of which is a fixed-size binary record.
+typedef struct {
+    const char* format;
+    uint32_t args[3];
+    unsigned level;
+} deferred_log_t;
+
+#define DEFERRED_LOG_SIZE  16u  // must be a power of two.
+static_assert( (DEFERRED_LOG_SIZE & (DEFERRED_LOG_SIZE - 1)) == 0 );
+
+static deferred_log_t deferred_logs[DEFERRED_LOG_SIZE];
+static unsigned deferred_begin = 0;
+static unsigned deferred_end = 0;
+static unsigned deferred_dropped = 0;  // number of records lost due to overflow
+
+// Coalescing buffer for the log output. Each stdio_write() posts a flush event to the
+// usbus thread, which then starts a separate CDC ACM transfer, so the log lines are
+// collected here and written out together once LOG_TX_FLUSH_SIZE bytes are pending or
+// LOG_TX_DEADLINE_MS has elapsed since the first pending line.
+#define LOG_TX_BUF_SIZE     512u
+#define LOG_TX_FLUSH_SIZE   256u  // 4 packets of CDC ACM bulk endpoint
+#define LOG_TX_DEADLINE_MS  2u
+
+static void _tmo_log_tx(void* arg);
+
+static char log_tx_buf[LOG_TX_BUF_SIZE];
+static size_t log_tx_len = 0;
+static bool log_tx_enabled = false;  // Set by log_start_coalescing().
+static bool log_timestamps_enabled = false;  // Set by log_start_timestamps().
+static unsigned log_tx_writes = 0;   // number of stdio_write() calls for logs
+static size_t log_tx_bytes = 0;      // number of bytes written by them
+static ztimer_t log_tx_timer = { .callback = _tmo_log_tx };
+
+static void _log_write(const char* data, size_t len)
+{
+    stdio_write(data, len);
+    log_tx_writes++;
+    log_tx_bytes += len;
+}
+
+static void _log_tx_append(const char* data, size_t len)
+{
+    if ( log_tx_len + len > LOG_TX_BUF_SIZE ) {
+        log_flush();
+        if ( len > LOG_TX_BUF_SIZE ) {
+            _log_write(data, len);
+            return;
+        }
+    }
+    __builtin_memcpy(&log_tx_buf[log_tx_len], data, len);
+    log_tx_len += len;
+}
+
+static void _tmo_log_tx(void* arg)
+{
+    (void)arg;
+    log_flush();
+}
+
+// Append a formatted line from a text record.
+static void _log_tx_line(unsigned level, const char* line, size_t len)
+{
+    // assert( len > 0 && line[len - 1] == '\n' );
+    switch ( level ) {
+        case LOG_ERROR:
+        case LOG_WARNING:
+        case LOG_INFO:
+            if ( len > 1 ) {  // If the line is not just "\n",
+                // Restore color before the trailing '\n'; In canonical-mode terminals,
+                // escape sequences after a newline will appear as part of the next line
+                // input.
+                _log_tx_append(
+                    COLOR_CODE[level], __builtin_strlen(COLOR_CODE[level]));
+                _log_tx_append(line, len - 1);
+                _log_tx_append(
+                    COLOR_CODE[LOG_DEBUG], __builtin_strlen(COLOR_CODE[LOG_DEBUG]));
+                _log_tx_append("\n", 1);
+                break;
+            }
+            // Intentional fall-through
+
+        default:
+            _log_tx_append(line, len);
+            break;
+    }
+}
+
+// Format a line directly into log_tx_buf, truncating it if it does not fit even in the
+// empty buffer.
+static void _log_tx_format(unsigned level, const char* format, va_list args)
+{
+    const bool is_colored = level >= LOG_ERROR && level <= LOG_INFO;
+    const char* const prefix = is_colored ? COLOR_CODE[level] : "";
+    const char* const suffix = COLOR_CODE[LOG_DEBUG];
+    const size_t prefix_len = __builtin_strlen(prefix);
+    const size_t suffix_len = is_colored ? __builtin_strlen(suffix) + 1 : 1;
+
+    for (;;) {
+        char* const line = &log_tx_buf[log_tx_len];
+        const size_t room = LOG_TX_BUF_SIZE - log_tx_len;
+        if ( room > prefix_len + suffix_len ) {
+            const size_t max_len = room - prefix_len - suffix_len;
+            va_list args_copy;
+            va_copy(args_copy, args);
+            // The null terminator goes into the space reserved for the suffix.
+            int len = vsnprintf(line + prefix_len, max_len + 1, format, args_copy);
+            va_end(args_copy);
+
+            if ( len >= 0 && ((size_t)len <= max_len || log_tx_len == 0) ) {
+                if ( (size_t)len > max_len )
+                    len = max_len;
+                if ( len == 0 ) {
+                    line[0] = '\n';
+                    log_tx_len++;
+                    return;
+                }
+                __builtin_memcpy(line, prefix, prefix_len);
+                char* const end = line + prefix_len + len;
+                if ( is_colored )
+                    __builtin_memcpy(end, suffix, suffix_len - 1);
+                end[suffix_len - 1] = '\n';
+                log_tx_len += prefix_len + len + suffix_len;
+                return;
+            }
+            if ( len < 0 )
+                return;
+        }
+        // Make room and try again.
+        log_flush();
+    }
+}
+
 void log_backup(unsigned level, const char* format, ...)
 {
     va_list args;
@@ -30,49 +172,126 @@ void log_backup(unsigned level, const char* format, ...)
 void vlog_backup(unsigned level, const char* format, va_list args)
 {
     // Defer context switching by disabling the PendSV interrupt. This ensures that
-    // stdio_write() can safely push log strings into cdcacm->tsrb without being
-    // preempted or interrupted, and that the cdcacm->flush events triggered by
-    // stdio_write() are deferred and processed together only after irq_enable() is
-    // called.
+    // the log is appended to log_tx_buf (and possibly pushed into cdcacm->tsrb by
+    // stdio_write()) without being preempted or interrupted, and that the
+    // cdcacm->flush event triggered by stdio_write() is processed only after
+    // irq_enable() is called.
     unsigned state = irq_disable();
 
-    // All logs are first saved to backup RAM, regardless of log_mask filtering.
-    const char* line = backup_ram_write(format, args);
+    // All logs are first saved to backup RAM, regardless of log_mask filtering. Note
+    // that ztimer is available only after log_start_timestamps() is called.
+    thread_t* const active = thread_get_active();
+    va_list args_copy;
+    va_copy(args_copy, args);
+    const log_record_t* const record = backup_ram_write(
+        level, active ? thread_get_priority(active) : 0xff,
+        log_timestamps_enabled ? ztimer_now(ZTIMER_MSEC) : 0,
+        format, args_copy);
+    va_end(args_copy);
 
     // LOG_LUA_ERROR is always displayed, regardless of the current thread.
     if ( level == LOG_LUA_ERROR
       // All LOG_* messages are displayed during boot code (kernel_init()).
-      || unlikely(thread_get_active() == NULL)
+      || unlikely(active == NULL)
       // Otherwise, LOG_* messages are filtered based on log_mask and thread priority.
-      || (log_mask & (1 << thread_get_priority(thread_get_active()))) ) {
-        const size_t len = __builtin_strlen(line);
-        // assert( len > 0 && line[len - 1] == '\n' );
-        switch ( level ) {
-            case LOG_ERROR:
-            case LOG_WARNING:
-            case LOG_INFO:
-                if ( len > 1 ) {  // If the line is not just "\n",
-                    // Restore color before the trailing '\n'; In canonical-mode
-                    // terminals, escape sequences after a newline will appear as part
-                    // of the next line input.
-                    stdio_write(COLOR_CODE[level], __builtin_strlen(COLOR_CODE[level]));
-                    stdio_write(line, len - 1);
-                    stdio_write(
-                        COLOR_CODE[LOG_DEBUG], __builtin_strlen(COLOR_CODE[LOG_DEBUG]));
-                    stdio_write("\n", 1);
-                    break;
-                }
-                // Intentional fall-through
-
-            default:
-                stdio_write(line, len);
-                break;
+      || (log_mask & (1 << thread_get_priority(active))) ) {
+        if ( log_binary ) {
+            _log_tx_append(LOG_BINARY_SYNC, sizeof(LOG_BINARY_SYNC));
+            _log_tx_append((const char*)record, record->size);
+        }
+        else if ( record->format == 0 ) {
+            // Text records hold the formatted line already.
+            const char* const line = (const char*)(record + 1);
+            _log_tx_line(level, line, __builtin_strlen(line));
         }
+        else
+            // Format it only when it is to be displayed.
+            _log_tx_format(level, format, args);
+
+        // Lua errors are written out right away as the REPL response follows them. The
+        // other output to stdio calls log_flush() before writing.
+        if ( !log_tx_enabled || level == LOG_LUA_ERROR
+          || log_tx_len >= LOG_TX_FLUSH_SIZE )
+            log_flush();
+        else if ( log_tx_len > 0 && !ztimer_is_set(ZTIMER_MSEC, &log_tx_timer) )
+            ztimer_set(ZTIMER_MSEC, &log_tx_timer, LOG_TX_DEADLINE_MS);
     }
 
     irq_restore(state);
 }
 
+void log_flush(void)
+{
+    unsigned state = irq_disable();
+    if ( log_tx_len > 0 ) {
+        ztimer_remove(ZTIMER_MSEC, &log_tx_timer);
+        _log_write(log_tx_buf, log_tx_len);
+        log_tx_len = 0;
+    }
+    irq_restore(state);
+}
+
+void log_start_timestamps(void)
+{
+    log_timestamps_enabled = true;
+}
+
+void log_start_coalescing(void)
+{
+    log_tx_enabled = true;
+}
+
+unsigned log_get_write_count(void)
+{
+    return log_tx_writes;
+}
+
+size_t log_get_write_bytes(void)
+{
+    return log_tx_bytes;
+}
+
+void log_defer(
+    unsigned level, const char* format, uint32_t arg0, uint32_t arg1, uint32_t arg2)
+{
+    unsigned state = irq_disable();
+    if ( deferred_end - deferred_begin < DEFERRED_LOG_SIZE ) {
+        deferred_log_t* const record =
+            &deferred_logs[deferred_end++ & (DEFERRED_LOG_SIZE - 1)];
+        record->format = format;
+        record->args[0] = arg0;
+        record->args[1] = arg1;
+        record->args[2] = arg2;
+        record->level = level;
+    }
+    else
+        deferred_dropped++;
+    irq_restore(state);
+}
+
+void log_flush_deferred(void)
+{
+    for (;;) {
+        // Pop one record at a time so that interrupts are disabled only briefly, and a
+        // higher-priority thread can safely record or flush logs in the meantime.
+        unsigned state = irq_disable();
+        if ( deferred_begin == deferred_end ) {
+            const unsigned dropped = deferred_dropped;
+            deferred_dropped = 0;
+            irq_restore(state);
+            if ( dropped > 0 )
+                log_backup(LOG_WARNING, "%u deferred logs dropped", dropped);
+            return;
+        }
+        const deferred_log_t record =
+            deferred_logs[deferred_begin++ & (DEFERRED_LOG_SIZE - 1)];
+        irq_restore(state);
+
+        log_backup(record.level, record.format,
+            record.args[0], record.args[1], record.args[2]);
+    }
+}
+
 uint8_t get_log_mask(void)
 {
     return log_mask;
@@ -84,3 +303,12 @@ void set_log_mask(uint8_t mask)
     log_mask = mask;
     irq_restore(state);
 }
+
+void set_log_binary(bool enable)
+{
+    unsigned state = irq_disable();
+    // Do not mix text and binary logs in the same write.
+    log_flush();
+    log_binary = enable;
+    irq_restore(state);
+}
@@ -3,6 +3,8 @@
 #pragma once
 
 #include <stdarg.h>             // for va_list
+#include <stdbool.h>            // for bool
+#include <stddef.h>             // for size_t
 #include <stdint.h>             // for uint8_t
 
 #include "log.h"                // for LOG_NONE
@@ -26,10 +28,45 @@ void log_backup(unsigned level, const char* format, ...);
 // va_list variant of log_backup().
 void vlog_backup(unsigned level, const char* format, va_list args);
 
+// Write out the pending log lines now, instead of waiting for the flush deadline. Output
+// written to stdio directly (e.g. Lua print() and fw.printf()) should call it first to
+// stay in order with the logs.
+void log_flush(void);
+
+// Start stamping the log records with ztimer_now(ZTIMER_MSEC); until then, they are
+// stamped 0. It should be called once ztimer is initialized.
+void log_start_timestamps(void);
+
+// Start coalescing log lines (See log_backup.c). Until then, each line is written out
+// immediately. It should be called once ztimer and CDC ACM are initialized.
+void log_start_coalescing(void);
+
+// Return the number of stdio_write() calls made for logs so far.
+unsigned log_get_write_count(void);
+
+// Return the number of bytes written by those calls so far.
+size_t log_get_write_bytes(void);
+
+// Record a log without formatting it, for use where formatting is too costly, e.g. while
+// interrupts are disabled. Only the format pointer and three word-sized arguments are
+// stored, so the format and any string arguments must outlive the record (e.g. string
+// literals). Use LOG_DEFERRED() below instead of calling it directly.
+void log_defer(
+    unsigned level, const char* format, uint32_t arg0, uint32_t arg1, uint32_t arg2);
+
+// Format and output all deferred logs, in the order they were recorded. It must be
+// called with interrupts enabled, and the logs are filtered by log_mask as if they were
+// issued from the calling thread.
+void log_flush_deferred(void);
+
 uint8_t get_log_mask(void);
 
 void set_log_mask(uint8_t mask);
 
+// Switch the log output on CDC ACM between formatted lines and binary log records (See
+// log_record_t in backup_ram.h), which ./dalogdecode can decode from the serial port.
+void set_log_binary(bool enable);
+
 // Each bit in the mask toggles the logging for the thread associated with its priority
 // level (1 << thread_get_priority()). The LSB (bit 0) is unrelated to masking logs, and
 // it only controls the displaying of the Lua welcome message. See lua::repl::start().
@@ -40,6 +77,15 @@ static const uint8_t LOG_MASK_WELCOME = 0x01;
 // always be displayed.
 static const unsigned LOG_LUA_ERROR = LOG_NONE;
 
+// Deferred variant of LOG(), taking up to three integer or pointer arguments.
+// e.g. LOG_DEFERRED(LOG_DEBUG, "USB_HID: key (0x%x %s)", keycode, name);
+#define LOG_DEFERRED(level, ...)  _LOG_DEFERRED(level, __VA_ARGS__, 0, 0, 0)
+#define _LOG_DEFERRED(level, format, arg0, arg1, arg2, ...)  do { \
+    if ( (level) <= LOG_LEVEL && (level) <= LOCAL_LOG_LEVEL ) \
+        log_defer((level), (format), \
+            (uint32_t)(arg0), (uint32_t)(arg1), (uint32_t)(arg2)); \
+    } while (0U)
+
 #ifdef __cplusplus
 }  // extern "C"
 
@@ -0,0 +1,139 @@
+#include "assert.h"
+
+#include "action_table.hpp"
+#include "lua.hpp"
+#include "usb_thread.hpp"       // for usb_thread::send_press(), ...
+
+
+
+// Flavor of ModIf, as defined in class.lua
+static constexpr uint8_t UNDO_MODIFIER = 1;
+
+action_table::action_t action_table::m_actions[MAX_ACTIONS + 1];
+
+unsigned action_table::m_action_count = 0;
+
+uint8_t action_table::m_slot_actions[KEY_LED_COUNT + 1];
+
+
+
+void action_table::reset()
+{
+    __builtin_memset(m_actions, 0, sizeof(m_actions));
+    __builtin_memset(m_slot_actions, 0, sizeof(m_slot_actions));
+    m_action_count = 0;
+}
+
+void action_table::set_slot_action(unsigned slot_index, uint8_t action)
+{
+    if ( slot_index >= 1 && slot_index <= KEY_LED_COUNT && action <= m_action_count )
+        m_slot_actions[slot_index] = action;
+}
+
+void action_table::press(uint8_t action)
+{
+    action_t& a = m_actions[action];
+    if ( ++a.press_count != 1 )
+        return;
+
+    switch ( a.type ) {
+        case ACTION_LIT:
+            usb_thread::send_press(a.keycode);
+            break;
+
+        case ACTION_MODIF:
+            // Same as Modifier:on_proxy_press() and ModIf:on_(modified_)press().
+            assert( !a.is_modified );
+            if ( is_pressed(a.modifier) ) {
+                a.is_modified = true;
+                if ( a.flavor == UNDO_MODIFIER )
+                    release(a.modifier);
+                press(a.modified);
+            }
+            else
+                press(a.original);
+            break;
+    }
+}
+
+void action_table::release(uint8_t action)
+{
+    action_t& a = m_actions[action];
+    if ( --a.press_count != 0 )
+        return;
+
+    switch ( a.type ) {
+        case ACTION_LIT:
+            usb_thread::send_release(a.keycode);
+            break;
+
+        case ACTION_MODIF:
+            if ( a.is_modified ) {
+                release(a.modified);
+                if ( a.flavor == UNDO_MODIFIER )
+                    press(a.modifier);
+                a.is_modified = false;
+            }
+            else
+                release(a.original);
+            break;
+    }
+}
+
+int action_table::_add(lua_State* L, const action_t& action)
+{
+    if ( m_action_count == MAX_ACTIONS )
+        return 0;
+
+    m_actions[++m_action_count] = action;
+    lua_pushinteger(L, m_action_count);
+    return 1;
+}
+
+// Check that the argument refers to an existing action.
+static uint8_t _check_action(lua_State* L, int arg, unsigned action_count)
+{
+    const lua_Integer action = luaL_checkinteger(L, arg);
+    luaL_argcheck(L, (action > 0 && action <= lua_Integer(action_count)), arg,
+        "invalid action");
+    return uint8_t(action);
+}
+
+int action_table::lit(lua_State* L)
+{
+    return _add(L, { .type = ACTION_LIT, .keycode = uint8_t(luaL_checkinteger(L, 1)) });
+}
+
+int action_table::pseudo(lua_State* L)
+{
+    return _add(L, { .type = ACTION_PSEUDO });
+}
+
+int action_table::modif(lua_State* L)
+{
+    return _add(L, {
+        .type = ACTION_MODIF,
+        .modifier = _check_action(L, 1, m_action_count),
+        .modified = _check_action(L, 2, m_action_count),
+        .original = _check_action(L, 3, m_action_count),
+        .flavor = uint8_t(luaL_optinteger(L, 4, 0))
+    });
+}
+
+int action_table::_press(lua_State* L)
+{
+    press(_check_action(L, 1, m_action_count));
+    return 0;
+}
+
+int action_table::_release(lua_State* L)
+{
+    release(_check_action(L, 1, m_action_count));
+    return 0;
+}
+
+int action_table::_is_pressed(lua_State* L)
+{
+    lua_pushboolean(L, is_pressed(_check_action(L, 1, m_action_count)));
+    return 1;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>              // for uint8_t, int8_t
+
+#include "led_conf.h"           // for KEY_LED_COUNT
+
+
+
+struct lua_State;
+
+// Static class for the action table, into which the keymap module lowers the keymaps
+// that can be executed natively (See Action in class.lua). Each action mirrors a keymap
+// instance in Lua, including its state, so that main_thread can dispatch key events on
+// the slots occupied by them without calling into Lua.
+// Note: All methods are called from main_thread only.
+class action_table {
+public:
+    enum : uint8_t {
+        ACTION_NONE = 0,
+        ACTION_PSEUDO,          // Pseudo()
+        ACTION_LIT,             // Lit(keyname)
+        ACTION_MODIF,           // ModIf(map_modifier, map_modified, map_original, flavor)
+    };
+
+    // Action indices are 1-based, with 0 meaning no action.
+    static constexpr unsigned MAX_ACTIONS = 127;
+
+    // Clear the table before loading the keymap module.
+    static void reset();
+
+    // Associate the slot with the action.
+    static void set_slot_action(unsigned slot_index, uint8_t action);
+
+    // Return the action associated with the slot, or 0 if none.
+    static uint8_t slot_action(unsigned slot_index) { return m_slot_actions[slot_index]; }
+
+    // Execute the action, as Base:_press() and Base:_release() do for the keymap.
+    static void press(uint8_t action);
+    static void release(uint8_t action);
+
+    static bool is_pressed(uint8_t action) { return m_actions[action].press_count > 0; }
+
+    // Add an action, returning its index, or nothing if the table is full.
+    static int lit(lua_State* L);     // fw.action_lit(keycode: int): int | void
+    static int pseudo(lua_State* L);  // fw.action_pseudo(): int | void
+    // fw.action_modif(modifier: int, modified: int, original: int [, flavor: int])
+    //     : int | void
+    static int modif(lua_State* L);
+
+    // Lua counterparts of press(), release() and is_pressed()
+    static int _press(lua_State* L);       // fw.action_press(action: int): void
+    static int _release(lua_State* L);     // fw.action_release(action: int): void
+    static int _is_pressed(lua_State* L);  // fw.action_is_pressed(action: int): bool
+
+private:
+    constexpr action_table() =delete;  // Ensure a static class
+
+    struct action_t {
+        uint8_t type;
+        uint8_t keycode;        // ACTION_LIT
+        uint8_t modifier;       // ACTION_MODIF: actions preceding this one in the table
+        uint8_t modified;
+        uint8_t original;
+        uint8_t flavor;
+        int8_t press_count;     // may go negative, as Base.m_press_count
+        bool is_modified;       // ACTION_MODIF
+    };
+
+    static action_t m_actions[MAX_ACTIONS + 1];
+
+    static unsigned m_action_count;
+
+    static uint8_t m_slot_actions[KEY_LED_COUNT + 1];
+
+    static int _add(lua_State* L, const action_t& action);
+};
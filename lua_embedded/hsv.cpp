@@ -0,0 +1,63 @@
+#include "hsv.hpp"
+
+
+
+// Bit positions in 0x00RRGGBB of the top, middle and bottom levels for each sextant,
+// derived from HSV_POINTER_SWAP() in fast_hsv2rgb.h. Only the lower 3 bits of the
+// sextant matter there, as here.
+struct level_shifts_t {
+    uint8_t top;
+    uint8_t mid;
+    uint8_t bottom;
+};
+
+static constexpr auto LEVEL_SHIFTS = [] {
+    constexpr auto swap = [](uint8_t& a, uint8_t& b) {
+        const uint8_t t = a;
+        a = b;
+        b = t;
+    };
+
+    std::array<level_shifts_t, 8> shifts {};
+    for ( unsigned sextant = 0 ; sextant < shifts.size() ; sextant++ ) {
+        // fast_hsv2rgb_32bit() stores the middle level through r, the top through g and
+        // the bottom through b, after swapping the pointers.
+        uint8_t r = 16, g = 8, b = 0;
+        if ( sextant & 2 )
+            swap(r, b);
+        if ( sextant & 4 )
+            swap(g, b);
+        if ( (sextant & 6) == 0 ? (sextant & 1) == 0 : (sextant & 1) != 0 )
+            swap(r, g);
+        shifts[sextant] = { g, r, b };
+    }
+    return shifts;
+}();
+
+[[gnu::always_inline]]
+static inline uint32_t _hsv2rgb(hsv_t color)
+{
+    const unsigned v = CIE1931_LUT[color.v];
+    const unsigned s = color.s;
+
+    // Bottom level: v * (1.0 - s), which is v itself for s = 0 (grayscale)
+    unsigned ww = v * (255 - s) + 1;
+    ww += ww >> 8;
+    const unsigned bottom = ww >> 8;
+
+    // Middle level, sloping up in even sextants and down in odd ones
+    const unsigned fraction = color.h & 0xff;
+    uint32_t d = v * (0xff00 - s * ((color.h & 0x100) ? fraction : 256 - fraction));
+    d += d >> 8;
+    d += v;
+    const unsigned mid = d >> 16;
+
+    const level_shifts_t& shifts = LEVEL_SHIFTS[(color.h >> 8) & 7];
+    return v << shifts.top | mid << shifts.mid | bottom << shifts.bottom;
+}
+
+void hsv2rgb_batch(const hsv_t hsv[], uint32_t rgb[], size_t n)
+{
+    for ( size_t i = 0 ; i < n ; i++ )
+        rgb[i] = _hsv2rgb(hsv[i]);
+}
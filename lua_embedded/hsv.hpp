@@ -1,5 +1,7 @@
 #pragma once
 
+#include <array>                // for std::array
+#include <cstddef>              // for size_t
 #include "fast_hsv2rgb.h"       // for HSV_HUE_STEPS
 
 
@@ -12,6 +14,25 @@ inline constexpr uint8_t cie1931(uint8_t v)
     return (v * v + 127) / 255;
 }
 
+// cie1931() tabulated at compile time, kept in flash
+inline constexpr auto CIE1931_LUT = [] {
+    std::array<uint8_t, 256> lut {};
+    for ( unsigned v = 0 ; v < lut.size() ; v++ )
+        lut[v] = cie1931(v);
+    return lut;
+}();
+
+// HSV color, as given to fw.led_set_hsv()
+struct hsv_t {
+    uint16_t h;
+    uint8_t s;
+    uint8_t v;
+};
+
+// Convert n colors into 0x00RRGGBB, each exactly as fast_hsv2rgb_32bit(h, s, cie1931(v))
+// would do but without branching on the sextant.
+void hsv2rgb_batch(const hsv_t hsv[], uint32_t rgb[], size_t n);
+
 // Note: Hue range is [0, 0x600) rather than [0, 360°).
 //  - High byte (0-5) selects sextant: R->Y->G->C->B->P.
 //  - Low byte (0-255) represents position within the sextant.
@@ -0,0 +1,126 @@
+#include "board.h"              // for get_cycle_count()
+#include "log.h"
+#include "time_units.h"         // for US_PER_SEC, MS_PER_SEC
+#include "ztimer.h"             // for ztimer_now()
+
+#include "config.hpp"           // for LUA_GC_STEP_BUDGET_US, ...
+#include "lcollect.hpp"
+#include "lua.hpp"
+
+
+
+namespace lua {
+
+// Heap usage in KB at the end of the last cycle
+static int _baseline_kb;
+
+static bool _is_in_cycle;
+
+// Statistics since gc_init()
+static uint32_t _start_ms;
+static uint32_t _max_pause_us;
+static uint32_t _steps;
+static uint32_t _cycles;
+static uint32_t _emergencies;
+
+static void _end_pause(uint32_t start_cycles)
+{
+    const uint32_t us =
+        (get_cycle_count() - start_cycles) / (CLOCK_CORECLOCK / US_PER_SEC);
+    if ( us > _max_pause_us )
+        _max_pause_us = us;
+}
+
+static void _end_cycle(lua_State* L)
+{
+    _is_in_cycle = false;
+    _baseline_kb = lua_gc(L, LUA_GCCOUNT, 0);
+    _cycles++;
+}
+
+void gc_init()
+{
+    global_lua_state L;
+
+    lua_gc(L, LUA_GCSTOP, 0);
+    _baseline_kb = lua_gc(L, LUA_GCCOUNT, 0);
+    _is_in_cycle = false;
+
+    _start_ms = ztimer_now(ZTIMER_MSEC);
+    _max_pause_us = 0;
+    _steps = 0;
+    _cycles = 0;
+    _emergencies = 0;
+}
+
+bool gc_is_pending()
+{
+    global_lua_state L;
+    return _is_in_cycle
+        || lua_gc(L, LUA_GCCOUNT, 0) >= _baseline_kb + LUA_GC_IDLE_THRESHOLD_KB;
+}
+
+void gc_step()
+{
+    global_lua_state L;
+
+    constexpr uint32_t BUDGET_CYCLES =
+        LUA_GC_STEP_BUDGET_US * (CLOCK_CORECLOCK / US_PER_SEC);
+    const uint32_t start = get_cycle_count();
+    _is_in_cycle = true;
+    do {
+        // Each basic step (data = 0) does a fixed amount of work (GCSTEPSIZE), even
+        // while the collector is stopped. It returns 1 at the end of the cycle.
+        _steps++;
+        if ( lua_gc(L, LUA_GCSTEP, 0) ) {
+            _end_cycle(L);
+            break;
+        }
+    } while ( get_cycle_count() - start < BUDGET_CYCLES );
+    _end_pause(start);
+}
+
+bool gc_is_urgent()
+{
+    global_lua_state L;
+    const int kb = lua_gc(L, LUA_GCCOUNT, 0);
+    // Unless the heap has grown since the last cycle, a full collection would not free
+    // any more.
+    return kb >= int(LUA_MEM_SIZE / 1024 * LUA_GC_EMERGENCY_PERCENT / 100)
+        && kb >= _baseline_kb + LUA_GC_IDLE_THRESHOLD_KB;
+}
+
+void gc_collect()
+{
+    global_lua_state L;
+
+    LOG_DEBUG("Lua: emergency collection at %d KB", lua_gc(L, LUA_GCCOUNT, 0));
+    const uint32_t start = get_cycle_count();
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    _emergencies++;
+    _end_cycle(L);
+    _end_pause(start);
+}
+
+int gc_stats(lua_State* L)
+{
+    const uint32_t elapsed_ms = ztimer_now(ZTIMER_MSEC) - _start_ms;
+
+    lua_createtable(L, 0, 6);
+    lua_pushinteger(L, lua_gc(L, LUA_GCCOUNT, 0));
+    lua_setfield(L, -2, "kb");
+    lua_pushinteger(L, _max_pause_us);
+    lua_setfield(L, -2, "max_pause_us");
+    lua_pushinteger(L, _steps);
+    lua_setfield(L, -2, "steps");
+    lua_pushinteger(L, _cycles);
+    lua_setfield(L, -2, "cycles");
+    lua_pushinteger(L,
+        elapsed_ms ? (uint64_t)_cycles * 60 * MS_PER_SEC / elapsed_ms : 0);
+    lua_setfield(L, -2, "cycles_per_min");
+    lua_pushinteger(L, _emergencies);
+    lua_setfield(L, -2, "emergencies");
+    return 1;
+}
+
+}
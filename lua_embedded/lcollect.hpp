@@ -0,0 +1,34 @@
+#pragma once
+
+
+
+struct lua_State;
+
+namespace lua {
+
+// Garbage collection scheduled by main_thread (See ENABLE_LUA_IDLE_GC in config.hpp).
+// The automatic collection is stopped, so that no GC pause falls in the middle of a key
+// event or a timer callback. Instead, the collection proceeds in bounded increments
+// while usb_thread and matrix_thread are idle, with a full collection as a fallback
+// when the heap fills up before that.
+
+// Stop the automatic collection. Called after loading the keymap module.
+void gc_init();
+
+// Check whether a collection cycle is in progress or the heap has grown enough since
+// the last cycle to start a new one.
+bool gc_is_pending();
+
+// Run the collection in increments for about LUA_GC_STEP_BUDGET_US.
+void gc_step();
+
+// Check whether the heap usage exceeds LUA_GC_EMERGENCY_PERCENT.
+bool gc_is_urgent();
+
+// Finish the collection cycle at once.
+void gc_collect();
+
+// fw.gc_stats(): table
+int gc_stats(lua_State* L);
+
+}
@@ -0,0 +1,192 @@
+#include <algorithm>            // for std::min()
+#include <new>                  // for placement new
+#include "is31fl3733.h"         // for is31_set_color(), is31_refresh_colors_async(), ...
+
+#include "hsv.hpp"              // for hsv2rgb_batch(), hsv_t, HSV_HUE_STEPS
+#include "led_frame.hpp"
+#include "lua.hpp"
+
+
+
+led_frame::frame_t* led_frame::_check_frame(lua_State* L, int arg)
+{
+    return static_cast<frame_t*>(luaL_checkudata(L, arg, "cframe"));
+}
+
+void led_frame::_check_range(lua_State* L, int arg, const frame_t* frame,
+    unsigned& begin, unsigned& end)
+{
+    const lua_Integer first = luaL_optinteger(L, arg, 1);
+    const lua_Integer last = luaL_optinteger(L, arg + 1, frame->count);
+    luaL_argcheck(L, first >= 1, arg, "invalid led_index");
+    luaL_argcheck(L, last <= lua_Integer(frame->count), arg + 1, "invalid led_index");
+    begin = first - 1;
+    end = last >= first ? last : begin;  // An empty range is fine.
+}
+
+int led_frame::create(lua_State* L)
+{
+    const lua_Integer count = luaL_optinteger(L, 1, ALL_LED_COUNT);
+    luaL_argcheck(L, count > 0 && count <= lua_Integer(ALL_LED_COUNT), 1,
+        "invalid count");
+
+    const size_t size = sizeof(frame_t) + count * sizeof(hsv_t);
+    frame_t* const frame = new (lua_newuserdata(L, size)) frame_t { unsigned(count) };
+    __builtin_memset(frame->colors(), 0, count * sizeof(hsv_t));  // All black
+    // ( -- userdata )
+
+    // The metatable only identifies the frames, and is created by the first one.
+    luaL_newmetatable(L, "cframe");
+    lua_setmetatable(L, -2);
+    // ( -- userdata )
+    return 1;
+}
+
+int led_frame::fill(lua_State* L)
+{
+    frame_t* const frame = _check_frame(L, 1);
+    const hsv_t color = {
+        uint16_t(luaL_checkinteger(L, 2) % HSV_HUE_STEPS),
+        uint8_t(luaL_checkinteger(L, 3)),
+        uint8_t(luaL_checkinteger(L, 4))
+    };
+    unsigned begin, end;
+    _check_range(L, 5, frame, begin, end);
+
+    hsv_t* const colors = frame->colors();
+    for ( unsigned i = begin ; i < end ; i++ )
+        colors[i] = color;
+    return 0;
+}
+
+int led_frame::set(lua_State* L)
+{
+    frame_t* const frame = _check_frame(L, 1);
+    const lua_Integer first = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, first >= 1, 2, "invalid led_index");
+    hsv_t* const colors = frame->colors() + (first - 1);
+    const size_t room = first <= lua_Integer(frame->count) ? frame->count - first + 1 : 0;
+
+    // Colors are packed into a string as 4 bytes each (h in little endian, s and v), or
+    // listed in a table as 3 integers each (h, s and v).
+    if ( lua_type(L, 3) == LUA_TSTRING ) {
+        size_t len;
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(lua_tolstring(L, 3, &len));
+        const size_t n = len / 4;
+        luaL_argcheck(L, len % 4 == 0 && n <= room, 3, "invalid length");
+        for ( size_t i = 0 ; i < n ; i++, p += 4 )
+            colors[i] = { uint16_t((p[0] | p[1] << 8) % HSV_HUE_STEPS), p[2], p[3] };
+    }
+    else {
+        luaL_checktype(L, 3, LUA_TTABLE);
+        const size_t len = lua_rawlen(L, 3);
+        const size_t n = len / 3;
+        luaL_argcheck(L, len % 3 == 0 && n <= room, 3, "invalid length");
+        for ( size_t i = 0 ; i < n ; i++ ) {
+            lua_rawgeti(L, 3, 3*i + 1);
+            lua_rawgeti(L, 3, 3*i + 2);
+            lua_rawgeti(L, 3, 3*i + 3);
+            // ( -- frame first colors h s v )
+            colors[i] = {
+                uint16_t(lua_tointeger(L, -3) % HSV_HUE_STEPS),
+                uint8_t(lua_tointeger(L, -2)),
+                uint8_t(lua_tointeger(L, -1))
+            };
+            lua_pop(L, 3);
+        }
+    }
+    return 0;
+}
+
+int led_frame::get(lua_State* L)
+{
+    frame_t* const frame = _check_frame(L, 1);
+    const lua_Integer led_index = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, led_index >= 1 && led_index <= lua_Integer(frame->count), 2,
+        "invalid led_index");
+
+    const hsv_t& color = frame->colors()[led_index - 1];
+    lua_pushinteger(L, color.h);
+    lua_pushinteger(L, color.s);
+    lua_pushinteger(L, color.v);
+    return 3;
+}
+
+int led_frame::scale(lua_State* L)
+{
+    frame_t* const frame = _check_frame(L, 1);
+    // The factor is in units of 1/256.
+    const lua_Integer factor = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, factor >= 0 && factor <= 0xffff, 2, "invalid factor");
+    unsigned begin, end;
+    _check_range(L, 3, frame, begin, end);
+
+    hsv_t* const colors = frame->colors();
+    for ( unsigned i = begin ; i < end ; i++ ) {
+        const unsigned v = (colors[i].v * unsigned(factor)) >> 8;
+        colors[i].v = v < 255 ? v : 255;
+    }
+    return 0;
+}
+
+int led_frame::rotate(lua_State* L)
+{
+    frame_t* const frame = _check_frame(L, 1);
+    // Reduce dh into [0, HSV_HUE_STEPS), as it may be negative.
+    const int dh = luaL_checkinteger(L, 2) % HSV_HUE_STEPS + HSV_HUE_STEPS;
+    unsigned begin, end;
+    _check_range(L, 3, frame, begin, end);
+
+    hsv_t* const colors = frame->colors();
+    for ( unsigned i = begin ; i < end ; i++ )
+        colors[i].h = (colors[i].h + dh) % HSV_HUE_STEPS;
+    return 0;
+}
+
+int led_frame::blend(lua_State* L)
+{
+    frame_t* const frame = _check_frame(L, 1);
+    const frame_t* const other = _check_frame(L, 2);
+    // The alpha is in units of 1/256, from 0 (this frame) to 256 (the other frame).
+    const lua_Integer alpha = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, alpha >= 0 && alpha <= 256, 3, "invalid alpha");
+    unsigned begin, end;
+    _check_range(L, 4, frame, begin, end);
+    luaL_argcheck(L, end <= other->count, 2, "too short");
+
+    hsv_t* const colors = frame->colors();
+    const hsv_t* const others = other->colors();
+    const int a = alpha;
+    for ( unsigned i = begin ; i < end ; i++ ) {
+        // Hue goes around the shorter way.
+        int dh = others[i].h - colors[i].h;
+        if ( dh > HSV_HUE_STEPS / 2 )
+            dh -= HSV_HUE_STEPS;
+        else if ( dh < -HSV_HUE_STEPS / 2 )
+            dh += HSV_HUE_STEPS;
+        colors[i].h = (colors[i].h + HSV_HUE_STEPS + dh * a / 256) % HSV_HUE_STEPS;
+        colors[i].s += (others[i].s - colors[i].s) * a / 256;
+        colors[i].v += (others[i].v - colors[i].v) * a / 256;
+    }
+    return 0;
+}
+
+int led_frame::show(lua_State* L)
+{
+    frame_t* const frame = _check_frame(L, 1);
+    unsigned begin, end;
+    _check_range(L, 2, frame, begin, end);
+
+    // Convert the colors in batches, with the CIE 1931 curve as fw.led_set_hsv() does.
+    constexpr unsigned BATCH_SIZE = 32;
+    const hsv_t* const colors = frame->colors();
+    uint32_t rgb[BATCH_SIZE];
+    for ( unsigned i = begin ; i < end ; i += BATCH_SIZE ) {
+        const unsigned n = std::min(end - i, BATCH_SIZE);
+        hsv2rgb_batch(&colors[i], rgb, n);
+        for ( unsigned j = 0 ; j < n ; j++ )
+            is31_set_color(IS31_LEDS[i + j], rgb[j] >> 16, rgb[j] >> 8, rgb[j]);
+    }
+    is31_refresh_colors_async(nullptr, nullptr);
+    return 0;
+}
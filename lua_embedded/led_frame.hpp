@@ -0,0 +1,57 @@
+#pragma once
+
+
+
+struct hsv_t;
+struct lua_State;
+
+// Static class for LED frames: userdata buffers holding the HSV colors of the LEDs from
+// led_index 1 up to a given count, which Lua effects compose with bulk operations before
+// showing them all at once. Each operation is a single C call over a range of the frame
+// (the whole frame by default), and show() ends with a single refresh of the LEDs,
+// whereas fw.led_set_hsv() takes a call (and a fw.* lookup) per LED.
+class led_frame {
+public:
+    // fw.frame_create([count: int]): userdata
+    static int create(lua_State* L);
+
+    // fw.frame_fill(frame: userdata, h: int, s: int, v: int [, first: int [, last: int]])
+    //     : void
+    static int fill(lua_State* L);
+
+    // fw.frame_set(frame: userdata, first: int, colors: string | table): void
+    static int set(lua_State* L);
+
+    // fw.frame_get(frame: userdata, led_index: int): int, int, int
+    static int get(lua_State* L);
+
+    // fw.frame_scale(frame: userdata, factor: int [, first: int [, last: int]]): void
+    static int scale(lua_State* L);
+
+    // fw.frame_rotate(frame: userdata, dh: int [, first: int [, last: int]]): void
+    static int rotate(lua_State* L);
+
+    // fw.frame_blend(frame: userdata, other: userdata, alpha: int [, first: int
+    //     [, last: int]]): void
+    static int blend(lua_State* L);
+
+    // fw.frame_show(frame: userdata [, first: int [, last: int]]): void
+    static int show(lua_State* L);
+
+private:
+    constexpr led_frame() =delete;  // Ensure a static class
+
+    // Userdata layout: the header followed by `count` colors
+    struct frame_t {
+        unsigned count;
+        hsv_t* colors() { return reinterpret_cast<hsv_t*>(this + 1); }
+        const hsv_t* colors() const { return reinterpret_cast<const hsv_t*>(this + 1); }
+    };
+
+    static frame_t* _check_frame(lua_State* L, int arg);
+
+    // Check the optional range of led_index starting at `arg`, returning it 0-based and
+    // half-open.
+    static void _check_range(lua_State* L, int arg, const frame_t* frame,
+        unsigned& begin, unsigned& end);
+};
@@ -1,90 +1,245 @@
 #include "log.h"
 
+#include "config.hpp"           // for EXECUTE_LATER_QUEUE_SIZE, ...
 #include "lexecute.hpp"
+#include "lprofile.hpp"         // for mem_phase_scope
 #include "lua.hpp"
 
 
 
 namespace lua {
 
-int execute_later(lua_State* L)
+static_assert( (EXECUTE_LATER_QUEUE_SIZE & (EXECUTE_LATER_QUEUE_SIZE - 1)) == 0 );
+
+// An argument is copied by value if it is not collectable. Otherwise, it is kept in the
+// registry, whose slots freed by luaL_unref() are reused without allocating.
+struct arg_t {
+    enum : uint8_t { ARG_NIL, ARG_BOOLEAN, ARG_POINTER, ARG_INTEGER, ARG_FLOAT, ARG_REF };
+
+    uint8_t type;
+    union {
+        bool b;
+        void* p;
+        lua_Integer i;
+        lua_Number n;
+        int ref;
+    };
+};
+
+struct call_t {
+    int rfunc;                  // registry ref to the function or to the packed frame
+    uint8_t nargs;              // or PACKED
+    arg_t args[EXECUTE_LATER_INLINE_ARGS];
+};
+
+// A call with more arguments than EXECUTE_LATER_INLINE_ARGS is packed into a call frame.
+constexpr uint8_t PACKED = 0xff;
+
+// Ring of pending calls, indexed by free-running counters
+static call_t _calls[EXECUTE_LATER_QUEUE_SIZE];
+static unsigned _head;
+static unsigned _tail;
+
+// Number of call frames spilled into the list in the registry under `&execute_later`,
+// once the ring is full.
+static unsigned _spill_count;
+
+// Save the top value into the argument, popping it.
+static void _save_arg(lua_State* L, arg_t& arg)
 {
-    LOG_DEBUG("Lua: execute_later()");
-    luaL_checktype(L, 1, LUA_TFUNCTION);
-    int n = lua_gettop(L);
-    lua_newtable(L);
+    switch ( lua_type(L, -1) ) {
+        case LUA_TNIL:
+            arg.type = arg_t::ARG_NIL;
+            break;
+
+        case LUA_TBOOLEAN:
+            arg.type = arg_t::ARG_BOOLEAN;
+            arg.b = lua_toboolean(L, -1);
+            break;
+
+        case LUA_TLIGHTUSERDATA:
+            arg.type = arg_t::ARG_POINTER;
+            arg.p = lua_touserdata(L, -1);
+            break;
+
+        case LUA_TNUMBER:
+            if ( lua_isinteger(L, -1) ) {
+                arg.type = arg_t::ARG_INTEGER;
+                arg.i = lua_tointeger(L, -1);
+            }
+            else {
+                arg.type = arg_t::ARG_FLOAT;
+                arg.n = lua_tonumber(L, -1);
+            }
+            break;
+
+        default:
+            arg.type = arg_t::ARG_REF;
+            arg.ref = luaL_ref(L, LUA_REGISTRYINDEX);  // pops the value
+            return;
+    }
+    lua_pop(L, 1);
+}
+
+// Push the argument, releasing its registry ref if any.
+static void _push_arg(lua_State* L, const arg_t& arg)
+{
+    switch ( arg.type ) {
+        case arg_t::ARG_NIL:
+            lua_pushnil(L);
+            break;
+
+        case arg_t::ARG_BOOLEAN:
+            lua_pushboolean(L, arg.b);
+            break;
+
+        case arg_t::ARG_POINTER:
+            lua_pushlightuserdata(L, arg.p);
+            break;
+
+        case arg_t::ARG_INTEGER:
+            lua_pushinteger(L, arg.i);
+            break;
+
+        case arg_t::ARG_FLOAT:
+            lua_pushnumber(L, arg.n);
+            break;
+
+        default:
+            lua_rawgeti(L, LUA_REGISTRYINDEX, arg.ref);
+            luaL_unref(L, LUA_REGISTRYINDEX, arg.ref);
+    }
+}
+
+// Pack f and the arguments on the stack into a call frame { n, f, arg1, ... }. The count
+// is stored explicitly, as lua_rawlen() is not reliable with nil arguments.
+static void _pack_frame(lua_State* L, int n)
+{
+    // ( -- f arg1 ... )
+    lua_createtable(L, n + 1, 0);
     lua_insert(L, 1);
     // ( -- call_frame f arg1 ... )
     for ( int i = n ; i > 0 ; i-- )  // Pack!
-        lua_rawseti(L, 1, i);
+        lua_rawseti(L, 1, i + 1);
+    lua_pushinteger(L, n);
+    lua_rawseti(L, 1, 1);
     // ( -- call_frame )
+}
 
-    lua_pushlightuserdata(L, (void*)&execute_later);
-    lua_pushvalue(L, -1);
-    lua_insert(L, 1);
-    // ( -- &execute_later call_fram &execute_later )
-    lua_gettable(L, LUA_REGISTRYINDEX);
-    // ( -- &execute_later call_frame next_call_frame )
-    lua_rawseti(L, 2, 0);  // call_frame[0] = next_call_frame
-    // ( -- &execute_later call_frame )
-    lua_settable(L, LUA_REGISTRYINDEX);
+// Unpack the call frame on the top, returning the number of arguments.
+static int _unpack_frame(lua_State* L)
+{
+    // ( -- call_frame )
+    const int call_frame = lua_absindex(L, -1);
+    lua_rawgeti(L, call_frame, 1);
+    const int n = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    luaL_checkstack(L, n, nullptr);
+    for ( int i = 2 ; i <= n + 1 ; i++ )  // Unpack!
+        lua_rawgeti(L, call_frame, i);
+    lua_remove(L, call_frame);
+    // ( -- f arg1 ... )
+    return n - 1;
+}
+
+static void _call(lua_State* L, int nargs)
+{
+    // ( -- f arg1 ... )
+    const int status = lua_pcall(L, nargs, 0, 0);
+    // ( -- [error_msg] )
+    if ( status != LUA_OK ) {
+        l_message(lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
     // ( -- )
-    return 0;
 }
 
-bool execute_is_pending()
+int execute_later(lua_State* L)
 {
-    global_lua_state L;
+    LOG_DEBUG("Lua: execute_later()");
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    const int n = lua_gettop(L);
 
-    lua_pushlightuserdata(L, (void*)&execute_later);
-    lua_gettable(L, LUA_REGISTRYINDEX);
-    // ( -- next_call_frame )
-    bool result = lua_isnil(L, -1);
-    lua_pop(L, 1);
+    // Once any call is spilled, the following calls are also spilled to keep the order.
+    if ( _spill_count > 0 || _tail - _head == EXECUTE_LATER_QUEUE_SIZE ) {
+        _pack_frame(L, n);
+        if ( lua_rawgetp(L, LUA_REGISTRYINDEX, (void*)&execute_later) == LUA_TNIL ) {
+            lua_pop(L, 1);
+            lua_newtable(L);
+            lua_pushvalue(L, -1);
+            lua_rawsetp(L, LUA_REGISTRYINDEX, (void*)&execute_later);
+        }
+        // ( -- call_frame spill_list )
+        lua_insert(L, -2);
+        lua_rawseti(L, -2, _spill_count + 1);
+        _spill_count++;
+        return 0;
+    }
+
+    call_t& call = _calls[_tail % EXECUTE_LATER_QUEUE_SIZE];
+    if ( n - 1 > int(EXECUTE_LATER_INLINE_ARGS) ) {
+        _pack_frame(L, n);
+        call.nargs = PACKED;
+    }
+    else {
+        call.nargs = n - 1;
+        for ( int i = n - 2 ; i >= 0 ; i-- )
+            _save_arg(L, call.args[i]);
+        // ( -- f )
+    }
+    call.rfunc = luaL_ref(L, LUA_REGISTRYINDEX);
     // ( -- )
-    return !result;
+    _tail++;
+    return 0;
+}
+
+bool execute_is_pending()
+{
+    return _head != _tail || _spill_count > 0;
 }
 
 void execute_pending_calls()
 {
+    const mem_phase_scope phase(MEM_PHASE_DEFERRED);
     global_lua_state L;
     LOG_DEBUG("Lua: execute_pending_calls()");
 
-    lua_pushlightuserdata(L, (void*)&execute_later);
-    lua_pushvalue(L, -1);
-    lua_gettable(L, LUA_REGISTRYINDEX);
-    // ( -- &execute_later call_frame )
+    // Take over the spill list, so that the calls made from within the pending calls are
+    // left for the next round.
+    lua_rawgetp(L, LUA_REGISTRYINDEX, (void*)&execute_later);
+    // ( -- spill_list | nil )
+    const int spill_list = lua_absindex(L, -1);
+    const unsigned spill_count = _spill_count;
+    if ( spill_count > 0 ) {
+        lua_pushnil(L);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, (void*)&execute_later);
+        _spill_count = 0;
+    }
 
-    const int call_frame = lua_absindex(L, -1);
-    while ( !lua_isnil(L, -1) ) {
-        // ( -- &execute_later call_frame )
-        int n = lua_rawlen(L, -1);  // Counts from call_frame[1], not call_frame[0].
-        for ( int i = 1 ; i <= n ; i++ )  // Unpack!
-            lua_rawgeti(L, call_frame, i);
-        // ( -- &execute_later call_frame f arg1 ... )
-        int status = lua_pcall(L, n - 1, 0, 0);
-        // ( -- &execute_later call_frame [error_msg] )
-        if ( status != LUA_OK ) {
-            l_message(lua_tostring(L, -1));
-            lua_pop(L, 1);
+    for ( unsigned n = _tail - _head ; n > 0 ; n-- ) {
+        // Copy the call out, as its slot can be reused by the calls made from within it.
+        const call_t call = _calls[_head++ % EXECUTE_LATER_QUEUE_SIZE];
+        lua_rawgeti(L, LUA_REGISTRYINDEX, call.rfunc);
+        luaL_unref(L, LUA_REGISTRYINDEX, call.rfunc);
+        if ( call.nargs == PACKED )
+            _call(L, _unpack_frame(L));
+        else {
+            // ( -- f )
+            luaL_checkstack(L, call.nargs, nullptr);
+            for ( unsigned i = 0 ; i < call.nargs ; i++ )
+                _push_arg(L, call.args[i]);
+            // ( -- f arg1 ... )
+            _call(L, call.nargs);
         }
-        // ( -- &execute_later call_frame )
+    }
 
-        // Clean up each call frame.
-        lua_rawgeti(L, -1, 0);
-        lua_insert(L, -2);
-        // ( -- &execute_later next_call_frame call_frame )
-        lua_pushnil(L);
-        // ( -- &execute_later next_call_frame call_frame nil )
-        lua_rawseti(L, -2, 0);  // call_frame[0] = nil
-        // ( -- &execute_later next_call_frame call_frame )
-        lua_pop(L, 1);
-        // ( -- &execute_later next_call_frame )
+    for ( unsigned i = 1 ; i <= spill_count ; i++ ) {
+        lua_rawgeti(L, spill_list, i);
+        // ( -- spill_list call_frame )
+        _call(L, _unpack_frame(L));
     }
 
-    // Clean up the pending call list.
-    // ( -- &execute_later nil )
-    lua_settable(L, LUA_REGISTRYINDEX);
+    lua_pop(L, 1);
     // ( -- )
 }
 
@@ -6,16 +6,17 @@ struct lua_State;
 
 namespace lua {
 
-// Enqueue the given function and the arguments into a call frame in the pending call
-// list.
+// Enqueue the given function and the arguments into the ring of pending calls, which
+// stores them without allocating on the Lua heap (See EXECUTE_LATER_QUEUE_SIZE in
+// config.hpp). Calls that do not fit are packed into Lua tables instead.
 // fw.execute_later(f, arg1, ...): void
 int execute_later(lua_State* L);
 
-// Check whether the pending call list contains any entries.
+// Check whether any calls are pending.
 bool execute_is_pending();
 
-// Execute all stored call frames in the pending call list (in reverse order), running
-// each function with its arguments in a protected environment.
+// Execute the pending calls in the order they were enqueued, running each function with
+// its arguments in a protected environment. Calls enqueued meanwhile are left pending.
 void execute_pending_calls();
 
 }
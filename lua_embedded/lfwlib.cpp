@@ -1,16 +1,31 @@
 // The "fw" module exposes firmware utility functions to Lua.
 
 #include "board.h"              // for system_reset(), sam0_flashpage_aux_get(), ...
-#include "compiler_hints.h"     // for UNREACHABLE()
-#include "is31fl3733.h"         // for is31_set_color(), IS31_LEDS, ...
-#include "log.h"                // for get/set_log_mask(), vlog_backup()
+#include "compiler_hints.h"     // for UNREACHABLE(), unlikely()
+#include "is31fl3733.h"         // for is31_set_color(), is31_abm_assign(), ...
+#include "log.h"                // for get/set_log_mask(), vlog_backup(), ...
+#include "periph/wdt.h"         // for wdt_kick()
 #include "ps.h"                 // for ps()
+#include "time_units.h"         // for US_PER_SEC
+#include "ztimer.h"             // for ztimer_now(), ztimer_sleep()
+
+extern "C" {
+#include "lstate.h"             // for G(), global_State::seed
+#include "lstring.h"            // for luaS_hash(), TString, UTString
+}
 
 #include <cstdio>               // for std::vprintf(), va_list
+#include <iterator>             // for std::size()
+#include "action_table.hpp"     // for action_table::lit(), ...
+#include "config.hpp"           // for ENABLE_NATIVE_EFFECTS, ...
+#include "effects_thread.hpp"   // for effects_thread::select(), find_effect(), ...
 #include "hid_keycodes.hpp"     // for keycode_to_name[]
 #include "hsv.hpp"              // for fast_hsv2rgb_32bit(), cie1931()
+#include "lcollect.hpp"         // for gc_stats()
+#include "led_frame.hpp"        // for led_frame::create(), ...
 #include "main_key_events.hpp"  // for main_key_events::start_defer(), ...
 #include "lexecute.hpp"         // for execute_later()
+#include "lprofile.hpp"         // for mem_profile()
 #include "lua.hpp"
 #include "persistent.hpp"       // for persistent::_get/_set(), ...
 #include "timer.hpp"            // for _timer_t::create(), ...
@@ -90,7 +105,174 @@ static int fw_led_set_hsv(lua_State* L)
 
 static int fw_led_refresh(lua_State*)
 {
-    is31_refresh_colors();
+    // Do not block main_thread for the I2C transfer.
+    is31_refresh_colors_async(nullptr, nullptr);
+    return 0;
+}
+
+static is31_abm_t _check_abm(lua_State* L, int arg)
+{
+    const lua_Integer abm = luaL_checkinteger(L, arg);
+    luaL_argcheck(L, abm >= IS31_ABM_NONE && abm <= IS31_ABM_3, arg, "invalid abm");
+    return is31_abm_t(abm);
+}
+
+static int fw_led_abm_configure(lua_State* L)
+{
+    const is31_abm_t abm = _check_abm(L, 1);
+    luaL_argcheck(L, abm != IS31_ABM_NONE, 1, "invalid abm");
+
+    const lua_Integer t1 = luaL_checkinteger(L, 2);
+    const lua_Integer t2 = luaL_checkinteger(L, 3);
+    const lua_Integer t3 = luaL_checkinteger(L, 4);
+    const lua_Integer t4 = luaL_checkinteger(L, 5);
+    const lua_Integer loops = luaL_optinteger(L, 6, 0);
+    luaL_argcheck(L, t1 >= 0 && t1 <= 7, 2, "out of range");
+    luaL_argcheck(L, t2 >= 0 && t2 <= 8, 3, "out of range");
+    luaL_argcheck(L, t3 >= 0 && t3 <= 7, 4, "out of range");
+    luaL_argcheck(L, t4 >= 0 && t4 <= 8, 5, "out of range");
+    luaL_argcheck(L, loops >= 0 && loops <= 0xfff, 6, "out of range");
+
+    const is31_abm_timing_t timing = {
+        uint8_t(t1), uint8_t(t2), uint8_t(t3), uint8_t(t4), uint16_t(loops),
+        bool(lua_toboolean(L, 7))
+    };
+    is31_abm_configure(abm, &timing);
+    return 0;
+}
+
+static int fw_led_abm_assign(lua_State* L)
+{
+    const is31_abm_t abm = _check_abm(L, 1);
+    const lua_Integer first = luaL_checkinteger(L, 2);
+    const lua_Integer last = luaL_optinteger(L, 3, first);
+    luaL_argcheck(L, first > 0 && first <= lua_Integer(ALL_LED_COUNT), 2,
+        "invalid led_index");
+    luaL_argcheck(L, last >= first && last <= lua_Integer(ALL_LED_COUNT), 3,
+        "invalid led_index");
+
+    is31_abm_assign(&IS31_LEDS[first - 1], last - first + 1, abm);
+    return 0;
+}
+
+static int fw_led_abm_start(lua_State*)
+{
+    is31_abm_start();
+    return 0;
+}
+
+// Push the counters per refresh as { transactions=, bus_bytes=, us= }.
+static void _push_pwm_stats(lua_State* L, const is31_pwm_stats_t& stats)
+{
+    const uint32_t n = stats.refreshes | (stats.refreshes == 0);
+    lua_createtable(L, 0, 3);
+    lua_pushinteger(L, stats.transactions / n);
+    lua_setfield(L, -2, "transactions");
+    lua_pushinteger(L, stats.bus_bytes / n);
+    lua_setfield(L, -2, "bus_bytes");
+    lua_pushinteger(L, stats.busy_us / n);
+    lua_setfield(L, -2, "us");
+}
+
+static int fw_led_benchmark(lua_State* L)
+{
+    const int n = luaL_optinteger(L, 1, 10);
+    luaL_argcheck(L, n > 0, 1, "must be positive");
+
+    // Typical sets of LEDs updated together, by slot_index
+    static constexpr uint8_t TRACE_SLOTS[] = { 3, 17, 22, 35, 41, 48, 53, 64 };
+    static constexpr struct {
+        const char* name;
+        const uint8_t* slots;  // nullptr for the slots from 1 to `count`
+        unsigned count;
+    } PATTERNS[] = {
+        { "key", TRACE_SLOTS, 1 },
+        { "trace", TRACE_SLOTS, std::size(TRACE_SLOTS) },
+        { "row", nullptr, 15 },
+        { "keys", nullptr, KEY_LED_COUNT },
+        { "all", nullptr, ALL_LED_COUNT }
+    };
+
+    lua_createtable(L, 0, std::size(PATTERNS) + 1);
+    for ( const auto& pattern : PATTERNS ) {
+        uint8_t need_update[DRIVER_COUNT][PWM_REGISTER_COUNT / 8] = {};
+        for ( unsigned i = 0 ; i < pattern.count ; i++ ) {
+            const unsigned slot_index = pattern.slots ? pattern.slots[i] : i + 1;
+            const is31_led_t led = IS31_LEDS[slot_index - 1];
+            // reg_r and reg_b follow reg_g by CS_LINE_COUNT each.
+            for ( unsigned j = 0, reg = led.reg_g ; j < 3 ; j++, reg += CS_LINE_COUNT )
+                need_update[led.driver][reg / 8] |= 1u << (reg % 8);
+        }
+
+        lua_createtable(L, 0, 2);
+        for ( const bool coalesce : { false, true } ) {
+            is31_pwm_stats_t stats = {};
+            for ( int i = 0 ; i < n ; i++ )
+                is31_benchmark_pwm_refresh(need_update, coalesce, &stats);
+            _push_pwm_stats(L, stats);
+            lua_setfield(L, -2, coalesce ? "coalesced" : "runs");
+        }
+        lua_setfield(L, -2, pattern.name);
+    }
+
+    is31_pwm_stats_t stats;
+    is31_get_pwm_stats(&stats);
+    _push_pwm_stats(L, stats);
+    lua_setfield(L, -2, "live");
+    return 1;
+}
+
+static hsv_t _check_hsv(lua_State* L, int arg)
+{
+    return {
+        uint16_t(luaL_checkinteger(L, arg) % HSV_HUE_STEPS),
+        uint8_t(luaL_checkinteger(L, arg + 1)),
+        uint8_t(luaL_checkinteger(L, arg + 2))
+    };
+}
+
+// The fw.effect_*() functions do nothing without ENABLE_NATIVE_EFFECTS, where
+// effects_thread is not created, and fw.effect_start() returns false then.
+
+static int fw_effect_start(lua_State* L)
+{
+    const effect_t* const effect = find_effect(luaL_checkstring(L, 1));
+    if ( !ENABLE_NATIVE_EFFECTS || effect == nullptr ) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+
+    const effect_params_t params = {
+        _check_hsv(L, 2),
+        uint32_t(luaL_optinteger(L, 5, effect->default_arg))
+    };
+    luaL_argcheck(L, params.arg > 0 || effect->default_arg == 0, 5, "invalid arg");
+    effects_thread::select(effect, params);
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+static int fw_effect_stop(lua_State*)
+{
+    if constexpr ( ENABLE_NATIVE_EFFECTS )
+        effects_thread::stop();
+    return 0;
+}
+
+static int fw_effect_override(lua_State* L)
+{
+    int slot_index = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, (slot_index > 0 && slot_index <= (int)ALL_LED_COUNT), 1,
+        "invalid slot_index");
+
+    if constexpr ( !ENABLE_NATIVE_EFFECTS )
+        return 0;
+    if ( lua_isnoneornil(L, 2) )
+        effects_thread::override(slot_index, nullptr);
+    else {
+        const hsv_t color = _check_hsv(L, 2);
+        effects_thread::override(slot_index, &color);
+    }
     return 0;
 }
 
@@ -168,6 +350,55 @@ static int fw_log(lua_State* L)
     return 0;
 }
 
+static int fw_log_benchmark(lua_State* L)
+{
+    const int n = luaL_optinteger(L, 1, 400);
+    const int size = luaL_optinteger(L, 2, 64);
+    luaL_argcheck(L, n > 0, 1, "must be positive");
+    luaL_argcheck(L, size >= 8 && size <= 256, 2, "out of range");
+
+    // Each line is "%6d " + payload + '\n', which makes up `size` bytes.
+    char payload[256];
+    __builtin_memset(payload, '.', size - 8);
+    payload[size - 8] = '\0';
+
+    // While a terminal is connected, stdio_write() waits for room in the stdout buffer
+    // of CDC ACM, which usb_thread drains to the host. Once the buffer has filled up, the
+    // bytes written to stdio are therefore the bytes sent to the host, and they are timed
+    // from that point on. Twice the buffer size leaves a margin for the buffer to fill.
+    constexpr size_t FULL_BYTES = 2 * CONFIG_USBUS_CDC_ACM_STDOUT_BUF_SIZE;
+    const unsigned writes = log_get_write_count();
+    const size_t bytes = log_get_write_bytes();
+    size_t full_bytes = 0;
+    uint32_t full_at = 0;
+    const uint32_t start = get_cycle_count();
+    for ( int i = 0 ; i < n ; i++ ) {
+        log_backup(LOG_DEBUG, "%6d %s", i, payload);
+        if ( full_bytes == 0 && log_get_write_bytes() - bytes >= FULL_BYTES ) {
+            full_bytes = log_get_write_bytes();
+            full_at = get_cycle_count();
+        }
+    }
+    log_flush();
+    const uint32_t end = get_cycle_count();
+    constexpr uint32_t CYCLES_PER_US = CLOCK_CORECLOCK / US_PER_SEC;
+
+    lua_createtable(L, 0, 4);
+    lua_pushinteger(L, n * size);
+    lua_setfield(L, -2, "bytes");
+    lua_pushinteger(L, log_get_write_count() - writes);
+    lua_setfield(L, -2, "writes");
+    lua_pushinteger(L, (end - start) / CYCLES_PER_US);
+    lua_setfield(L, -2, "us");
+    if ( full_bytes != 0 && end != full_at ) {
+        const uint32_t us = (end - full_at) / CYCLES_PER_US;
+        lua_pushinteger(L,
+            us ? (uint64_t)(log_get_write_bytes() - full_bytes) * US_PER_SEC / us : 0);
+        lua_setfield(L, -2, "sent_bytes_per_sec");
+    }
+    return 1;
+}
+
 static int fw_printf(lua_State* L)
 {
     const char* const format = luaL_checkstring(L, 1);
@@ -175,10 +406,18 @@ static int fw_printf(lua_State* L)
     const int argc = lua_gettop(L);
     uint32_t args[argc * 2] __attribute__((aligned(sizeof(double))));
 
+    // Keep the output in order with the logs pending in the coalescing buffer.
+    log_flush();
     lua_pushinteger(L, std::vprintf(format, make_va_list(L, args, argc)));
     return 1;
 }
 
+static int fw_log_binary(lua_State* L)
+{
+    set_log_binary(lua_toboolean(L, 1));
+    return 0;
+}
+
 static int fw_log_mask(lua_State* L)
 {
     if ( lua_gettop(L) == 0 ) {
@@ -433,16 +672,143 @@ static int fw_switchover(lua_State*)
     return 0;
 }
 
+// Latency statistics in microseconds, with a histogram of log2 buckets: bucket i
+// (1-based) counts latencies in [2^(i-1), 2^i) us, bucket 1 also counting 0 us, and the
+// last bucket counting everything above.
+class latency_stats_t {
+public:
+    void add(uint32_t cycles) {
+        const uint32_t us = cycles / (CLOCK_CORECLOCK / US_PER_SEC);
+        const unsigned i = us < 2 ? 0 : 31 - __builtin_clz(us);
+        m_buckets[i < NUM_BUCKETS ? i : NUM_BUCKETS - 1]++;
+        m_min = us < m_min ? us : m_min;
+        m_max = us > m_max ? us : m_max;
+        m_sum += us;
+        m_count++;
+    }
+
+    // Push { min=, max=, avg=, [1]=, ..., [NUM_BUCKETS]= } onto the Lua stack.
+    void push(lua_State* L) const {
+        lua_createtable(L, NUM_BUCKETS, 3);
+        for ( unsigned i = 0 ; i < NUM_BUCKETS ; i++ ) {
+            lua_pushinteger(L, m_buckets[i]);
+            lua_rawseti(L, -2, i + 1);
+        }
+        lua_pushinteger(L, m_count ? m_min : 0);
+        lua_setfield(L, -2, "min");
+        lua_pushinteger(L, m_max);
+        lua_setfield(L, -2, "max");
+        lua_pushinteger(L, m_count ? m_sum / m_count : 0);
+        lua_setfield(L, -2, "avg");
+    }
+
+private:
+    static constexpr unsigned NUM_BUCKETS = 16;
+    uint32_t m_buckets[NUM_BUCKETS] = {};
+    uint32_t m_min = UINT32_MAX;
+    uint32_t m_max = 0;
+    uint64_t m_sum = 0;
+    uint32_t m_count = 0;
+};
+
+static int fw_usb_latency_test(lua_State* L)
+{
+    const int n = luaL_optinteger(L, 1, 100);
+    const uint8_t keycode = luaL_optinteger(L, 2, KC_RESERVED);
+    luaL_argcheck(L, n > 0, 1, "must be positive");
+    luaL_argcheck(L, keycode != KC_NO && keycode < KC_LCTRL, 2, "invalid keycode");
+
+    // A sample will fail if not acknowledged within this time.
+    constexpr uint32_t SAMPLE_TIMEOUT_MS = 4 * KEYBOARD_REPORT_INTERVAL_MS + 10;
+
+    using probe_t = usbus_hid_keyboard_t::latency_probe_t;
+    probe_t& probe = usb_thread::latency_probe();
+    latency_stats_t queued, transfer, total;
+    int failed = 0;
+
+    probe.keycode = keycode;
+    for ( int i = 0 ; i < 2 * n ; i++ ) {
+        probe.state = probe_t::IDLE;
+        // usb_thread preempts us and reports the event right away, or in the next
+        // packet frame if the current one is occupied.
+        if ( i % 2 == 0 )
+            usb_thread::send_press(keycode);
+        else
+            usb_thread::send_release(keycode);
+
+        const uint32_t since = ztimer_now(ZTIMER_MSEC);
+        while ( probe.state != probe_t::ACKED && probe.state != probe_t::FAILED
+          && ztimer_now(ZTIMER_MSEC) - since < SAMPLE_TIMEOUT_MS )
+            ztimer_sleep(ZTIMER_MSEC, 1);
+
+#ifdef DEVELHELP
+        wdt_kick();
+#endif
+
+        if ( probe.state != probe_t::ACKED ) {
+            failed++;
+            continue;
+        }
+        queued.add(probe.submitted_at - probe.queued_at);
+        transfer.add(probe.acked_at - probe.submitted_at);
+        total.add(probe.acked_at - probe.queued_at);
+    }
+    probe.keycode = KC_NO;
+
+    lua_createtable(L, 0, 4);
+    lua_pushinteger(L, failed);
+    lua_setfield(L, -2, "failed");
+    queued.push(L);
+    lua_setfield(L, -2, "queued");
+    transfer.push(L);
+    lua_setfield(L, -2, "transfer");
+    total.push(L);
+    lua_setfield(L, -2, "total");
+    return 1;
+}
+
+
 
+static int fw_index_benchmark(lua_State* L);
 
 // Flash-resident table of `fw.*` C functions, sorted alphabetically by `name` so
-// _fw_index() can binary-search it. Storing it as `static constexpr` keeps the array
-// (and its string literals) in .rodata, so no Lua hash node is allocated for any entry.
-// The doc comment for each function appears at its alphabetical position.
+// _fw_index() can binary-search it if the perfect hash is not available. Storing it as
+// `static constexpr` keeps the array (and its string literals) in .rodata, so no Lua
+// hash node is allocated for any entry. The doc comment for each function appears at
+// its alphabetical position.
 //
 // Note: because lookups go through __index, `pairs(fw)` and `next(fw, k)` will only see
-// fields actually present in the fw table (i.e. `nvm`), not the entries listed below.
+// fields actually present in the fw table (i.e. `nvm` and the cached functions), not the
+// entries listed below.
 static constexpr luaL_Reg fw_lib[] = {
+// fw.action_is_pressed(action: int): bool
+// Checks if the action is pressed, as Base:is_pressed() does.
+    { "action_is_pressed", action_table::_is_pressed },
+
+// fw.action_lit(keycode: int): int | void
+// Adds an action for Lit() to the action table and returns its index, or nothing if the
+// table is full.
+// The `fw.action_*()` functions support the Action class implementation. See comments
+// in class.lua and action_table.hpp for more details.
+    { "action_lit", action_table::lit },
+
+// fw.action_modif(modifier: int, modified: int, original: int [, flavor: int])
+//     : int | void
+// Adds an action for ModIf() with the given actions, which must precede it in the table.
+    { "action_modif", action_table::modif },
+
+// fw.action_press(action: int): void
+// Executes the action for a press, as Base:_press() does.
+    { "action_press", action_table::_press },
+
+// fw.action_pseudo(): int | void
+// Adds an action for Pseudo().
+    { "action_pseudo", action_table::pseudo },
+
+// fw.action_release(action: int): void
+// Executes the action for a release, as Base:_release() does.
+    { "action_release", action_table::_release },
+
 // fw.defer_is_pending(slot_index: int, is_press: bool): bool
 // Checks if a key press/release event is deferred on the given slot.
     { "defer_is_pending", main_key_events::defer_is_pending },
@@ -465,10 +831,82 @@ static constexpr luaL_Reg fw_lib[] = {
 // Reboots the system into DFU mode.
     { "dfu_mode", fw_dfu_mode },
 
+// fw.effect_override(slot_index: int [, h: int, s: int, v: int]): void
+// Draws the LED in the HSV color on top of the native effect, e.g. for a lamp, or
+// stops doing it if no color is given. Up to 8 LEDs can be overridden at a time.
+    { "effect_override", fw_effect_override },
+
+// fw.effect_start(name: string, h: int, s: int, v: int [, arg: int]): bool
+// Starts the native effect `name` ("breathing", "rainbow", "ripple", "solid" or "trace")
+// in the HSV color, which is then rendered in effects_thread without running any Lua
+// code per frame or per key event. `arg` is the period in ms for "breathing",
+// "rainbow" and "trace", or the speed in key widths per second for "ripple". Returns
+// false if no such effect is found, or if the firmware is built without
+// ENABLE_NATIVE_EFFECTS (config.hpp).
+    { "effect_start", fw_effect_start },
+
+// fw.effect_stop(): void
+// Stops the native effect, leaving the LEDs to Lua again.
+    { "effect_stop", fw_effect_stop },
+
 // fw.execute_later(f, arg1, ...): void
 // Schedules `f(arg1, ...)` to execute after all current key event processing completes.
     { "execute_later", execute_later },
 
+// fw.frame_blend(frame: userdata, other: userdata, alpha: int [, first: int
+//     [, last: int]]): void
+// Blends the colors of `other` into the frame by alpha / 256 (0 to 256), going around
+// the hue circle the shorter way.
+    { "frame_blend", led_frame::blend },
+
+// fw.frame_create([count: int]): userdata
+// Creates and returns an LED frame holding the HSV colors of the LEDs from led_index 1
+// to `count` (ALL_LED_COUNT by default), initially all black. The `fw.frame_*()`
+// functions operate on the LEDs from `first` to `last` in the frame (all of them by
+// default) in a single call, and changes take effect only after fw.frame_show().
+// A frame takes 4 bytes per LED from the Lua heap.
+    { "frame_create", led_frame::create },
+
+// fw.frame_fill(frame: userdata, h: int, s: int, v: int [, first: int [, last: int]])
+//     : void
+// Sets the LEDs to the same HSV color.
+    { "frame_fill", led_frame::fill },
+
+// fw.frame_get(frame: userdata, led_index: int): int, int, int
+// Returns the HSV color of the LED in the frame.
+    { "frame_get", led_frame::get },
+
+// fw.frame_rotate(frame: userdata, dh: int [, first: int [, last: int]]): void
+// Rotates the hue of the LEDs by dh, which may be negative.
+    { "frame_rotate", led_frame::rotate },
+
+// fw.frame_scale(frame: userdata, factor: int [, first: int [, last: int]]): void
+// Scales the brightness (v) of the LEDs by factor / 256, saturating at 255.
+    { "frame_scale", led_frame::scale },
+
+// fw.frame_set(frame: userdata, first: int, colors: string | table): void
+// Sets the LEDs from `first` on to the given colors, either packed into a string as 4
+// bytes each (h in little endian, s, v) or listed in a table as { h, s, v, h, s, ... }.
+    { "frame_set", led_frame::set },
+
+// fw.frame_show(frame: userdata [, first: int [, last: int]]): void
+// Applies the colors in the frame to the RGB LEDs and refreshes them at once, as
+// fw.led_set_hsv() and fw.led_refresh() would do for each LED.
+    { "frame_show", led_frame::show },
+
+// fw.gc_stats(): table
+// Returns the statistics of the idle-time garbage collection (See ENABLE_LUA_IDLE_GC in
+// config.hpp) as { kb=, max_pause_us=, steps=, cycles=, cycles_per_min=, emergencies= },
+// where `kb` is the current heap usage, `max_pause_us` the longest time spent in a
+// collection at once, and `emergencies` the number of full collections forced by
+// LUA_GC_EMERGENCY_PERCENT.
+    { "gc_stats", gc_stats },
+
+// fw.index_benchmark([n: int]): table
+// Looks up the fw_lib[] names n times (10000 by default) using the binary search and
+// then the perfect hash, and returns { search=, hash= } in lookups per second.
+    { "index_benchmark", fw_index_benchmark },
+
 // fw.keycode(keyname: string): int | void
 // Returns the keycode (a.k.a. scan code) for the given keyname, which can be passed to
 // fw.send_key(). Refer to hid_keycodes.hpp for valid key names.
@@ -481,9 +919,37 @@ static constexpr luaL_Reg fw_lib[] = {
 // Turns the debug LED on (x=1), off (x=0), or toggle (x=-1).
     { "led0", fw_led0 },
 
+// fw.led_abm_assign(abm: int, first: int [, last: int]): void
+// Assigns the RGB LEDs from `first` to `last` (only `first` by default) to the hardware
+// auto breath mode `abm` (1 to 3), in which they breathe by themselves up to their
+// colors with no CPU or I2C work per frame, or back to normal (0).
+    { "led_abm_assign", fw_led_abm_assign },
+
+// fw.led_abm_configure(abm: int, t1: int, t2: int, t3: int, t4: int [, loops: int
+//     [, end_on: bool]]): void
+// Sets the timing of the auto breath mode `abm` (1 to 3): rising over 0.21 s << t1
+// (0-7), staying on for 0.21 s << (t2 - 1) (0 for none, up to 8), falling over
+// 0.21 s << t3 and staying off for 0.21 s << (t4 - 1), repeated `loops` times (0 for
+// endless by default), and then ending off, or on if `end_on`. Takes effect at
+// fw.led_abm_start().
+    { "led_abm_configure", fw_led_abm_configure },
+
+// fw.led_abm_start(): void
+// (Re)starts all auto breath modes in sync.
+    { "led_abm_start", fw_led_abm_start },
+
+// fw.led_benchmark([n: int]): table
+// Rewrites the PWM registers of typical sets of LEDs ("key", "trace", "row", "keys" and
+// "all") with their current colors n times (10 by default), writing each run of them
+// separately and then coalescing the runs. Returns the average cost per refresh as
+// { key={ runs={ transactions=, bus_bytes=, us= }, coalesced={ ... } }, trace=..., ...,
+// live={ ... } }, where `live` averages all the actual refreshes since boot.
+    { "led_benchmark", fw_led_benchmark },
+
 // fw.led_refresh(): void
 // Applies buffered color updates to the RGB LEDs. Changes are staged via
-// fw.led_set_rgb() or fw.led_set_hsv().
+// fw.led_set_rgb() or fw.led_set_hsv(). Returns without waiting for the I2C transfer,
+// and refreshes made while one is in progress are merged into the next one.
     { "led_refresh", fw_led_refresh },
 
 // fw.led_set_hsv(led_index: int, h: int, s: int, v: int): void
@@ -515,6 +981,23 @@ static constexpr luaL_Reg fw_lib[] = {
 //   - %p: tables, functions, or userdata (logged as raw pointers, e.g., 0x12345678)
     { "log", fw_log },
 
+// fw.log_benchmark([n: int [, size: int]]): table
+// Logs n lines of `size` bytes each (400 and 64 by default) as fast as possible, and
+// returns { bytes=, writes=, us=, sent_bytes_per_sec= }, where `writes` is the number
+// of stdio_write() calls (i.e. usbus wakeups) made for them, and `sent_bytes_per_sec`
+// is the CDC ACM throughput to the host, measured once the stdout buffer
+// (CONFIG_USBUS_CDC_ACM_STDOUT_BUF_SIZE) has filled up. It is missing if the lines do
+// not add up to twice the buffer size. Run it with a terminal connected (e.g. dalua);
+// otherwise, CDC ACM discards the oldest bytes instead of sending them, and the number
+// is meaningless.
+    { "log_benchmark", fw_log_benchmark },
+
+// fw.log_binary(enable: bool): void
+// Switches the log output on the serial port to binary log records, which are much
+// cheaper to produce than formatted lines. Use `./dalogdecode /dev/ttyACMx` instead of
+// `dalua` to read them. Note that the REPL output is not affected.
+    { "log_binary", fw_log_binary },
+
 // fw.log_mask(): int
 // Returns the current log mask configured in the firmware.
 //
@@ -529,6 +1012,19 @@ static constexpr luaL_Reg fw_lib[] = {
 //   - 128: Logs from main_thread
     { "log_mask", fw_log_mask },
 
+// fw.mem_profile(enable: bool): void
+// Starts (or restarts) profiling the allocations on the Lua heap if true, or stops it
+// otherwise, writing the results into the logs (See `./dalog`). The profile counts the
+// allocations and frees per phase (key, lamp, timer, repl, deferred and other), and the
+// allocations per call site, identified by the Lua function (source:linedefined).
+// Profiling takes about 800 bytes from the Lua heap while running.
+//
+// fw.mem_profile(): table | void
+// Returns the profile in progress as { phases={ key={ allocs=, bytes=, frees=, freed= },
+// ... }, sites={ { source=, line=, allocs=, bytes= }, ... } }, with the sites sorted by
+// bytes, or nothing if not profiling.
+    { "mem_profile", mem_profile },
+
 // fw.pack(...): table
 // Equivalent to table.pack(); packs arguments into a table with a field 'n' for count.
     // { "pack", fw_pack },
@@ -580,8 +1076,8 @@ static constexpr luaL_Reg fw_lib[] = {
 // Performs a system reset, rebooting the system.
     { "system_reset", fw_system_reset },
 
-// fw.timer_create(): userdata
-// Creates and returns a timer instance.
+// fw.timer_create(callback): userdata
+// Creates and returns a timer instance. `callback` is called whenever the timer expires.
 // The `fw.timer_*()` functions support the Timer class implementation. See comments in
 // class.lua for more details.
     { "timer_create", _timer_t::create },
@@ -590,10 +1086,9 @@ static constexpr luaL_Reg fw_lib[] = {
 // Returns the elapsed time since the epoch if the timer is active, or nothing otherwise.
     { "timer_now", _timer_t::now },
 
-// fw.timer_start(timer: userdata, callback, timeout_ms: int [, repeated: bool]): int
+// fw.timer_start(timer: userdata, timeout_ms: int [, repeated: bool]): int
 // Starts or restarts the timer, setting its epoch to the current time. Returns 0 as the
-// initial elapsed time since the epoch. `callback` is called when the timer expires
-// later.
+// initial elapsed time since the epoch.
     { "timer_start", _timer_t::start },
 
 // fw.timer_stop(timer: userdata): bool
@@ -604,39 +1099,176 @@ static constexpr luaL_Reg fw_lib[] = {
 // fw.unpack(t: table [, i: int [, j: int]]): (...)
 // Equivalent to table.unpack(); returns the elements of the table from index i to j.
     // { "unpack", fw_unpack },
+
+// fw.usb_latency_test([n: int [, keycode: int]]): table
+// Sends n press/release pairs of the keycode (a reserved usage that hosts ignore, by
+// default) and measures the latency of each event in microseconds, using the cycle
+// counter. Returns { failed=, queued=, transfer=, total= }, where
+//   - queued: from report_event() until the report is submitted to the host,
+//   - transfer: from the submission until the host acknowledges it,
+//   - total: queued + transfer,
+// each being { min=, max=, avg=, [1]=, ..., [16]= } with log2 histogram buckets (the
+// i-th bucket counts latencies in [2^(i-1), 2^i) us).
+// To correlate with host-side timestamps (see ./dalatency), pass a key that the host
+// can see but does not act on, e.g. fw.keycode("F24").
+// It blocks the keymap while running, so call it from REPL.
+    { "usb_latency_test", fw_usb_latency_test },
 };
 
-// __index(fw, name): binary-search fw_lib[] and push the matching C function, or
-// nil if not found. Called for every `fw.<name>` access except `fw.nvm`, which is
-// stored as a real field on the fw table and is therefore resolved before __index
-// runs.
-static int _fw_index(lua_State* L)
+static constexpr int FW_LIB_SIZE = int(sizeof(fw_lib) / sizeof(fw_lib[0]));
+
+static constexpr bool _is_sorted(const luaL_Reg* lib, int size)
 {
-    const char* key = luaL_checkstring(L, 2);
+    for ( int i = 1 ; i < size ; i++ ) {
+        const char* a = lib[i - 1].name;
+        const char* b = lib[i].name;
+        while ( *a != '\0' && *a == *b ) {
+            a++;
+            b++;
+        }
+        if ( (unsigned char)*a >= (unsigned char)*b )
+            return false;
+    }
+    return true;
+}
+
+static_assert( _is_sorted(fw_lib, FW_LIB_SIZE), "fw_lib[] must be sorted by name" );
 
-    int lo = 0, hi = int(sizeof(fw_lib) / sizeof(fw_lib[0])) - 1;
+// Binary-search fw_lib[] for the key, returning its index or -1 if not found.
+static int _fw_search(const char* key)
+{
+    int lo = 0, hi = FW_LIB_SIZE - 1;
     while ( lo <= hi ) {
         int mid = (lo + hi) >> 1;
         int cmp = __builtin_strcmp(key, fw_lib[mid].name);
-        if ( cmp == 0 ) {
-            lua_pushcfunction(L, fw_lib[mid].func);
-            return 1;
-        }
+        if ( cmp == 0 )
+            return mid;
         if ( cmp < 0 )
             hi = mid - 1;
         else
             lo = mid + 1;
     }
+    return -1;
+}
+
+// Perfect hash of the fw_lib[] names, keyed by the hash that Lua stores in the TString
+// header of each interned short string, so that a lookup computes no hash at all. The
+// top FW_HASH_BITS bits of (hash * _fw_multiplier) give a distinct slot for every name.
+// Since Lua seeds its string hash per state (See luai_makeseed()), the multiplier is
+// searched in luaopen_fw() rather than at compile time.
+constexpr unsigned FW_HASH_BITS = 8;
+static_assert( FW_LIB_SIZE * 4 <= (1 << FW_HASH_BITS), "FW_HASH_BITS too small" );
+
+static uint8_t _fw_slots[1 << FW_HASH_BITS];  // index + 1 into fw_lib[], or 0 if none
+static uint32_t _fw_multiplier = 0;           // or 0 if not found
 
-    return 0;  // not found; Lua resolves the access to nil.
+static inline unsigned _fw_slot(unsigned hash, uint32_t multiplier)
+{
+    return (hash * multiplier) >> (32 - FW_HASH_BITS);
+}
+
+static void _fw_build_hash(lua_State* L)
+{
+    unsigned hashes[FW_LIB_SIZE];
+    for ( int i = 0 ; i < FW_LIB_SIZE ; i++ ) {
+        const char* const name = fw_lib[i].name;
+        hashes[i] = luaS_hash(name, __builtin_strlen(name), G(L)->seed);
+    }
+
+    // Try pseudo-random odd multipliers. With the table at most 1/4 full, a few hundred
+    // trials are expected at most.
+    constexpr int MAX_TRIALS = 16384;
+    uint32_t multiplier = 0x9e3779b1u;
+    for ( int trial = 0 ; trial < MAX_TRIALS ; trial++ ) {
+        __builtin_memset(_fw_slots, 0, sizeof(_fw_slots));
+        int i = 0;
+        for ( ; i < FW_LIB_SIZE ; i++ ) {
+            uint8_t& slot = _fw_slots[_fw_slot(hashes[i], multiplier)];
+            if ( slot != 0 )
+                break;
+            slot = i + 1;
+        }
+        if ( i == FW_LIB_SIZE ) {
+            _fw_multiplier = multiplier;
+            return;
+        }
+        multiplier = (multiplier * 1664525u + 1013904223u) | 1u;
+    }
+
+    _fw_multiplier = 0;
+    LOG_WARNING("Lua: no perfect hash for fw_lib[]; falling back to binary search");
+}
+
+// Return the index of the key (from lua_tolstring()) in fw_lib[], or -1 if not found.
+static int _fw_lookup(const char* key)
+{
+    const TString* const ts = (const TString*)(key - sizeof(UTString));
+    if ( unlikely(_fw_multiplier == 0) || ts->tt != LUA_TSHRSTR )
+        return _fw_search(key);
+
+    const int i = _fw_slots[_fw_slot(ts->hash, _fw_multiplier)] - 1;
+    return ( i >= 0 && __builtin_strcmp(key, fw_lib[i].name) == 0 ) ? i : -1;
+}
+
+static int fw_index_benchmark(lua_State* L)
+{
+    const int n = luaL_optinteger(L, 1, 10000);
+    luaL_argcheck(L, n > 0, 1, "must be positive");
+
+    // Intern the names, as lundump does for the string constants in a chunk.
+    const char* keys[FW_LIB_SIZE];
+    luaL_checkstack(L, FW_LIB_SIZE + 1, nullptr);
+    for ( int i = 0 ; i < FW_LIB_SIZE ; i++ )
+        keys[i] = lua_pushstring(L, fw_lib[i].name);
+
+    volatile int found;
+    uint32_t start = get_cycle_count();
+    for ( int i = 0 ; i < n ; i++ )
+        found = _fw_search(keys[i % FW_LIB_SIZE]);
+    const uint32_t search_cycles = get_cycle_count() - start;
+
+    start = get_cycle_count();
+    for ( int i = 0 ; i < n ; i++ )
+        found = _fw_lookup(keys[i % FW_LIB_SIZE]);
+    const uint32_t hash_cycles = get_cycle_count() - start;
+    (void)found;
+
+    lua_createtable(L, 0, 2);
+    lua_pushinteger(L, (uint64_t)n * CLOCK_CORECLOCK / (search_cycles | 1));
+    lua_setfield(L, -2, "search");
+    lua_pushinteger(L, (uint64_t)n * CLOCK_CORECLOCK / (hash_cycles | 1));
+    lua_setfield(L, -2, "hash");
+    return 1;
+}
+
+// __index(fw, name): look up fw_lib[] and push the matching C function, or nil if not
+// found. Called for every `fw.<name>` access except `fw.nvm`, which is stored as a real
+// field on the fw table and is therefore resolved before __index runs, and except the
+// functions cached in the fw table with CACHE_FW_FUNCTIONS.
+static int _fw_index(lua_State* L)
+{
+    const char* key = luaL_checkstring(L, 2);
+
+    const int i = _fw_lookup(key);
+    if ( i < 0 )
+        return 0;  // not found; Lua resolves the access to nil.
+
+    lua_pushcfunction(L, fw_lib[i].func);
+    if constexpr ( CACHE_FW_FUNCTIONS ) {
+        lua_pushvalue(L, 2);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, 1);  // fw[name] = func
+    }
+    return 1;
 }
 
 int luaopen_fw(lua_State* L)
 {
     // `fw` is a tiny table that only holds the `nvm` field; every C function in the
-    // fw.* namespace is reached via __index = _fw_index, which binary-searches the
-    // flash-resident fw_lib[] above. This saves roughly one Lua hash node per
-    // function (~24 B each).
+    // fw.* namespace is reached via __index = _fw_index, which looks up the
+    // flash-resident fw_lib[] above using a perfect hash. This saves roughly one Lua
+    // hash node per function (~24 B each).
+    _fw_build_hash(L);
     lua_createtable(L, 0, 1);  // fw table that supports 1 non-array field (`nvm`).
 
 // fw.nvm: table (userdata, actually)
@@ -666,7 +1298,7 @@ int luaopen_fw(lua_State* L)
     lua_setmetatable(L, -2);
     lua_setfield(L, -2, "nvm");
 
-    // Attach the binary-search __index as fw's metatable.
+    // Attach the perfect-hash __index (See _fw_lookup()) as fw's metatable.
     lua_createtable(L, 0, 1);
     lua_pushcfunction(L, _fw_index);
     lua_setfield(L, -2, "__index");
@@ -3,13 +3,23 @@
 #include "log.h"
 #include "riotboot/slot.h"      // for riotboot_slot_get_hdr(), ...
 
+#include "action_table.hpp"     // for action_table::slot_action(), ...
+#include "config.hpp"           // for ENABLE_NATIVE_EFFECTS
+#include "effects_thread.hpp"   // for effects_thread::is_running()
 #include "lkeymap.hpp"
+#include "lprofile.hpp"         // for mem_phase_scope
 #include "lua.hpp"
+#include "main_key_events.hpp"  // for main_key_events::is_deferring(), ...
 
 
 
 namespace lua {
 
+// Effect notifications for the key events handled natively
+constexpr size_t EFFECT_BATCH_SIZE = 16;
+static main_key_events::key_event_t _effect_events[EFFECT_BATCH_SIZE];
+static size_t _effect_event_count;
+
 static const char* _reader(lua_State*, void* arg, size_t* psize)
 {
     bool& done = *(bool*)arg;
@@ -42,6 +52,10 @@ void load_keymap()
 {
     global_lua_state L;
 
+    // The keymap module fills in the action table while loading.
+    action_table::reset();
+    _effect_event_count = 0;
+
     bool done = false;
     // We pass a null chunkname argument to lua_load(). In this case, Lua will assign
     // the default value "=(load)" to the chunkname.
@@ -86,6 +100,29 @@ void load_keymap()
     lua_settable(L, LUA_REGISTRYINDEX);
     // ( -- module-table )
 
+    // Store the Lua effect driver in the registry under the key `&flush_effect_events`,
+    // and copy the table of lowered slots. Both are optional, so that the native
+    // handling is simply disabled for older modules.
+    lua_pushlightuserdata(L, (void*)&flush_effect_events);
+    if ( lua_rawgeti(L, -2, 3) == LUA_TFUNCTION ) {
+        // ( -- module-table &flush_effect_events handle_effect_events )
+        lua_settable(L, LUA_REGISTRYINDEX);
+        if ( lua_rawgeti(L, -1, 4) == LUA_TTABLE ) {
+            // ( -- module-table slot-actions )
+            lua_pushnil(L);
+            while ( lua_next(L, -2) ) {
+                // ( -- module-table slot-actions slot_index action )
+                action_table::set_slot_action(
+                    lua_tointeger(L, -2), lua_tointeger(L, -1));
+                lua_pop(L, 1);
+            }
+        }
+        lua_pop(L, 1);
+    }
+    else
+        lua_pop(L, 2);
+    // ( -- module-table )
+
     // Clean up the local objects in the module that are no longer referenced.
     lua_gc(L, LUA_GCCOLLECT, 0);
     LOG_DEBUG("Lua: current memory usage = %d KB", lua_gc(L, LUA_GCCOUNT, 0));
@@ -94,6 +131,30 @@ void load_keymap()
 
 void handle_key_event(unsigned slot_index, bool is_press)
 {
+    const mem_phase_scope phase(MEM_PHASE_KEY_EVENT);
+
+    // A lowered slot is executed natively, unless a keymap is deferring the events to
+    // make a decision on them (See Defer in class.lua).
+    const uint8_t action = action_table::slot_action(slot_index);
+    if ( action != 0 && !main_key_events::is_deferring() ) {
+        if ( is_press )
+            action_table::press(action);
+        else
+            action_table::release(action);
+
+        // A native effect gets the key events from main_thread::signal_key_event().
+        if ( ENABLE_NATIVE_EFFECTS && effects_thread::is_running() )
+            return;
+
+        if ( _effect_event_count == EFFECT_BATCH_SIZE )
+            flush_effect_events();
+        _effect_events[_effect_event_count++] = {{ uint8_t(slot_index), is_press }};
+        return;
+    }
+
+    // Keep the Effect notifications in order.
+    flush_effect_events();
+
     global_lua_state L;
 
     lua_pushlightuserdata(L, (void*)&handle_key_event);
@@ -106,8 +167,41 @@ void handle_key_event(unsigned slot_index, bool is_press)
     // ( -- )
 }
 
+void flush_effect_events()
+{
+    if ( _effect_event_count == 0 )
+        return;
+
+    const mem_phase_scope phase(MEM_PHASE_KEY_EVENT);
+    global_lua_state L;
+
+    lua_pushlightuserdata(L, (void*)&flush_effect_events);
+    lua_gettable(L, LUA_REGISTRYINDEX);
+    // ( -- handle_effect_events )
+    luaL_checkstack(L, 2 * EFFECT_BATCH_SIZE, nullptr);
+    for ( size_t i = 0 ; i < _effect_event_count ; i++ ) {
+        lua_pushinteger(L, _effect_events[i].slot_index);
+        lua_pushboolean(L, _effect_events[i].is_press);
+    }
+    // ( -- handle_effect_events slot_index is_press ... )
+    const int nargs = 2 * _effect_event_count;
+    _effect_event_count = 0;
+    lua_call(L, nargs, 0);  // Invoke handle_effect_events() outside a protected env.
+    // ( -- )
+}
+
+bool effect_events_pending()
+{
+    return _effect_event_count > 0;
+}
+
 void handle_lamp_state(uint8_t lamp_state)
 {
+    const mem_phase_scope phase(MEM_PHASE_LAMP_EVENT);
+
+    // The lamp driver also notifies the active Effect (See export.lua).
+    flush_effect_events();
+
     global_lua_state L;
 
     lua_pushlightuserdata(L, (void*)&handle_lamp_state);
@@ -12,8 +12,16 @@ void load_keymap();
 
 // C++ wrapper for the Lua-based keymap driver. Dispatches key input events from
 // firmware to user-defined mapping logic in Lua.
+// The slots lowered into the action table by the keymap module (See Action in class.lua)
+// are handled natively without entering the interpreter. Their notifications to the
+// active Effect are queued and delivered in a batch later.
 void handle_key_event(unsigned slot_index, bool is_press);
 
+// Deliver the queued Effect notifications to the Lua-based effect driver.
+void flush_effect_events();
+
+bool effect_events_pending();
+
 // C++ wrapper for the Lua-based lamp driver. Updates keyboard indicator lamps based on
 // user-defined logic in Lua.
 void handle_lamp_state(uint8_t lamp_state);
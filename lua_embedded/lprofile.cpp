@@ -0,0 +1,238 @@
+#include "log.h"
+
+#include "lprofile.hpp"
+#include "lua.hpp"
+
+
+
+namespace lua {
+
+static constexpr const char* PHASE_NAMES[NUM_MEM_PHASES] = {
+    "other", "key", "lamp", "timer", "repl", "deferred"
+};
+
+// Call sites are identified by the source and the line where the Lua function is
+// defined. Once the table is full, the last entry collects the rest.
+constexpr unsigned MAX_SITES = 24;
+constexpr unsigned SOURCE_LEN = 16;
+
+// Levels of the call stack to search for a Lua function, skipping C functions such as
+// fw.*() or the metamethods.
+constexpr int MAX_LEVELS = 4;
+
+struct phase_stats_t {
+    uint32_t allocs;            // number of allocations (including growing reallocs)
+    uint32_t bytes;             // bytes allocated
+    uint32_t frees;             // number of frees
+    uint32_t freed;             // bytes freed (including shrinking reallocs)
+};
+
+struct site_t {
+    char source[SOURCE_LEN];
+    int line;
+    uint32_t allocs;
+    uint32_t bytes;
+};
+
+struct profile_t {
+    lua_Alloc alloc;            // the original allocator and its user data
+    void* ud;
+    lua_State* L;
+    bool is_paused;             // true while reporting
+    phase_stats_t phases[NUM_MEM_PHASES];
+    unsigned site_count;
+    site_t sites[MAX_SITES];
+};
+
+// Profile in progress, stored as a userdata in the registry under `&mem_profile`
+static profile_t* _profile = nullptr;
+
+static site_t& _find_site(profile_t* profile)
+{
+    const char* source = "(C)";
+    int line = -1;
+    lua_Debug ar;
+    for ( int level = 0 ; level < MAX_LEVELS && lua_getstack(profile->L, level, &ar) ;
+      level++ ) {
+        // "S" fills in only what is already there, without allocating.
+        lua_getinfo(profile->L, "S", &ar);
+        if ( ar.what[0] != 'C' ) {
+            source = ar.short_src;
+            line = ar.linedefined;
+            break;
+        }
+    }
+
+    site_t* const sites = profile->sites;
+    for ( unsigned i = 0 ; i < profile->site_count ; i++ )
+        if ( sites[i].line == line
+          && __builtin_strncmp(sites[i].source, source, SOURCE_LEN - 1) == 0 )
+            return sites[i];
+
+    if ( profile->site_count == MAX_SITES )
+        return sites[MAX_SITES - 1];
+
+    site_t& site = sites[profile->site_count++];
+    if ( profile->site_count < MAX_SITES ) {
+        __builtin_strncpy(site.source, source, SOURCE_LEN - 1);
+        site.line = line;
+    }
+    else {
+        __builtin_strcpy(site.source, "(others)");
+        site.line = -1;
+    }
+    return site;
+}
+
+static void* _profiling_alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+    profile_t* const profile = static_cast<profile_t*>(ud);
+    // `osize` holds the type of the object being created if ptr is NULL.
+    const size_t old_size = ptr ? osize : 0;
+
+    // Find the call site before calling the allocator, which may free the old block of
+    // the Lua stack while it is being reallocated.
+    if ( nsize > old_size && !profile->is_paused ) {
+        phase_stats_t& stats = profile->phases[mem_phase_scope::current()];
+        stats.allocs++;
+        stats.bytes += nsize - old_size;
+        site_t& site = _find_site(profile);
+        site.allocs++;
+        site.bytes += nsize - old_size;
+    }
+
+    void* const block = profile->alloc(profile->ud, ptr, osize, nsize);
+
+    if ( nsize < old_size && !profile->is_paused ) {
+        phase_stats_t& stats = profile->phases[mem_phase_scope::current()];
+        if ( nsize == 0 )
+            stats.frees++;
+        stats.freed += old_size - nsize;
+    }
+    return block;
+}
+
+// Sort the sites by bytes allocated, in descending order.
+static void _sort_sites(profile_t* profile)
+{
+    site_t* const sites = profile->sites;
+    for ( unsigned i = 1 ; i < profile->site_count ; i++ ) {
+        const site_t site = sites[i];
+        unsigned j = i;
+        for ( ; j > 0 && sites[j - 1].bytes < site.bytes ; j-- )
+            sites[j] = sites[j - 1];
+        sites[j] = site;
+    }
+}
+
+static void _push_report(lua_State* L, profile_t* profile)
+{
+    lua_createtable(L, 0, 2);
+
+    lua_createtable(L, 0, NUM_MEM_PHASES);
+    for ( unsigned i = 0 ; i < NUM_MEM_PHASES ; i++ ) {
+        const phase_stats_t& stats = profile->phases[i];
+        lua_createtable(L, 0, 4);
+        lua_pushinteger(L, stats.allocs);
+        lua_setfield(L, -2, "allocs");
+        lua_pushinteger(L, stats.bytes);
+        lua_setfield(L, -2, "bytes");
+        lua_pushinteger(L, stats.frees);
+        lua_setfield(L, -2, "frees");
+        lua_pushinteger(L, stats.freed);
+        lua_setfield(L, -2, "freed");
+        lua_setfield(L, -2, PHASE_NAMES[i]);
+    }
+    lua_setfield(L, -2, "phases");
+
+    lua_createtable(L, profile->site_count, 0);
+    for ( unsigned i = 0 ; i < profile->site_count ; i++ ) {
+        const site_t& site = profile->sites[i];
+        lua_createtable(L, 0, 4);
+        lua_pushstring(L, site.source);
+        lua_setfield(L, -2, "source");
+        lua_pushinteger(L, site.line);
+        lua_setfield(L, -2, "line");
+        lua_pushinteger(L, site.allocs);
+        lua_setfield(L, -2, "allocs");
+        lua_pushinteger(L, site.bytes);
+        lua_setfield(L, -2, "bytes");
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "sites");
+}
+
+// Write the profile into the logs, which can be uploaded later using `./dalog`.
+static void _log_report(profile_t* profile)
+{
+    for ( unsigned i = 0 ; i < NUM_MEM_PHASES ; i++ ) {
+        const phase_stats_t& stats = profile->phases[i];
+        if ( stats.allocs || stats.frees )
+            LOG_INFO("Lua: mem_profile %s: %lu allocs (%lu B), %lu frees (%lu B)",
+                PHASE_NAMES[i], stats.allocs, stats.bytes, stats.frees, stats.freed);
+    }
+    for ( unsigned i = 0 ; i < profile->site_count ; i++ ) {
+        const site_t& site = profile->sites[i];
+        LOG_INFO("Lua: mem_profile %s:%d: %lu allocs (%lu B)",
+            site.source, site.line, site.allocs, site.bytes);
+    }
+}
+
+static void _start(lua_State* L)
+{
+    if ( _profile != nullptr ) {
+        // Restart with the counters cleared.
+        profile_t* const profile = _profile;
+        __builtin_memset(profile->phases, 0, sizeof(profile->phases));
+        profile->site_count = 0;
+        return;
+    }
+
+    // Allocate the buffer before the allocator is replaced, so that it is not counted.
+    profile_t* const profile =
+        static_cast<profile_t*>(lua_newuserdata(L, sizeof(profile_t)));
+    __builtin_memset(profile, 0, sizeof(profile_t));
+    lua_rawsetp(L, LUA_REGISTRYINDEX, (void*)&mem_profile);
+
+    profile->alloc = lua_getallocf(L, &profile->ud);
+    profile->L = L;
+    lua_setallocf(L, _profiling_alloc, profile);
+    _profile = profile;
+    LOG_DEBUG("Lua: mem_profile started");
+}
+
+void mem_profile_stop(lua_State* L)
+{
+    if ( _profile == nullptr )
+        return;
+
+    lua_setallocf(L, _profile->alloc, _profile->ud);
+    _profile = nullptr;
+    lua_pushnil(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, (void*)&mem_profile);
+}
+
+int mem_profile(lua_State* L)
+{
+    if ( lua_gettop(L) == 0 ) {
+        if ( _profile == nullptr )
+            return 0;
+
+        _profile->is_paused = true;
+        _sort_sites(_profile);
+        _push_report(L, _profile);
+        _profile->is_paused = false;
+        return 1;
+    }
+
+    if ( lua_toboolean(L, 1) )
+        _start(L);
+    else if ( _profile != nullptr ) {
+        _sort_sites(_profile);
+        _log_report(_profile);
+        mem_profile_stop(L);
+    }
+    return 0;
+}
+
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>              // for uint8_t
+
+
+
+struct lua_State;
+
+namespace lua {
+
+// Allocation profiler for the Lua heap, started and stopped by fw.mem_profile(). While
+// running, it wraps the TLSF allocator of the Lua state and counts the allocations and
+// frees per phase (i.e. the kind of event being handled), and the allocations per Lua
+// function (call site) as well. Its buffer is taken from the Lua heap only while
+// running.
+
+enum mem_phase_t : uint8_t {
+    MEM_PHASE_OTHER = 0,
+    MEM_PHASE_KEY_EVENT,        // lua::handle_key_event(), lua::flush_effect_events()
+    MEM_PHASE_LAMP_EVENT,       // lua::handle_lamp_state()
+    MEM_PHASE_TIMER,            // _timer_t::_hdlr_timeout()
+    MEM_PHASE_REPL,             // lua::repl::execute()
+    MEM_PHASE_DEFERRED,         // lua::execute_pending_calls()
+    NUM_MEM_PHASES
+};
+
+// Attribute the allocations to the phase until it goes out of scope.
+class mem_phase_scope {
+public:
+    explicit mem_phase_scope(mem_phase_t phase): m_saved(m_current) { m_current = phase; }
+    ~mem_phase_scope() { m_current = m_saved; }
+
+    static mem_phase_t current() { return m_current; }
+
+private:
+    const mem_phase_t m_saved;
+    static inline mem_phase_t m_current = MEM_PHASE_OTHER;
+};
+
+// fw.mem_profile([enable: bool]): table | void
+int mem_profile(lua_State* L);
+
+// Stop profiling before closing the Lua state.
+void mem_profile_stop(lua_State* L);
+
+}
@@ -1,4 +1,6 @@
 #include "assert.h"
+#include "is31fl3733.h"         // for is31_abm_reset()
+#include "log.h"                // for log_flush()
 // #include "tlsf.h"               // for tlsf_destroy()
 
 extern "C" {
@@ -6,6 +8,10 @@ extern "C" {
 #include "lualib.h"             // for luaopen_*()
 }
 
+#include "config.hpp"           // for ENABLE_LUA_IDLE_GC, ENABLE_RGB_LED, ...
+#include "effects_thread.hpp"   // for effects_thread::stop()
+#include "lcollect.hpp"         // for lua::gc_init()
+#include "lprofile.hpp"         // for lua::mem_profile_stop()
 #include "lua.hpp"
 #include "lkeymap.hpp"          // for lua::load_keymap()
 
@@ -30,6 +36,17 @@ static int _panic(lua_State* L)
     return 0;
 }
 
+// print() in the base library writes to stdout directly, which would overtake the log
+// lines still held in the coalescing buffer (See log_backup.c); write them out first.
+static int _print(lua_State* L)
+{
+    log_flush();
+    lua_pushvalue(L, lua_upvalueindex(1));  // the original print()
+    lua_insert(L, 1);
+    lua_call(L, lua_gettop(L) - 1, 0);
+    return 0;
+}
+
 // Exported from lfwlib.cpp
 extern int luaopen_fw(lua_State* L);
 
@@ -43,6 +60,9 @@ void global_lua_state::init()
     // Note: Avoid calling lua_riot_openlibs(), as it links all modules (used or not),
     // which unnecessarily increases the firmware image size.
     luaL_requiref(L, "_G", luaopen_base, 1);  // Load into the global environment.
+    lua_getfield(L, -1, "print");
+    lua_pushcclosure(L, _print, 1);
+    lua_setfield(L, -2, "print");
     // luaL_requiref(L, LUA_COLIBNAME, luaopen_coroutine, 1);   // 2K
     // luaL_requiref(L, LUA_TABLIBNAME, luaopen_table, 1);      // 3.3K
     // luaL_requiref(L, LUA_IOLIBNAME, luaopen_io, 1);          // 10.9K
@@ -58,11 +78,22 @@ void global_lua_state::init()
 
     // Load the "keymap" module into the registry.
     load_keymap();
+
+    if constexpr ( ENABLE_LUA_IDLE_GC )
+        gc_init();
 }
 
 void global_lua_state::destroy()
 {
+    // The native effect and its overrides, and the LEDs breathing in hardware are owned
+    // by the Lua state.
+    if constexpr ( ENABLE_NATIVE_EFFECTS )
+        effects_thread::stop();
+    if constexpr ( ENABLE_RGB_LED )
+        is31_abm_reset();
+    mem_profile_stop(L);
     lua_close(L);
+    L = nullptr;
     // Note that it is desirable to destory the TLSF allocator instance associated with
     // lua_memory using tlsf_destroy(tlsf). But it is known that tlsf_create_with_pool()
     // initializes the allocator metadata directly in the provided memory region, and it
@@ -70,6 +101,12 @@ void global_lua_state::destroy()
     // to resetting the allocator.
 }
 
+void* global_lua_state::borrow_memory()
+{
+    assert( L == nullptr );
+    return lua_memory;
+}
+
 bool global_lua_state::validate_bytecode(uintptr_t addr)
 {
     // Verify that the image is a valid Lua bytecode.
@@ -51,6 +51,10 @@ public:
 
     static bool validate_bytecode(uintptr_t addr);
 
+    // Return lua_memory (LUA_MEM_SIZE bytes) for use as a temporary buffer, which is
+    // allowed only while the Lua state does not exist (i.e. in DFU mode).
+    static void* borrow_memory();
+
     operator lua_State*() { return L; }
 
 private:
@@ -34,6 +34,9 @@ public:
     // Check if the queue is full with all deferred events.
     static bool terminal_full();
 
+    // Check if in defer mode, started by fw.defer_start().
+    static bool is_deferring() { return m_get == &try_peek; }
+
     // Start or stop defer mode.
     static int defer_start(lua_State* L);  // fw.defer_start(): void
     static int defer_stop(lua_State* L);   // fw.defer_stop(): void
@@ -1,7 +1,8 @@
-#include "log.h"                // for get_log_mask()
+#include "log.h"                // for get_log_mask(), log_flush()
 #include "stdio_base.h"         // for stdio_write()
 
 #include "config.hpp"           // for ENABLE_LUA_REPL
+#include "lprofile.hpp"         // for mem_phase_scope
 #include "lua.hpp"              // for LUA_COPYRIGHT, l_message(), ...
 #include "repl.hpp"
 #include "timed_stdin.hpp"      // for timed_stdin::_reader()
@@ -28,6 +29,8 @@ void repl::report(status_t status)
     global_lua_state L;
 
     if ( status == LUA_OK ) {
+        // Write out pending logs first so that they precede the results.
+        log_flush();
         for ( int i = -lua_gettop(L) ; i < 0 ; i++ ) {
             size_t l;
             const char* s = luaL_tolstring(L, i, &l);
@@ -61,11 +64,14 @@ void repl::respond(status_t status)
     // As the host operates in canonical input mode, binary status (e.g., '\x4') cannot
     // be sent directly. Convert the status into a printable ASCII character instead.
     const ping resp(status);
+    // Write out pending logs first so that they precede the response.
+    log_flush();
     stdio_write(&resp, sizeof(resp));
 }
 
 void repl::execute()
 {
+    const mem_phase_scope phase(MEM_PHASE_REPL);
     global_lua_state L;
     LOG_DEBUG("Lua: repl::execute()");
 
@@ -0,0 +1,55 @@
+// Host test of hsv2rgb_batch() against fast_hsv2rgb_32bit(), which it replaces for the
+// LED frames and the native effects. See ./Makefile.
+//
+// Only the lower 3 bits of the sextant (h >> 8) matter to either conversion, so every
+// s and v is compared for h below 0x800, which covers all the distinct cases. The rest
+// of h is compared for every s and a sample of v.
+
+#include <cstdio>               // for std::printf()
+#include <cstdlib>              // for EXIT_SUCCESS, EXIT_FAILURE
+#include "hsv.hpp"
+
+
+
+static uint32_t _reference(uint16_t h, uint8_t s, uint8_t v)
+{
+    uint8_t r, g, b;
+    fast_hsv2rgb_32bit(h, s, cie1931(v), &r, &g, &b);
+    return (uint32_t)r << 16 | (uint32_t)g << 8 | b;
+}
+
+// Compare the colors of the given h and v for all s, returning the number of mismatches.
+static unsigned _check(uint16_t h, uint8_t v)
+{
+    hsv_t hsv[256];
+    uint32_t rgb[256];
+    for ( unsigned s = 0 ; s < 256 ; s++ )
+        hsv[s] = { h, uint8_t(s), v };
+    hsv2rgb_batch(hsv, rgb, 256);
+
+    unsigned mismatches = 0;
+    for ( unsigned s = 0 ; s < 256 ; s++ ) {
+        const uint32_t expected = _reference(h, uint8_t(s), v);
+        if ( rgb[s] != expected && mismatches++ == 0 )
+            std::printf("h=0x%x s=%u v=%u: 0x%06x, expected 0x%06x\n",
+                h, s, v, (unsigned)rgb[s], (unsigned)expected);
+    }
+    return mismatches;
+}
+
+int main()
+{
+    unsigned long mismatches = 0;
+    unsigned long count = 0;
+
+    for ( unsigned h = 0 ; h <= 0xffff ; h++ ) {
+        const unsigned v_step = h < 0x800 ? 1 : 51;
+        for ( unsigned v = 0 ; v < 256 ; v += v_step ) {
+            mismatches += _check(uint16_t(h), uint8_t(v));
+            count += 256;
+        }
+    }
+
+    std::printf("hsv_test: %lu of %lu colors mismatched\n", mismatches, count);
+    return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,56 +1,116 @@
+#include <algorithm>            // for std::min()
 #include <new>                  // for placement new
 #include "assert.h"
-#include "log.h"
 
+#include "lprofile.hpp"         // for lua::mem_phase_scope
 #include "lua.hpp"              // for lua::global_lua_state
 #include "main_thread.hpp"      // for main_thread::signal_event()
 #include "timer.hpp"
 
 
 
+_timer_t* _timer_t::m_wheel[WHEEL_SLOTS];
+
+uint32_t _timer_t::m_wheel_now;
+
+uint32_t _timer_t::m_wheel_target;
+
+ztimer_t _timer_t::m_wheel_timer = { {}, &_tmo_wheel, nullptr };
+
+event_t _timer_t::m_event_expiry = { nullptr, _hdlr_expiry };
+
+// Check whether the deadline has been reached at the time `now`, allowing for the
+// wrap-around of ztimer_now().
+static bool _is_due(uint32_t deadline, uint32_t now)
+{
+    return int32_t(now - deadline) >= 0;
+}
+
 int _timer_t::create(lua_State* L)
 {
+    // ( -- callback )
+    luaL_checktype(L, 1, LUA_TFUNCTION);
     void* memory = lua_newuserdata(L, sizeof(_timer_t));
     new (memory) _timer_t();
+    // ( -- callback userdata )
+    lua_insert(L, 1);
+    lua_setuservalue(L, 1);  // Bind the callback to the timer once and for all.
+    // ( -- userdata )
+
+    // Set up __gc() for the new userdata to ensure that if it is garbage-collected
+    // without calling _timer_t::stop() (e.g. during lua_close()), the timer is unlinked
+    // from the wheel. The metatable is created only once, by the first timer.
+    if ( luaL_newmetatable(L, "ctimer") ) {
+        // ( -- userdata metatable )
+        lua_pushcfunction(L, _timer_t::stop);
+        lua_setfield(L, -2, "__gc");
+    }
+    // ( -- userdata metatable )
+    lua_setmetatable(L, -2);
     // ( -- userdata )
     return 1;
 }
 
+void _timer_t::_link(_timer_t** pnext)
+{
+    m_next = *pnext;
+    if ( m_next != nullptr )
+        m_next->m_pprev = &m_next;
+    m_pprev = pnext;
+    *pnext = this;
+}
+
+void _timer_t::_unlink()
+{
+    if ( m_pprev == nullptr )
+        return;
+    *m_pprev = m_next;
+    if ( m_next != nullptr )
+        m_next->m_pprev = m_pprev;
+    m_next = nullptr;
+    m_pprev = nullptr;
+}
+
+void _timer_t::_schedule(uint32_t deadline)
+{
+    m_deadline = deadline;
+    _link(&m_wheel[deadline % WHEEL_SLOTS]);
+}
+
 int _timer_t::start(lua_State* L)
 {
-    // ( -- userdata callback timeout_ms [repeated] )
+    // ( -- userdata timeout_ms [repeated] )
     _timer_t* const that = static_cast<_timer_t*>(lua_touserdata(L, 1));
     assert( that != nullptr );
 
-    const int timeout_ms = luaL_checkinteger(L, 3);
+    const int timeout_ms = luaL_checkinteger(L, 2);
     assert( timeout_ms > 0 );
 
-    // Note that lua_toboolean(L, 4) returns false if the argument is absent or nil.
-    that->m_timeout_ms = lua_toboolean(L, 4) ? timeout_ms : 0;
-    lua_settop(L, 2);
-    // ( -- userdata callback )
+    // Note that lua_toboolean(L, 3) returns false if the argument is absent or nil.
+    that->m_timeout_ms = lua_toboolean(L, 3) ? timeout_ms : 0;
 
-    luaL_checktype(L, 2, LUA_TFUNCTION);
-    if ( that->m_rcallback != LUA_NOREF ) {
-        // This case can happen when restarting the timer.
-        luaL_unref(L, LUA_REGISTRYINDEX, that->m_rcallback);
+    if ( that->m_rself == LUA_NOREF ) {
+        lua_settop(L, 1);
+        // ( -- userdata )
+        that->m_rself = luaL_ref(L, LUA_REGISTRYINDEX);
+        // ( -- )
     }
-    that->m_rcallback = luaL_ref(L, LUA_REGISTRYINDEX);
-    // ( -- userdata )
-
-    // Set up __gc() for the new userdata to ensure that if it is garbage-collected
-    // without calling _timer_t::stop() (e.g. during lua_close()), m_rcallback is
-    // unreferenced and the associated timer is properly stopped.
-    luaL_newmetatable(L, "ctimer");
-    // ( -- userdata metatable )
-    lua_pushcfunction(L, _timer_t::stop);
-    lua_setfield(L, -2, "__gc");
-    // ( -- userdata metatable )
-    lua_setmetatable(L, -2);
-    // ( -- userdata )
+    else
+        // Restarting the timer involves no allocation or reference.
+        that->_unlink();
 
     // Set the epoch to the current time.
-    that->m_epoch = ztimer_set(ZTIMER_MSEC, that, timeout_ms);
+    const uint32_t now = ztimer_now(ZTIMER_MSEC);
+    that->m_epoch = now;
+    that->_schedule(now + timeout_ms);
+
+    // An expiry event that is already pending will service the wheel and set the timer
+    // again anyway.
+    if ( !ztimer_is_set(ZTIMER_MSEC, &m_wheel_timer)
+      || !_is_due(that->m_deadline, m_wheel_target) ) {
+        m_wheel_target = that->m_deadline;
+        ztimer_set(ZTIMER_MSEC, &m_wheel_timer, timeout_ms);
+    }
 
     // Return 0 as the initial elapsed time since the epoch.
     lua_pushinteger(L, 0);
@@ -62,10 +122,13 @@ int _timer_t::stop(lua_State* L)
     _timer_t* const that = static_cast<_timer_t*>(lua_touserdata(L, 1));
     assert( that != nullptr );
     bool result = false;
-    if ( that->m_rcallback != LUA_NOREF ) {
-        result = ztimer_remove(ZTIMER_MSEC, that);
-        luaL_unref(L, LUA_REGISTRYINDEX, that->m_rcallback);
-        that->m_rcallback = LUA_NOREF;  // Also indicates that timeout is not expected.
+    if ( that->m_rself != LUA_NOREF ) {
+        // If it was the earliest one, m_wheel_timer will find nothing due and set itself
+        // to the next deadline.
+        that->_unlink();
+        luaL_unref(L, LUA_REGISTRYINDEX, that->m_rself);
+        that->m_rself = LUA_NOREF;  // Also indicates that timeout is not expected.
+        result = true;
     }
     lua_pushboolean(L, result);
     // ( -- userdata result )
@@ -76,7 +139,7 @@ int _timer_t::now(lua_State* L)
 {
     _timer_t* const that = static_cast<_timer_t*>(lua_touserdata(L, 1));
     assert( that != nullptr );
-    if ( ztimer_is_set(ZTIMER_MSEC, that) ) {
+    if ( that->m_rself != LUA_NOREF ) {
         lua_pushinteger(L, ztimer_now(ZTIMER_MSEC) - that->m_epoch);
         // ( -- userdata int )
         return 1;
@@ -84,58 +147,109 @@ int _timer_t::now(lua_State* L)
     return 0;
 }
 
-// _hdlr_timeout() executes in the context of main_thread.
-void _timer_t::_hdlr_timeout(event_t* event)
+void _timer_t::_arm_wheel()
 {
-    _timer_t* const that = static_cast<event_ext_t<_timer_t*>*>(event)->arg;
-
-    // Although ztimer_t guarantees that its callback is never invoked after
-    // ztimer_remove() - even if the timer expires during ztimer_remove() - a spurious
-    // timeout can still occur in rare cases. For example, our _timer_t might expire
-    // after entering on_release(), but before calling fw.timer_stop(). In this window,
-    // the m_event_timeout event could be signaled before _timer_t::stop() executes.
-    // To guard against this, we explicitly check whether the timeout is expected
-    // (that->m_rcallback != LUA_NOREF). If it isn't, we discard the event and prevent
-    // on_timeout() from executing.
-    if ( that->m_rcallback != LUA_NOREF ) {
+    bool is_found = false;
+
+    // Each slot holds the deadlines that are congruent modulo WHEEL_SLOTS, and all of
+    // them are later than m_wheel_now. So, a deadline in the next revolution is found
+    // by checking the slots in order.
+    for ( uint32_t t = m_wheel_now + 1 ; !is_found && t != m_wheel_now + 1 + WHEEL_SLOTS ;
+      t++ )
+        for ( _timer_t* timer = m_wheel[t % WHEEL_SLOTS] ; timer ; timer = timer->m_next )
+            if ( timer->m_deadline == t ) {
+                m_wheel_target = t;
+                is_found = true;
+                break;
+            }
+
+    // Otherwise, take the earliest of the later deadlines, if any.
+    if ( !is_found )
+        for ( _timer_t* slot : m_wheel )
+            for ( _timer_t* timer = slot ; timer ; timer = timer->m_next )
+                if ( !is_found || !_is_due(timer->m_deadline, m_wheel_target) ) {
+                    m_wheel_target = timer->m_deadline;
+                    is_found = true;
+                }
+
+    if ( is_found ) {
+        const int32_t timeout = m_wheel_target - ztimer_now(ZTIMER_MSEC);
+        ztimer_set(ZTIMER_MSEC, &m_wheel_timer, timeout > 0 ? timeout : 0);
+    }
+    else
+        ztimer_remove(ZTIMER_MSEC, &m_wheel_timer);
+}
+
+// _hdlr_expiry() executes in the context of main_thread.
+void _timer_t::_hdlr_expiry(event_t*)
+{
+    const uint32_t now = ztimer_now(ZTIMER_MSEC);
+
+    // Move the timers that are due into the expired list, checking only the slots for
+    // the ticks passed since the last service (or all slots if more than a revolution).
+    // A spurious expiry, such as after the earliest timer is stopped, finds none due.
+    _timer_t* expired = nullptr;
+    _timer_t** ptail = &expired;
+    const uint32_t ticks = std::min(now - m_wheel_now, uint32_t(WHEEL_SLOTS));
+    for ( uint32_t t = now - ticks + 1 ; t != now + 1 ; t++ ) {
+        _timer_t* timer = m_wheel[t % WHEEL_SLOTS];
+        while ( timer != nullptr ) {
+            _timer_t* const next = timer->m_next;
+            if ( _is_due(timer->m_deadline, now) ) {
+                timer->_unlink();
+                timer->_link(ptail);
+                ptail = &timer->m_next;
+            }
+            timer = next;
+        }
+    }
+    m_wheel_now = now;
+
+    if ( expired != nullptr ) {
+        const lua::mem_phase_scope phase(lua::MEM_PHASE_TIMER);
         lua::global_lua_state L;
 
-        // Invoke the Lua callback function.
-        lua_rawgeti(L, LUA_REGISTRYINDEX, that->m_rcallback);
-        // ( -- callback )
-
-        // Invoke the callback with an appropriate argument.
-        if ( that->m_timeout_ms > 0 ) {
-            // Safe to use ztimer_now() here: timers are scheduled back-to-back, with
-            // each new timer set from within the handler itself.
-            lua_pushinteger(L, ztimer_now(ZTIMER_MSEC) - that->m_epoch);
-            lua_call(L, 1, 1);
-            if ( lua_toboolean(L, -1) )
-                that->m_epoch = that->m_restart_ms;
+        // A callback may also stop the timers remaining in the expired list, which
+        // unlinks them from the list.
+        while ( _timer_t* const that = expired ) {
+            that->_unlink();
+
+            lua_rawgeti(L, LUA_REGISTRYINDEX, that->m_rself);
+            lua_getuservalue(L, -1);
+            // ( -- userdata callback )
+
+            // Invoke the callback with an appropriate argument.
+            if ( that->m_timeout_ms > 0 ) {
+                // Start the repeated timer again before the callback, which may stop it.
+                // The period is kept unless main_thread has fallen behind.
+                that->m_restart_ms = that->m_deadline;
+                uint32_t deadline = that->m_deadline + that->m_timeout_ms;
+                if ( _is_due(deadline, now) )
+                    deadline = now + that->m_timeout_ms;
+                that->_schedule(deadline);
+
+                lua_pushinteger(L, now - that->m_epoch);
+                lua_call(L, 1, 1);
+                if ( lua_toboolean(L, -1) )
+                    that->m_epoch = that->m_restart_ms;
+            }
+            else {
+                luaL_unref(L, LUA_REGISTRYINDEX, that->m_rself);
+                that->m_rself = LUA_NOREF;
+                lua_call(L, 0, 0);
+            }
             lua_settop(L, 0);
+            // ( -- )
         }
-        else {
-            lua_call(L, 0, 0);
-            luaL_unref(L, LUA_REGISTRYINDEX, that->m_rcallback);
-            that->m_rcallback = LUA_NOREF;
-        }
-        // ( -- )
     }
 
-    else
-        LOG_WARNING("Map: spurious timeout");
+    _arm_wheel();
 }
 
-void _timer_t::_tmo_key_timer(void* arg)
+void _timer_t::_tmo_wheel(void*)
 {
-    _timer_t* const that = static_cast<_timer_t*>(arg);
-
-    // Start the timer again if it is a repeated one.
-    if ( that->m_timeout_ms > 0 )
-        that->m_restart_ms = ztimer_set(ZTIMER_MSEC, that, that->m_timeout_ms);
-
-    // Use an event to execute the timeout handler (_hdlr_timeout()) in thread context,
-    // rather than directly in interrupt context. This also ensures that on_timeout()
-    // is invoked only when Lua is idle - not actively executing another function.
-    main_thread::signal_event(&that->m_event_timeout);
+    // Use an event to service the wheel (_hdlr_expiry()) in thread context, rather than
+    // directly in interrupt context. This also ensures that on_timeout() is invoked
+    // only when Lua is idle - not actively executing another function.
+    main_thread::signal_event(&m_event_expiry);
 }
@@ -1,24 +1,28 @@
 #pragma once
 
-#include "ztimer.h"
-
-#include "event_ext.hpp"        // for event_ext_t
+#include "event.h"              // for event_t
+#include "ztimer.h"             // for ztimer_t
 
 
 
 struct lua_State;
 
-// Internal C++ helper for the `Timer` class in Lua. Wraps ztimer_t.
-class _timer_t: public ztimer_t {
+// Internal C++ helper for the `Timer` class in Lua. Instead of a ztimer_t per timer, all
+// timers are kept in a hashed timer wheel that shares a single ztimer_t and is serviced
+// in the context of main_thread. Starting or restarting a timer only links it into a
+// wheel slot with a new deadline, and the timers that fall due together are delivered
+// in one batch.
+class _timer_t {
 public:
-    // fw.timer_create(): userdata
+    // fw.timer_create(callback): userdata
     static int create(lua_State* L);
 
     // Note: This class is intentionally minimal and does not define an explicit
-    // `destroy()` method. The callback reference (`m_rcallback`) is managed exclusively
-    // through the `start()` and `stop()` methods invoked from Lua.
+    // `destroy()` method. The reference to the timer itself (`m_rself`), which is held
+    // while the timer is active, is managed through the `start()` and `stop()` methods
+    // invoked from Lua.
 
-    // fw.timer_start(timer: userdata, callback, timeout_ms: int [, repeated: bool]): int
+    // fw.timer_start(timer: userdata, timeout_ms: int [, repeated: bool]): int
     static int start(lua_State* L);
 
     // fw.timer_stop(timer: userdata): bool
@@ -27,22 +31,50 @@ public:
     // fw.timer_now(timer: userdata): int | void
     static int now(lua_State* L);
 
-protected:
-    explicit _timer_t()
-    : ztimer_t { .callback = _tmo_key_timer, .arg = this }
-    {}
-
 private:
-    uint32_t m_timeout_ms = 0;
+    explicit _timer_t() {}
+
+    uint32_t m_deadline = 0;
+
+    uint32_t m_timeout_ms = 0;  // Non-zero for a repeated timer.
 
     uint32_t m_epoch = 0;
 
     uint32_t m_restart_ms = 0;
 
-    int m_rcallback = LUA_NOREF;  // Reference to a callback function in Lua.
+    // Reference to the userdata of this timer while it is active. The callback function
+    // in Lua is bound to the userdata as its user value by create().
+    int m_rself = LUA_NOREF;
+
+    // Links in a wheel slot or in the list of expired timers
+    _timer_t* m_next = nullptr;
+    _timer_t** m_pprev = nullptr;
+
+    void _link(_timer_t** pnext);
+    void _unlink();
+
+    // Link the timer into the wheel slot for the deadline.
+    void _schedule(uint32_t deadline);
+
+    static constexpr unsigned WHEEL_SLOTS = 32;
+    static_assert( (WHEEL_SLOTS & (WHEEL_SLOTS - 1)) == 0 );
+
+    static _timer_t* m_wheel[WHEEL_SLOTS];
+
+    // Time up to which the wheel has been serviced
+    static uint32_t m_wheel_now;
+
+    // Deadline for which m_wheel_timer is set
+    static uint32_t m_wheel_target;
+
+    static ztimer_t m_wheel_timer;
+
+    static event_t m_event_expiry;
+
+    // Set m_wheel_timer to the earliest deadline in the wheel.
+    static void _arm_wheel();
 
-    event_ext_t<_timer_t*> m_event_timeout = { nullptr, _hdlr_timeout, this };
-    static void _hdlr_timeout(event_t* event);
+    static void _hdlr_expiry(event_t* event);
 
-    static void _tmo_key_timer(void* arg);
+    static void _tmo_wheel(void* arg);
 };
@@ -1,10 +1,13 @@
+#include <array>                // for std::array
+#include <iterator>             // for std::size()
+
 #include "assert.h"
 #include "auto_init.h"          // for auto_init()
 #include "board.h"              // for _sheap, _eheap, system_reset()
 #include "cpu.h"                // for RSTC
 #include "irq.h"                // for irq_disable(), irq_restore()
 #include "led_conf.h"           // for KEY_LED_COUNT
-#include "log.h"                // for set_log_mask()
+#include "log.h"                // for set_log_mask(), log_start_timestamps()
 #include "periph/wdt.h"         // for wdt_kick()
 #include "thread.h"             // for thread_get_active(), cpu_switch_context_exit()
 #include "thread_flags.h"       // for thread_flags_set(), thread_flags_wait_one()
@@ -13,10 +16,13 @@
 #include "adc.hpp"              // for adc::init()
 #include "event_ext.hpp"        // for event_post(), event_queue_init(), event_get()
 #include "lua.hpp"              // for lua::global_lua_state::init(), ...
-#include "config.hpp"           // for ENABLE_CDC_ACM, ENABLE_LUA_REPL
+#include "config.hpp"           // for ENABLE_CDC_ACM, ENABLE_LUA_REPL, ...
+#include "effects_thread.hpp"   // for effects_thread::init(), ...
+#include "hid_keycodes.hpp"     // for keycode(), KC_NO
 #include "main_key_events.hpp"  // for main_key_events::push(), ...
 #include "lexecute.hpp"         // for lua::execute_pending_calls(), ...
-#include "lkeymap.hpp"          // for lua::handle_key_event(), lua::handle_lamp_state()
+#include "lcollect.hpp"         // for lua::gc_step(), lua::gc_collect(), ...
+#include "lkeymap.hpp"          // for lua::handle_key_event(), lua::flush_effect_events()
 #include "main_thread.hpp"
 #include "matrix_thread.hpp"    // for matrix_thread::init(), matrix_thread::is_idle()
 #include "persistent.hpp"       // for persistent::init()
@@ -53,6 +59,8 @@ ztimer_t main_thread::m_heartbeat_timer;
 
 void* (*main_thread::m_active_mode)(void*);
 
+bool main_thread::m_is_staging = false;
+
 void main_thread::init()
 {
     LOG_INFO("Main: This is RIOT! (Version: " RIOT_VERSION ")");
@@ -122,6 +130,8 @@ bool main_thread::signal_key_event(unsigned slot_index, bool is_press, uint32_t
     if ( likely(main_key_events::push({{ uint8_t(slot_index), is_press }}, timeout_us)) )
     {
         set_thread_flags(FLAG_KEY_EVENT);
+        if constexpr ( ENABLE_NATIVE_EFFECTS )
+            effects_thread::signal_key_event(slot_index, is_press);
         return true;
     }
 
@@ -137,6 +147,35 @@ bool main_thread::signal_key_event(unsigned slot_index, bool is_press, uint32_t
     return false;
 }
 
+void main_thread::signal_staging()
+{
+    m_is_staging = true;
+    if ( !is_dfu_mode() )
+        signal_mode_toggle();
+}
+
+// FALLBACK_KEYMAP converted into keycodes at compile time
+static constexpr auto _fallback_keycodes = [] {
+    std::array<uint8_t, std::size(FALLBACK_KEYMAP)> keycodes {};
+    for ( size_t i = 0 ; i < keycodes.size() ; i++ )
+        keycodes[i] = keycode(FALLBACK_KEYMAP[i]);
+    return keycodes;
+}();
+
+static_assert( _fallback_keycodes.size() == KEY_LED_COUNT );
+
+void main_thread::type_fallback(unsigned slot_index, bool is_press)
+{
+    // slot_index starts from 1.
+    const uint8_t keycode = _fallback_keycodes[slot_index - 1];
+    if ( keycode == KC_NO )
+        return;
+    if ( is_press )
+        usb_thread::send_press(keycode);
+    else
+        usb_thread::send_release(keycode);
+}
+
 void main_thread::signal_lamp_state(uint8_t lamp_state)
 {
     static event_ext_t<uint8_t> _event = { nullptr,
@@ -178,8 +217,10 @@ NORETURN void* main_thread::_thread_entry(void*)
         lua::global_lua_state::validate_bytecode(SLOT0_OFFSET + RIOTBOOT_HDR_LEN)
         ? &normal_mode : &dfu_mode;
 
-    if ( IS_USED(MODULE_AUTO_INIT) )
+    if ( IS_USED(MODULE_AUTO_INIT) ) {
         auto_init();     // ztimer_init(), ...
+        log_start_timestamps();
+    }
 
     // Initialize subsystems in the order of dependency.
     adc::init();         // Invokes v_5v.wait_for_stable_5v().
@@ -187,6 +228,8 @@ NORETURN void* main_thread::_thread_entry(void*)
     usbhub_thread::init();
     usb_thread::init();  // printf() will work from this point, displaying on the host.
     matrix_thread::init();  // Produces signals to main_thread.
+    if constexpr ( ENABLE_NATIVE_EFFECTS )
+        effects_thread::init();
 
     // The event_queue_init() should be called from the queue-owning thread.
     event_queue_init(&m_event_queue);
@@ -228,6 +271,14 @@ void* main_thread::dfu_mode(void*)
 
             case FLAG_KEY_EVENT:
                 main_key_events::key_event_t event;
+                // While staging a firmware image, the keys are typed as usual, just
+                // without the Lua keymap.
+                if ( m_is_staging ) {
+                    while ( main_key_events::get(&event) )
+                        type_fallback(event.slot_index, event.is_press);
+                    break;
+                }
+
                 // If the ESC key is released, trigger system_reset(). All other keys are
                 // ignored.
                 // Note that seeprom_bkswrst() might be more appropriate if DFU mode was
@@ -248,6 +299,7 @@ void* main_thread::dfu_mode(void*)
         }
     }
 
+    m_is_staging = false;
     LED0_OFF;
     if constexpr ( ENABLE_RGB_LED )
         rgb_gcr::enable();
@@ -281,7 +333,23 @@ void* main_thread::normal_mode(void*)
             // this time, key events from matrix_thread may still occur, but they won't
             // be handled until processing completes. Events can still be sent to
             // usb_thread, but only through explicit calls to fw.send_key().
+
+            // If the Lua heap is filling up, collect garbage without waiting any longer.
+            if constexpr ( ENABLE_LUA_IDLE_GC ) {
+                if ( lua::gc_is_urgent() ) {
+                    lua::gc_collect();
+                    continue;
+                }
+            }
+
             if ( usb_thread::is_idle() && matrix_thread::is_idle() ) {
+                // The Effect notifications for the natively handled keys come first,
+                // so that the LEDs keep up with the typing.
+                if ( lua::effect_events_pending() ) {
+                    lua::flush_effect_events();
+                    continue;
+                }
+
                 if ( lua::execute_is_pending() ) {
                     lua::execute_pending_calls();
                     continue;
@@ -300,6 +368,15 @@ void* main_thread::normal_mode(void*)
                 // Leave normal mode if prompted.
                 if ( exit )
                     break;
+
+                // Collect garbage in the remaining idle time, a bounded increment at a
+                // time.
+                if constexpr ( ENABLE_LUA_IDLE_GC ) {
+                    if ( lua::gc_is_pending() ) {
+                        lua::gc_step();
+                        continue;
+                    }
+                }
             }
 
             // `wait_for_input()` is called when either not both threads are idle or
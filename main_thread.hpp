@@ -36,6 +36,13 @@ public:
 
     static void signal_mode_toggle() { set_thread_flags(FLAG_MODE_TOGGLE); }
 
+    // Signal to main_thread that a firmware image is about to be staged into the
+    // opposite bank, where the Lua keymap resides. main_thread enters DFU mode, but keeps
+    // typing with FALLBACK_KEYMAP until the banks are swapped.
+    static void signal_staging();
+
+    static bool is_staging() { return m_is_staging; }
+
     // Signal a generic event to main_thread.
     static void signal_event(event_t* event);
 
@@ -83,6 +90,12 @@ private:
     // normal_mode().
     static void* (*m_active_mode)(void*);
 
+    // True while a firmware image is being staged (See signal_staging()).
+    static bool m_is_staging;
+
+    // Type the key event with FALLBACK_KEYMAP in DFU mode.
+    static void type_fallback(unsigned slot_index, bool is_press);
+
     // Watchdog refresh timer
     static constexpr uint32_t HEARTBEAT_PERIOD_MS = 1000;
     static ztimer_t m_heartbeat_timer;
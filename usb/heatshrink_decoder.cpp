@@ -0,0 +1,75 @@
+#include "heatshrink_decoder.hpp"
+
+
+
+bool heatshrink_decoder::init(
+    uint8_t window_bits, uint8_t lookahead_bits, uint8_t* window)
+{
+    if ( window_bits < MIN_WINDOW_BITS || window_bits > MAX_WINDOW_BITS
+      || lookahead_bits < MIN_LOOKAHEAD_BITS || lookahead_bits > MAX_LOOKAHEAD_BITS
+      || lookahead_bits >= window_bits )
+        return false;
+
+    m_window = window;
+    m_mask = (1u << window_bits) - 1;
+    m_head = 0;
+    m_window_bits = window_bits;
+    m_lookahead_bits = lookahead_bits;
+    m_state = TAG;
+    m_bit_count = 0;
+    m_bits = 0;
+    // The encoder never refers back beyond the start of the output, but clear the
+    // window anyway to make a corrupted stream decode deterministically.
+    __builtin_memset(window, 0, 1u << window_bits);
+    return true;
+}
+
+uint32_t heatshrink_decoder::get_bits(uint8_t count)
+{
+    m_bit_count -= count;
+    return (m_bits >> m_bit_count) & ((1u << count) - 1);
+}
+
+size_t heatshrink_decoder::feed(uint8_t byte, uint8_t* out)
+{
+    m_bits = (m_bits << 8) | byte;
+    m_bit_count += 8;
+
+    size_t size = 0;
+    while ( true ) {
+        switch ( m_state ) {
+            case TAG:
+                if ( m_bit_count < 1 )
+                    return size;
+                m_state = get_bits(1) ? LITERAL : INDEX;
+                break;
+
+            case LITERAL:
+                if ( m_bit_count < 8 )
+                    return size;
+                out[size] = get_bits(8);
+                put(out[size++]);
+                m_state = TAG;
+                break;
+
+            case INDEX:
+                if ( m_bit_count < m_window_bits )
+                    return size;
+                m_index = get_bits(m_window_bits) + 1;
+                m_state = COUNT;
+                break;
+
+            case COUNT: {
+                if ( m_bit_count < m_lookahead_bits )
+                    return size;
+                size_t count = get_bits(m_lookahead_bits) + 1;
+                while ( count-- > 0 ) {
+                    out[size] = m_window[(m_head - m_index) & m_mask];
+                    put(out[size++]);
+                }
+                m_state = TAG;
+                break;
+            }
+        }
+    }
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>              // for size_t
+#include <cstdint>              // for uint8_t, uint16_t, uint32_t
+
+
+
+// Streaming decoder of the heatshrink format (github.com/atomicobject/heatshrink), an
+// LZSS variant that needs no more memory than its window of (1 << window_bits) bytes.
+//
+// The compressed data is a bit stream, MSB first, of two kinds of symbols:
+//   1 + byte (8 bits)                  a literal byte
+//   0 + index (window_bits)            copy (count + 1) bytes from (index + 1) bytes
+//     + count (lookahead_bits)         back in the output
+// The last byte is padded with 0 bits, which never make up a complete symbol.
+class heatshrink_decoder {
+public:
+    static constexpr uint8_t MIN_WINDOW_BITS = 4;
+    static constexpr uint8_t MAX_WINDOW_BITS = 14;
+    static constexpr uint8_t MIN_LOOKAHEAD_BITS = 3;
+    static constexpr uint8_t MAX_LOOKAHEAD_BITS = 8;
+
+    // Max number of bytes output by feed(). A symbol takes more than 8 bits, so each
+    // byte completes at most one symbol.
+    static constexpr size_t MAX_OUTPUT_SIZE = 1u << MAX_LOOKAHEAD_BITS;
+
+    // Return false if the parameters are not supported. `window` must hold
+    // (1 << window_bits) bytes.
+    bool init(uint8_t window_bits, uint8_t lookahead_bits, uint8_t* window);
+
+    // Decode the next byte, storing the output into `out`, which should have room for
+    // MAX_OUTPUT_SIZE bytes. Return the number of bytes output.
+    size_t feed(uint8_t byte, uint8_t* out);
+
+private:
+    enum : uint8_t { TAG, LITERAL, INDEX, COUNT };
+
+    uint32_t get_bits(uint8_t count);
+
+    void put(uint8_t byte) { m_window[m_head++ & m_mask] = byte; }
+
+    uint8_t* m_window;
+    uint16_t m_mask;            // (1 << window_bits) - 1
+    uint16_t m_head;            // number of bytes output, wrapping around
+    uint16_t m_index;           // offset of the back-reference being decoded
+    uint8_t m_window_bits;
+    uint8_t m_lookahead_bits;
+    uint8_t m_state;
+    uint8_t m_bit_count;        // number of bits available in m_bits
+    uint32_t m_bits;
+};
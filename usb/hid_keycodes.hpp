@@ -211,6 +211,8 @@ inline constexpr const char* keycode_to_name[] = {
 // Shortcut keycodes
 constexpr uint8_t KC_NO = 0;
 constexpr uint8_t KC_A = 4;
+// A reserved usage that hosts ignore, e.g. for fw.usb_latency_test().
+constexpr uint8_t KC_RESERVED = 0xA5;
 
 
 // Note: This uses a simple linear search to map the key name to its keycode.
@@ -114,6 +114,31 @@ inline constexpr uint8_t NkroReportDescriptor[] = {
     HID_RI_END_COLLECTION(0)
 };
 
+constexpr size_t RAW_HID_REPORT_SIZE = 64;  // must not exceed the interrupt EP size.
+
+// Vendor-defined usage page and usage, the same as QMK uses for its raw HID, so that
+// host tools can locate the interface by (usage_page, usage) == (0xFF60, 0x61).
+inline constexpr uint8_t RawHidReportDescriptor[] = {
+    HID_RI_USAGE_PAGE(16, 0xFF60),     // Vendor Defined
+    HID_RI_USAGE(8, 0x61),             // Vendor Defined
+    HID_RI_COLLECTION(8, 0x01),        // Application
+        // Data to host
+        HID_RI_USAGE(8, 0x62),         // Vendor Defined
+        HID_RI_LOGICAL_MINIMUM(8, 0x00),
+        HID_RI_LOGICAL_MAXIMUM(16, 0x00FF),
+        HID_RI_REPORT_COUNT(8, RAW_HID_REPORT_SIZE),
+        HID_RI_REPORT_SIZE(8, 0x08),
+        HID_RI_INPUT(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE),
+        // Data from host
+        HID_RI_USAGE(8, 0x63),         // Vendor Defined
+        HID_RI_LOGICAL_MINIMUM(8, 0x00),
+        HID_RI_LOGICAL_MAXIMUM(16, 0x00FF),
+        HID_RI_REPORT_COUNT(8, RAW_HID_REPORT_SIZE),
+        HID_RI_REPORT_SIZE(8, 0x08),
+        HID_RI_OUTPUT(8, HID_IOF_DATA | HID_IOF_VARIABLE | HID_IOF_ABSOLUTE | HID_IOF_NON_VOLATILE),
+    HID_RI_END_COLLECTION(0)
+};
+
 
 
 // Simplified std::copy_n() but constexpr function.
@@ -2,6 +2,8 @@
 
 #define USB_H_USER_IS_RIOT_INTERNAL
 
+#include <cstdio>               // for snprintf()
+
 #include "backup_ram.h"         // for backup_ram_read()
 #include "board.h"              // for system_reset()
 #include "log.h"
@@ -11,10 +13,13 @@
 #include "usb/descriptor.h"
 #include "usb/usbus.h"
 #include "usb/usbus/control.h"
-#include "riotboot/slot.h"
+#include "riotboot/hdr.h"       // for RIOTBOOT_MAGIC
+#include "riotboot/slot.h"      // for riotboot_slot_get_hdr(), riotboot_slot_size()
 #include "riotboot/usb_dfu.h"
 #include "ztimer.h"
 
+#include "config.hpp"           // for DFU_TRANSFER_SIZE
+#include "lua.hpp"              // for lua::global_lua_state::borrow_memory()
 #include "main_thread.hpp"      // for main_thread::signal_mode_toggle(), ...
 #include "matrix_thread.hpp"    // for matrix_thread::enable/disable()
 #include "usb_dfu.hpp"
@@ -30,10 +35,8 @@ static void _transfer_handler(usbus_t* usbus, usbus_handler_t* handler,
                               usbdev_ep_t* ep, usbus_event_transfer_t event);
 static void _init(usbus_t* usbus, usbus_handler_t* handler);
 
-// Represents wTransferSize: the maximum number of bytes the device can accept per
-// Control transfer. This value directly impacts download and upload speeds. Any positive
-// number is valid and does not require additional memory allocation.
-#define DEFAULT_XFER_SIZE 1024
+// bStatus of DFU_GETSTATUS response for a failed write into the NVM (errWRITE)
+constexpr uint8_t DFU_STATUS_ERR_WRITE = 0x03;
 
 
 
@@ -49,7 +52,7 @@ static size_t _gen_dfu_descriptor(usbus_t* usbus, void* arg)
     if_desc.attribute = USB_DFU_WILL_DETACH | USB_DFU_MANIFEST_TOLERANT
                       | USB_DFU_CAN_DOWNLOAD | USB_DFU_CAN_UPLOAD;
     if_desc.detach_timeout = USB_DFU_DETACH_TIMEOUT_MS;
-    if_desc.xfer_size = DEFAULT_XFER_SIZE;
+    if_desc.xfer_size = DFU_TRANSFER_SIZE;
     if_desc.bcd_dfu = USB_DFU_VERSION_BCD;
 
     usbus_control_slicer_put_bytes(usbus, (uint8_t*)&if_desc, sizeof(if_desc));
@@ -115,6 +118,9 @@ static void _init(usbus_t* usbus, usbus_handler_t* handler)
     // Add string descriptor to the interface
     dfu->iface.descr = &dfu->slot0_str;
 
+    // String descriptor reporting the result of DFU_DNLOAD
+    usbus_add_string_descriptor(usbus, &dfu->status_str, dfu->status_text);
+
 #if NUM_SLOTS == 2
     // DFU Runtime mode does not allow multiple slots.
     // Create needed string descriptor for the alternate settings
@@ -163,21 +169,115 @@ static int dfu_detach_handler(usbus_t*, usbus_dfu_device_t* dfu, usb_setup_t*)
     return 1;
 }
 
+// Comparing the image with the flash needs a buffer larger than we can afford, so it
+// borrows lua_memory, which is free in DFU mode. As the first block of a download
+// arrives before main_thread leaves normal mode, it is only held in RAM until then,
+// without touching the slot from which Lua still runs its bytecode in place. The host
+// is kept waiting for DFU mode after the first block (See dfu_getstatus_handler()), so
+// the block must fit in the page buffer of the writer.
+static void _begin_stream(usbus_dfu_device_t* dfu)
+{
+    static_assert( LUA_MEM_SIZE >= NVM_STREAM_DIFF_BUF_SIZE );
+    static_assert( DFU_TRANSFER_SIZE <= NVM_STREAM_PAGE_SIZE );
+
+    const uint32_t start = (uint32_t)riotboot_slot_get_hdr(dfu->selected_slot);
+    const size_t size = riotboot_slot_size(dfu->selected_slot);
+    if ( main_thread::is_dfu_mode() )
+        nvm_stream_begin_diff(&dfu->stream, start, size,
+            lua::global_lua_state::borrow_memory());
+    else
+        nvm_stream_begin_held(&dfu->stream, start, size);
+}
+
+// A compressed image is decoded into a buffer following the window, both of which
+// also reside in lua_memory after the buffer for comparison, and written into the flash
+// once the buffer fills up.
+constexpr size_t DFU_DECODED_FLUSH_SIZE = 256;
+
+static_assert( LUA_MEM_SIZE >= NVM_STREAM_DIFF_BUF_SIZE
+    + (1u << heatshrink_decoder::MAX_WINDOW_BITS)
+    + DFU_DECODED_FLUSH_SIZE + heatshrink_decoder::MAX_OUTPUT_SIZE );
+
+static inline bool _is_compressed(const usbus_dfu_device_t* dfu)
+{
+    return dfu->hdr.magic_number == DFU_COMPRESSED_MAGIC;
+}
+
+static int _write_decoded(usbus_dfu_device_t* dfu)
+{
+    // Determine skip_signature from the first decoded bytes.
+    if ( unlikely(dfu->skip_signature == -1) ) {
+        if ( dfu->decoded_size < sizeof(uint32_t) )
+            return -1;
+        dfu->skip_signature = (*(uint32_t*)(void*)dfu->decoded == RIOTBOOT_MAGIC);
+    }
+
+    const size_t size = dfu->decoded_size;
+    dfu->decoded_size = 0;
+    return nvm_stream_write(&dfu->stream, dfu->decoded, size);
+}
+
+static int _write_compressed(usbus_dfu_device_t* dfu, const uint8_t* data, size_t size)
+{
+    // Skip the padding after the header.
+    const size_t pad_size = size < dfu->pad_size ? size : dfu->pad_size;
+    dfu->pad_size -= pad_size;
+    data += pad_size;
+    size -= pad_size;
+    if ( size == 0 )
+        return 0;
+
+    // Start decoding, and writing into the slot. This fails if the image is not padded
+    // and main_thread is still in normal mode.
+    if ( unlikely(dfu->decoded == nullptr) ) {
+        if ( !main_thread::is_dfu_mode() )
+            return -1;
+        uint8_t* const window = (uint8_t*)
+            lua::global_lua_state::borrow_memory() + NVM_STREAM_DIFF_BUF_SIZE;
+        if ( !dfu->decoder.init(dfu->hdr.window_bits, dfu->hdr.lookahead_bits, window) )
+            return -1;
+        dfu->decoded = window + (1u << heatshrink_decoder::MAX_WINDOW_BITS);
+        _begin_stream(dfu);
+    }
+
+    for ( size_t i = 0 ; i < size ; i++ ) {
+        dfu->decoded_size +=
+            dfu->decoder.feed(data[i], &dfu->decoded[dfu->decoded_size]);
+        if ( dfu->decoded_size >= DFU_DECODED_FLUSH_SIZE && _write_decoded(dfu) != 0 )
+            return -1;
+    }
+    return 0;
+}
+
 static int dfu_dnload_handler(usbus_t* usbus, usbus_dfu_device_t* dfu, usb_setup_t* pkt)
 {
     // If the host indicates the end of the download, we finalize the flash and
     // transition to DFU_MANIFEST_SYNC.
     if ( pkt->length == 0 ) {
-        riotboot_flashwrite_flush(&dfu->writer);
+        if ( _is_compressed(dfu) ) {
+            // Verify the decompressed image against the header before it becomes valid.
+            if ( _write_decoded(dfu) != 0
+              || nvm_stream_size(&dfu->stream) != dfu->hdr.size
+              || nvm_stream_finish_crc(&dfu->stream, dfu->hdr.crc32) != 0 )
+                goto error;
+        }
+        else if ( nvm_stream_finish(&dfu->stream) != 0 )
+            goto error;
+        LOG_DEBUG("DFU: DFU_DNLOAD end (%d bytes)", nvm_stream_size(&dfu->stream));
+
+        if ( dfu->stream.diff_buf ) {
+            snprintf(dfu->status_text, sizeof(dfu->status_text),
+                "%u of %u pages unchanged", dfu->stream.skipped,
+                nvm_stream_pages(&dfu->stream));
+            LOG_DEBUG("DFU: %s", dfu->status_text);
+        }
+
         // skip_signature should be either 0 or 1 here.
-        if ( dfu->skip_signature ) {
-            riotboot_flashwrite_finish(&dfu->writer);
+        if ( dfu->skip_signature )
             // Let main_thread enter the normal mode, if the downloaded image
             // has a slot header (i.e. a Lua bytecode image).
             main_thread::signal_mode_toggle();
-        }
 
-        LOG_DEBUG("DFU: DFU_DNLOAD end (%d bytes)", dfu->writer.offset);
         dfu->dfu_state = USB_DFU_STATE_DFU_MANIFEST_SYNC;
         return 1;
     }
@@ -193,6 +293,7 @@ static int dfu_dnload_handler(usbus_t* usbus, usbus_dfu_device_t* dfu, usb_setup
             if ( !main_thread::is_dfu_mode() )
                 main_thread::signal_mode_toggle();
             dfu->skip_signature = -1;
+            dfu->hdr.magic_number = 0;
             dfu->dfu_state = USB_DFU_STATE_DFU_DL_BUSY;
             break;
 
@@ -201,46 +302,69 @@ static int dfu_dnload_handler(usbus_t* usbus, usbus_dfu_device_t* dfu, usb_setup
             break;
 
     // During the Data stage, we process each 64-byte packet of DFU download data from
-    // the host.
+    // the host. The packets are buffered and written into the NVM in the background
+    // (See nvm_stream.h), so we return without waiting for the NVM in most cases.
 
         case USB_DFU_STATE_DFU_DL_SYNC:
         case USB_DFU_STATE_DFU_DL_BUSY: {
             size_t data_size = 0;
             const uint8_t* data = usbus_control_get_out_data(usbus, &data_size);
 
-            // If skip_signature is not determined, it means we are at the very first
-            // 64-byte packet of the first DFU_DNLOAD request.
-            if ( unlikely(dfu->skip_signature == -1) ) {
-                // Avoid underflow condition
-                if ( data_size < RIOTBOOT_FLASHWRITE_SKIPLEN )
+            // If the stream is not started yet (nor the header of a compressed image
+            // is read), it means we are at the very first 64-byte packet of the first
+            // DFU_DNLOAD request.
+            if ( unlikely(dfu->stream.end == 0 && !_is_compressed(dfu)) ) {
+                if ( data_size < sizeof(uint32_t) )
                     goto error;
 
-                // Determine skip_signature by checking if the packet starts with a slot
-                // header.
-                dfu->skip_signature = (*(uint32_t*)(void*)data == RIOTBOOT_MAGIC);
-                if ( dfu->skip_signature ) {
-                    // Skip writing the magic number ("RIOT") in the slot header.
-                    riotboot_flashwrite_init(&dfu->writer, dfu->selected_slot);
-                    data_size -= RIOTBOOT_FLASHWRITE_SKIPLEN;
-                    data += RIOTBOOT_FLASHWRITE_SKIPLEN;
+                // Both a Lua bytecode image and a headerless firmware image are written
+                // from the start of the slot. The magic number ("RIOT") in the slot
+                // header is written last by nvm_stream_finish().
+                const uint32_t magic = *(uint32_t*)(void*)data;
+                dfu->status_text[0] = '\0';
+
+                if ( magic == DFU_COMPRESSED_MAGIC ) {
+                    // A compressed image (See ./dacompress), for which skip_signature
+                    // is determined later from the decoded bytes. The decoder and the
+                    // stream are started by _write_compressed() after the padding.
+                    if ( data_size < sizeof(dfu->hdr) )
+                        goto error;
+                    __builtin_memcpy(&dfu->hdr, data, sizeof(dfu->hdr));
+                    if ( dfu->hdr.size > riotboot_slot_size(dfu->selected_slot)
+                      || (dfu->hdr.data_offset != 0
+                          && dfu->hdr.data_offset < sizeof(dfu->hdr)) ) {
+                        dfu->hdr.magic_number = 0;
+                        goto error;
+                    }
+                    dfu->pad_size = dfu->hdr.data_offset != 0
+                        ? dfu->hdr.data_offset - sizeof(dfu->hdr) : 0;
+                    dfu->decoded = nullptr;
+                    dfu->decoded_size = 0;
+                    data += sizeof(dfu->hdr);
+                    data_size -= sizeof(dfu->hdr);
                 }
                 else {
-                    // Headerless firmware image.
-                    riotboot_flashwrite_init_raw(
-                        &dfu->writer, dfu->selected_slot, 0);
+                    // Determine skip_signature by checking if the packet starts with a
+                    // slot header.
+                    dfu->skip_signature = (magic == RIOTBOOT_MAGIC);
+                    // Skip the blocks that are unchanged, which is typical when
+                    // iterating on the keymap with `./dadownload`.
+                    _begin_stream(dfu);
                 }
             }
 
-            int success = riotboot_flashwrite_putbytes(
-                &dfu->writer, data, data_size, true);
-            if ( success == 0 )
+            if ( (_is_compressed(dfu) ? _write_compressed(dfu, data, data_size)
+                  : nvm_stream_write(&dfu->stream, data, data_size)) == 0 )
                 break;
         }
         // Intentional fall-through
 
         default:
         error:
-            // Error occurred, stall the current transfer.
+            // Error occurred, stall the current transfer. The slot is left incomplete,
+            // so DFU_DETACH should not swap the banks.
+            nvm_stream_abort(&dfu->stream);
+            dfu->skip_signature = -1;
             dfu->dfu_state = USB_DFU_STATE_DFU_ERROR;
             return -1;
     }
@@ -252,12 +376,12 @@ static int dfu_upload_handler(usbus_t* usbus, usbus_dfu_device_t* dfu, usb_setup
 {
     // Note: We read directly from backup RAM without stashing the data. The first
     // 64-byte packet is sent to the host reliably thanks to irq_disable(). However, if
-    // the backup RAM is full and a new log entry larger than 64 bytes arrives between
-    // the first and second packet transmissions, the second packet may be truncated,
-    // and no further packets will be sent.
+    // the backup RAM rolls over between the first and second packet transmissions, the
+    // oldest records being uploaded may be overwritten by new ones.
     unsigned irq = irq_disable();
 
-    static const char* logs;
+    static const uint8_t* logs;
+    static size_t logs_size;
     static size_t read_offset;
     static int last_block;
 
@@ -265,7 +389,7 @@ static int dfu_upload_handler(usbus_t* usbus, usbus_dfu_device_t* dfu, usb_setup
     if ( dfu->dfu_state == USB_DFU_STATE_DFU_IDLE ) {
         LOG_DEBUG("DFU: DFU_UPLOAD start");
         dfu->dfu_state = USB_DFU_STATE_DFU_UP_IDLE;
-        logs = backup_ram_read();
+        logs = backup_ram_read(&logs_size);
         read_offset = 0;
         last_block = -1;
     }
@@ -277,12 +401,12 @@ static int dfu_upload_handler(usbus_t* usbus, usbus_dfu_device_t* dfu, usb_setup
     // will have the same block number (pkt->value).
     if ( last_block != pkt->value ) {
         last_block = pkt->value;
-        data = (const uint8_t*)&logs[read_offset];
-        data_size = 0;
+        data = &logs[read_offset];
         // Note that pkt->length is the total data size requested from the host in a
         // transfer. It will be usually the same as wTransferSize.
-        while ( data_size < pkt->length && data[data_size] )
-            data_size++;
+        data_size = logs_size - read_offset;
+        if ( data_size > pkt->length )
+            data_size = pkt->length;
     }
 
     // Note that usbus_control_slicer_put_bytes() must be called with the same buffer and
@@ -315,6 +439,7 @@ static int dfu_clrstatus_handler(usbus_t*, usbus_dfu_device_t* dfu, usb_setup_t*
 
 static int dfu_abort_handler(usbus_t*, usbus_dfu_device_t* dfu, usb_setup_t*)
 {
+    nvm_stream_abort(&dfu->stream);
     matrix_thread::enable();
     dfu->dfu_state = USB_DFU_STATE_DFU_IDLE;
     return 1;
@@ -322,6 +447,9 @@ static int dfu_abort_handler(usbus_t*, usbus_dfu_device_t* dfu, usb_setup_t*)
 
 static int dfu_getstatus_handler(usbus_t* usbus, usbus_dfu_device_t* dfu, usb_setup_t*)
 {
+    uint8_t status = 0;
+    uint32_t timeout = bwPollTimeout;
+
     switch ( dfu->dfu_state ) {
         case USB_DFU_STATE_DFU_DL_BUSY:
             // Keep the host waiting until main_thread enters DFU mode.
@@ -329,12 +457,23 @@ static int dfu_getstatus_handler(usbus_t* usbus, usbus_dfu_device_t* dfu, usb_se
                 LOG_DEBUG("DFU: Waiting for entering DFU mode");
                 break;
             }
+            // Now that Lua is gone, compare the image from the first block on.
+            nvm_stream_start_diff(&dfu->stream, lua::global_lua_state::borrow_memory());
             // Intentional fall-through
 
         case USB_DFU_STATE_DFU_DL_SYNC:
-            // Flashing of a block is complete, since packets are written as they are
-            // received.
-            dfu->dfu_state = USB_DFU_STATE_DFU_DL_IDLE;
+            if ( nvm_stream_poll(&dfu->stream) != 0 ) {
+                nvm_stream_abort(&dfu->stream);
+                status = DFU_STATUS_ERR_WRITE;
+                dfu->dfu_state = USB_DFU_STATE_DFU_ERROR;
+                break;
+            }
+            // The next block can be sent as soon as the page buffered in RAM is handed
+            // over to the NVM, even before the NVM finishes writing it. Otherwise, let
+            // the host wait for the remaining time of the NVM command in progress.
+            timeout = nvm_stream_busy_ms(&dfu->stream);
+            dfu->dfu_state = timeout == 0
+                ? USB_DFU_STATE_DFU_DL_IDLE : USB_DFU_STATE_DFU_DL_BUSY;
             break;
 
         case USB_DFU_STATE_DFU_MANIFEST_SYNC:
@@ -350,10 +489,10 @@ static int dfu_getstatus_handler(usbus_t* usbus, usbus_dfu_device_t* dfu, usb_se
 
     // Send the response back to the host.
     dfu_get_status_pkt_t buf = {
-        .status = 0,
-        .timeout = bwPollTimeout,
+        .status = status,
+        .timeout = timeout,
         .state = dfu->dfu_state,
-        .string = 0
+        .string = uint8_t(dfu->status_text[0] ? dfu->status_str.idx : 0)
     };
     usbus_control_slicer_put_bytes(usbus, (uint8_t*)&buf, sizeof(buf));
     // LOG_DEBUG("DFU: respond to DFU_GETSTATUS (state=%d)", dfu->dfu_state);
@@ -1,12 +1,31 @@
 #pragma once
 
 #include "usb/dfu.h"
-#include "riotboot/flashwrite.h"
+#include "nvm_stream.h"         // for nvm_stream_t
+
+#include "heatshrink_decoder.hpp"   // for heatshrink_decoder
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// Header prepended to a compressed DFU_DNLOAD image by ./dacompress, in place of (and
+// in the same spirit as) riotboot_hdr_t. The image following it is compressed in the
+// heatshrink format (See heatshrink_decoder.hpp). ./dacompress pads the header out to
+// the first DFU_DNLOAD block, which arrives before main_thread enters DFU mode, where
+// the decoder can have its window.
+typedef struct {
+    uint32_t magic_number;      // DFU_COMPRESSED_MAGIC
+    uint8_t window_bits;
+    uint8_t lookahead_bits;
+    uint16_t data_offset;       // offset of the compressed data from the start of the
+                                // header, or 0 if right after the header
+    uint32_t size;              // size of the decompressed image
+    uint32_t crc32;             // CRC-32 (as zlib.crc32()) of the decompressed image
+} dfu_compressed_hdr_t;
+
+constexpr uint32_t DFU_COMPRESSED_MAGIC = 0x5a4f4952;  // "RIOZ"
+
 // USBUS DFU device interface context
 typedef struct usbus_dfu_device {
     usbus_handler_t handler_ctrl;           // Control interface handler
@@ -17,7 +36,14 @@ typedef struct usbus_dfu_device {
     usbus_interface_alt_t iface_alt_slot1;  // Alt interface for secondary slot
     usbus_string_t slot1_str;               // Descriptor string for Slot 1
 #endif
-    riotboot_flashwrite_t writer;           // DFU firmware update state structure
+    nvm_stream_t stream;                    // DFU firmware update state structure
+    heatshrink_decoder decoder;             // Decoder of a compressed image
+    dfu_compressed_hdr_t hdr;               // Header of a compressed image, if any
+    uint16_t pad_size;                      // Bytes of the padding yet to be skipped
+    uint8_t* decoded;                       // Decoded bytes, or nullptr if not started
+    size_t decoded_size;                    // Number of bytes in `decoded`
+    usbus_string_t status_str;              // iString of DFU_GETSTATUS response
+    char status_text[40];                   // Result of the last DFU_DNLOAD
     usbus_t* usbus;                         // Ptr to the USBUS context
     usb_dfu_state_t dfu_state;              // Internal DFU state machine
     uint8_t mode;                           // 0 - APP mode, 1 DFU mode
@@ -29,7 +55,8 @@ typedef struct usbus_dfu_device {
 void usbus_dfu_init(usbus_t* usbus, usbus_dfu_device_t* handler);
 
 // Minimum time, in milliseconds, that the host should wait before sending a subsequent
-// DFU_GETSTATUS request.
+// DFU_GETSTATUS request, while main_thread is entering DFU mode. While flashing, the
+// remaining busy time of the NVM is reported instead.
 constexpr uint32_t bwPollTimeout = 10;
 
 // For Control Transfers with no Data stage (like DFU_DETACH), the Status stage must
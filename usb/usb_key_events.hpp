@@ -13,19 +13,21 @@ public:
     struct key_event_t { uint8_t keycode; bool is_press; };
     static_assert( sizeof(key_event_t) == sizeof(uint16_t) );
 
-    // These methods are NOT thread-safe. It is the caller's responsibility to ensure
-    // safe access and synchronization.
-    // - push() is invoked by report_event() from the client thread (main_thread),
-    //   with interrupts disabled.
+    // This is a lock-free single-producer single-consumer queue:
+    // - push() is invoked by report_event() from the client thread (main_thread), and
+    //   is the only method that writes m_end.
     // - The remaining methods are used exclusively by usb_thread, which runs at the
-    //   highest priority and is not preempted.
+    //   highest priority and is never preempted by the client thread. They are the
+    //   only methods that write m_begin.
+    // An event is written into its slot first and then published by an atomic store to
+    // m_end, so usb_thread never sees a partially written event.
 
     void push(key_event_t event, bool wait_if_full =false);
     bool pop();
     void clear();
 
-    bool not_empty() const { return m_begin != m_end; }
-    bool not_full() const { return (m_end - m_begin) < QUEUE_SIZE; }
+    bool not_empty() const { return m_begin != end(); }
+    bool not_full() const { return (end() - m_begin) < QUEUE_SIZE; }
     bool peek(key_event_t& event) const;
 
 private:
@@ -43,4 +45,6 @@ private:
 
     size_t m_begin = 0;
     size_t m_end = 0;
+
+    size_t end() const { return __atomic_load_n(&m_end, __ATOMIC_ACQUIRE); }
 };
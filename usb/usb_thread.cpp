@@ -1,11 +1,12 @@
-#include "log.h"
+#include "log.h"                // for log_start_coalescing()
 #include "usbus_ext.h"          // for usbus_t, usbus_init(), usbus_create(), ...
 #include "thread.h"             // for thread_get_unchecked()
 
-#include "config.hpp"           // for ENABLE_NKRO, ENABLE_CDC_ACM
+#include "config.hpp"           // for ENABLE_NKRO, ENABLE_CDC_ACM, ENABLE_RAW_HID
 #include "usb_dfu.hpp"          // for usbus_dfu_init()
 #include "usb_thread.hpp"
 #include "usbus_hid_keyboard.hpp" // for usbus_hid_keyboard_tl<>
+#include "usbus_hid_rawhid.hpp" // for usbus_hid_rawhid_t
 
 
 
@@ -31,8 +32,11 @@ void usb_thread::init()
     // the HID stack is initialized first and allocates endpoints, it may reserve the
     // endpoints needed by CDC ACM, potentially preventing it from working properly.
     // See riot/tests/sys/usbus_board_reset/main.c for the initialization order.
-    if constexpr ( ENABLE_CDC_ACM )
+    if constexpr ( ENABLE_CDC_ACM ) {
         usb_cdc_acm_stdio_init(&m_usbus);
+        // Log lines are now coalesced into fewer CDC ACM transfers.
+        log_start_coalescing();
+    }
 
     // DFU mode stack
     static usbus_dfu_device_t _dfu;
@@ -41,6 +45,11 @@ void usb_thread::init()
     static usbus_hid_keyboard_tl<ENABLE_NKRO> _hid_keyboard(&m_usbus);
     m_hid_keyboard = &_hid_keyboard;
 
+    // Raw HID for host tooling
+    if constexpr ( ENABLE_RAW_HID ) {
+        static usbus_hid_rawhid_t _hid_rawhid(&m_usbus);
+    }
+
     // Create "usbus" thread.
     usbus_create(
         m_thread_stack, sizeof(m_thread_stack), THREAD_PRIO_USB, USBUS_TNAME, &m_usbus);
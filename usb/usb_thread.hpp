@@ -46,6 +46,10 @@ public:
         m_hid_keyboard->report_release(keycode);
     }
 
+    static usbus_hid_keyboard_t::latency_probe_t& latency_probe() {
+        return m_hid_keyboard->m_latency_probe;
+    }
+
 private:
     constexpr usb_thread() =delete;  // Ensure a static class
 
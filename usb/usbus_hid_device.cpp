@@ -50,18 +50,22 @@ usbus_hid_device_ext_t::usbus_hid_device_ext_t(usbus_t* _usbus,
     usbus_register_event_handler(usbus, &handler_ctrl);
 }
 
-void usbus_hid_device_ext_t::_hdlr_tx_ready(event_t* event)
+void usbus_hid_device_ext_t::transmit()
 {
-    usbus_hid_device_ext_t* const hidx = static_cast<usbus_hid_device_ext_t*>(
-        (usbus_hid_device_t*)container_of(event, usbus_hid_device_t, tx_ready));
-    usbdev_ep_xmit(hidx->ep_in->ep, hidx->in_buf, hidx->occupied);
+    usbdev_ep_xmit(ep_in->ep, in_buf, occupied);
 
     // The host typically polls for IN packets at intervals of at least
-    // hidx->ep_in->interval ms. After sending a packet, we start tx_timer to monitor
-    // for host responsiveness—for example, to detect a cable break or stalled
-    // transmission.
+    // ep_in->interval ms. After sending a packet, we start tx_timer to monitor for host
+    // responsiveness—for example, to detect a cable break or stalled transmission.
     // An extra 1 ms is added as a timing margin to account for jitter.
-    ztimer_set(ZTIMER_MSEC, &hidx->tx_timer, hidx->ep_in->interval + 1);
+    ztimer_set(ZTIMER_MSEC, &tx_timer, ep_in->interval + 1);
+}
+
+void usbus_hid_device_ext_t::_hdlr_tx_ready(event_t* event)
+{
+    usbus_hid_device_ext_t* const hidx = static_cast<usbus_hid_device_ext_t*>(
+        (usbus_hid_device_t*)container_of(event, usbus_hid_device_t, tx_ready));
+    hidx->transmit();
 }
 
 void usbus_hid_device_ext_t::_tmo_transfer_complete(void* arg)
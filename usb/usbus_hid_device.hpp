@@ -55,6 +55,9 @@ protected:
     usbus_hid_device_ext_t(usbus_t* usbus,
         const uint8_t* report_desc, size_t report_desc_size, usbus_hid_cb_t cb_receive_data);
 
+    // Arm the IN endpoint to transmit in_buf[0..occupied), within usb_thread context.
+    void transmit();
+
     event_ext_t<usbus_hid_device_ext_t*> m_event_transfer_complete = {
         nullptr,  // .list_node
         [](event_t* pevent) {  // .handler
@@ -1,7 +1,7 @@
 // #define LOCAL_LOG_LEVEL LOG_NONE
 
-#include "irq.h"                // for irq_disable(), irq_restore()
-#include "log.h"
+#include "board.h"              // for get_cycle_count()
+#include "log.h"                // for LOG_DEFERRED(), log_flush_deferred()
 #include "ztimer.h"             // for ztimer_set(), ztimer_remove()
 
 #include "config.hpp"           // for USB_RESUME_SETTLE_MS, ...
@@ -127,11 +127,12 @@ void usbus_hid_keyboard_t::_tmo_resume_settle(void* arg)
 // * This condition, however, can be relaxed in 6KRO mode. Even in NKRO mode, a
 //   non-modifier press can be reported alongside a modifier press in the same frame.
 
-// This method is not thread-safe, but is always invoked either from usb_thread or via
-// report_event() from client thread — both contexts ensure thread safety. To preserve
-// event ordering when sending to the host, this method must not be called again within
-// the same packet frame if returning false. Both report_event() and
-// on_transfer_complete() respect this constraint.
+// This method is not thread-safe, but is always invoked from usb_thread, which is the
+// only context that stages the report. To preserve event ordering when sending to the
+// host, events must be tried in order and none may be skipped if this returns false.
+// process_key_event_queue() respects this constraint.
+// Note: Logs are only recorded here using LOG_DEFERRED() and are formatted later with
+// log_flush_deferred(), once the events that fit into the current frame are reported.
 bool usbus_hid_keyboard_t::try_report_event(uint8_t keycode, bool is_press)
 {
     if ( m_report_updated > 1 )
@@ -140,13 +141,16 @@ bool usbus_hid_keyboard_t::try_report_event(uint8_t keycode, bool is_press)
             return false;
 
     if ( update_report(keycode, is_press) ) {
+        if ( unlikely(keycode == m_latency_probe.keycode) )
+            m_latency_probe.state = latency_probe_t::STAGED;
+
         if ( m_report_updated++ == 0 ) {
-            LOG_DEBUG("USB_HID: register %s (0x%x %s)",
+            LOG_DEFERRED(LOG_DEBUG, "USB_HID: register %s (0x%x %s)",
                 press_or_release(is_press), keycode, keycode_to_name[keycode]);
             submit_report();
         }
         else {
-            LOG_DEBUG("USB_HID: defer %s (0x%x %s)",
+            LOG_DEFERRED(LOG_DEBUG, "USB_HID: defer %s (0x%x %s)",
                 press_or_release(is_press), keycode, keycode_to_name[keycode]);
             if ( is_press )
                 m_press_yet_to_submit = keycode;
@@ -156,45 +160,73 @@ bool usbus_hid_keyboard_t::try_report_event(uint8_t keycode, bool is_press)
     return true;
 }
 
-// This method is supposed to execute from client thread (main_thread).
+// This method is supposed to execute from client thread (main_thread). It neither
+// touches the report nor disables interrupts; the event is published through the
+// lock-free key event queue, and usb_thread, which preempts us as soon as the event is
+// posted, reports it.
 void usbus_hid_keyboard_t::report_event(uint8_t keycode, bool is_press)
 {
-    unsigned state = irq_disable();  // Disable preemption by usb_thread or interrupt.
+    const bool is_usb_accessible = m_is_usb_accessible;
+
+    if ( unlikely(keycode == m_latency_probe.keycode) ) {
+        m_latency_probe.queued_at = get_cycle_count();
+        m_latency_probe.state = latency_probe_t::QUEUED;
+    }
 
     // While USB is suspended, key events are still added to the event queue so they can
     // take effect once USB resumes. These events remain in the queue only for
     // USB_SUSPEND_EVENT_TIMEOUT_MS.
-    if ( unlikely(!m_is_usb_accessible) ) {
+    if ( unlikely(!is_usb_accessible) ) {
         LOG_DEBUG("USB_HID: key %s in suspend mode", press_or_release(is_press));
         if ( is_press )
             usb_thread::send_remote_wake_up();
-        m_key_event_queue.push({keycode, is_press});
 
         // Start m_timer_clear_queue, or extend its duration if the timer is already
         // running.
         ztimer_set(ZTIMER_MSEC, &m_timer_clear_queue, USB_SUSPEND_EVENT_TIMEOUT_MS);
     }
 
-    else if ( m_key_event_queue.not_empty() || !try_report_event(keycode, is_press) )
-        // m_is_usb_accessible is true and we allow push() to block.
-        m_key_event_queue.push({keycode, is_press}, true);
+    // We allow push() to block only if USB is accessible.
+    m_key_event_queue.push({keycode, is_press}, is_usb_accessible);
+    usbus_event_post(usbus, &m_event_key_queued);
+}
+
+// Process the key event queue, pushing as many events as fit into the packet frame. If
+// an event cannot be pushed, exit early and resume processing at the next frame.
+void usbus_hid_keyboard_t::process_key_event_queue()
+{
+    usb_key_events::key_event_t event;
+    while ( m_key_event_queue.peek(event)
+      && try_report_event(event.keycode, event.is_press) )
+        m_key_event_queue.pop();
 
-    irq_restore(state);
+    log_flush_deferred();
 }
 
 void usbus_hid_keyboard_t::submit_report()
 {
+    if ( unlikely(m_latency_probe.state == latency_probe_t::STAGED) ) {
+        m_latency_probe.submitted_at = get_cycle_count();
+        m_latency_probe.state = latency_probe_t::SUBMITTED;
+    }
+
     occupied = ep_in->maxpacketsize;
     fill_in_buf();
-    usbus_event_post(usbus, &tx_ready);
+    // We are already in usb_thread, so arm the endpoint directly instead of posting
+    // tx_ready.
+    transmit();
 }
 
 // This method is invoked from an event handler (e.g. m_event_transfer_complete or
-// usbdev_ep_esr()) within usb_thread context. However, it is safe to call from
-// interrupt context as well, since submit_report() and try_report_event() only post
-// events and perform lightweight memory operations.
+// usbdev_ep_esr()) within usb_thread context.
 void usbus_hid_keyboard_t::on_transfer_complete(bool was_successful)
 {
+    if ( unlikely(m_latency_probe.state == latency_probe_t::SUBMITTED) ) {
+        m_latency_probe.acked_at = get_cycle_count();
+        m_latency_probe.state =
+            was_successful ? latency_probe_t::ACKED : latency_probe_t::FAILED;
+    }
+
     // If USB suspends during an active transfer, do nothing here — on_reset() is
     // responsible for resetting the report state data.
     if ( unlikely(!m_is_usb_accessible) )
@@ -202,9 +234,6 @@ void usbus_hid_keyboard_t::on_transfer_complete(bool was_successful)
 
     if ( was_successful && m_report_updated > 1 ) {
         LOG_DEBUG("USB_HID: register deferred events");
-        // Calling submit_report() here will post a new event while another event is
-        // being handled, which requires Riot's _usbus_thread() to be updated to handle
-        // multiple queued events per invocation.
         submit_report();
         m_report_updated = 1;
     }
@@ -214,17 +243,11 @@ void usbus_hid_keyboard_t::on_transfer_complete(bool was_successful)
     }
     m_press_yet_to_submit = KC_NO;
 
-    // Process remaining events from the key event queue, pushing as many as fit into
-    // the packet frame. If an event cannot be pushed, exit early and resume processing
-    // at the next frame.
-    usb_key_events::key_event_t event;
-    while ( m_key_event_queue.peek(event)
-      && try_report_event(event.keycode, event.is_press) )
-        m_key_event_queue.pop();
+    // Process remaining events from the key event queue.
+    process_key_event_queue();
 }
 
 
-
 // Keyboard HID report formats:
 //
 // * Standard 8-byte report (6KRO):
@@ -248,7 +271,7 @@ bool usbus_hid_keyboard_t::help_update_bits(uint8_t& bits, uint8_t keycode, bool
 {
     const uint8_t mask = uint8_t(1) << (keycode & 7);
     if ( ((bits & mask) != 0) == is_press ) {
-        LOG_ERROR("USB_HID: Key (0x%x %s) is already %sed",
+        LOG_DEFERRED(LOG_ERROR, "USB_HID: Key (0x%x %s) is already %sed",
             keycode, keycode_to_name[keycode], is_press ? "press" : "releas");
         return false;
     }
@@ -264,7 +287,7 @@ bool usbus_hid_keyboard_t::help_update_skro_report(
     for ( i = 0 ; i < SKRO_KEYS_SIZE && keys[i] != KC_NO ; i++ )
         if ( keys[i] == keycode ) {
             if ( is_press ) {
-                LOG_ERROR("USB_HID: Key (0x%x %s) is already pressed",
+                LOG_DEFERRED(LOG_ERROR, "USB_HID: Key (0x%x %s) is already pressed",
                     keycode, keycode_to_name[keycode]);
                 return false;
             }
@@ -277,13 +300,13 @@ bool usbus_hid_keyboard_t::help_update_skro_report(
         }
 
     if ( !is_press ) {
-        LOG_ERROR("USB_HID: Key (0x%x %s) is already released",
+        LOG_DEFERRED(LOG_ERROR, "USB_HID: Key (0x%x %s) is already released",
             keycode, keycode_to_name[keycode]);
         return false;
     }
 
     if ( i == SKRO_KEYS_SIZE ) {
-        LOG_WARNING("USB_HID: no room to report key press (0x%x %s)",
+        LOG_DEFERRED(LOG_WARNING, "USB_HID: no room to report key press (0x%x %s)",
             keycode, keycode_to_name[keycode]);
         return false;
     }
@@ -296,7 +319,8 @@ bool usbus_hid_keyboard_t::help_update_nkro_report(
     uint8_t bits[], uint8_t keycode, bool is_press)
 {
     if ( (keycode >> 3) >= NKRO_KEYS_SIZE ) {
-        LOG_WARNING("USB_HID: Key (0x%x) is out of NKRO report range", keycode);
+        LOG_DEFERRED(LOG_WARNING,
+            "USB_HID: Key (0x%x) is out of NKRO report range", keycode);
         return false;
     }
 
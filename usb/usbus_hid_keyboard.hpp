@@ -12,7 +12,8 @@
 class usbus_hid_keyboard_t: public usbus_hid_device_ext_t {
 public:
     // This function works because m_report_updated is updated within the highest
-    // priority usb_thread context (from try_report_event() and on_transfer_complete()).
+    // priority usb_thread context (from try_report_event() and on_transfer_complete()),
+    // which processes each key event as soon as report_event() posts it.
     bool is_idle() const { return m_report_updated == 0; }
 
     void on_reset() override;
@@ -26,16 +27,30 @@ public:
     void set_protocol(uint8_t protocol) override { m_keyboard_protocol = protocol; }
 
     // These two user-facing methods register key press/release events to the host. They
-    // are thread-safe, and non-blocking as long as the key event queue is not full. If
-    // the queue is full and USB is accessible, the caller thread (main_thread) will
-    // block until space becomes available. If USB is not accessible, the methods remain
-    // non-blocking and silently discard the oldest events.
+    // are thread-safe without disabling interrupts, and non-blocking as long as the key
+    // event queue is not full. If the queue is full and USB is accessible, the caller
+    // thread (main_thread) will block until space becomes available. If USB is not
+    // accessible, the methods remain non-blocking and discard the new events with a
+    // warning, leaving the queued ones to usb_thread.
     // Note: No explicit delay between consecutive calls is required — this is handled
     // internally. You can safely call report_press() and report_release() back-to-back
     // for the same key.
     void report_press(uint8_t keycode) { report_event(keycode, true); }
     void report_release(uint8_t keycode) { report_event(keycode, false); }
 
+    // Latency probe used by fw.usb_latency_test(). While `keycode` is set (not KC_NO),
+    // key events of the keycode are timestamped with the cycle counter when queued by
+    // report_event(), when submitted to the host, and when acknowledged by the host.
+    // `state` is updated by usb_thread and polled by the client thread.
+    struct latency_probe_t {
+        enum : uint8_t { IDLE, QUEUED, STAGED, SUBMITTED, ACKED, FAILED };
+        volatile uint8_t state = IDLE;
+        uint8_t keycode = KC_NO;
+        uint32_t queued_at;
+        uint32_t submitted_at;
+        uint32_t acked_at;
+    } m_latency_probe;
+
 protected:
     using usbus_hid_device_ext_t::usbus_hid_device_ext_t;
 
@@ -73,10 +88,27 @@ protected:
     // possible.
     bool try_report_event(uint8_t keycode, bool is_press);
 
-    // Report a key event during the current packet frame if possible. Otherwise put it
-    // in the key event queue so that it can be reported in next packet frame(s).
+    // Put a key event in the key event queue and let usb_thread report it during the
+    // current packet frame if possible, or in next packet frame(s) otherwise.
     void report_event(uint8_t keycode, bool is_press);
 
+    // Report as many queued key events as fit into the current packet frame.
+    void process_key_event_queue();
+
+    // Posted by report_event() to have usb_thread process the key event queue.
+    event_ext_t<usbus_hid_keyboard_t*> m_event_key_queued = {
+        nullptr,  // .list_node
+        [](event_t* pevent) {  // .handler
+            usbus_hid_keyboard_t* const hidx =
+                static_cast<event_ext_t<usbus_hid_keyboard_t*>*>(pevent)->arg;
+            // While USB is inaccessible the events remain in the queue, and will be
+            // processed by _tmo_resume_settle().
+            if ( hidx->m_is_usb_accessible )
+                hidx->process_key_event_queue();
+        },
+        this  // .arg
+    };
+
     // Timer to wait for USB_SUSPEND_EVENT_TIMEOUT_MS before clearing the key event
     // queue, used when events are backfilled while USB is inaccessible.
     // Note: The key event queue is cleared by posting m_event_clear_queue from the
@@ -94,12 +126,15 @@ protected:
         [](event_t* pevent) {  // .handler
             usbus_hid_keyboard_t* const hidx =
                 static_cast<event_ext_t<usbus_hid_keyboard_t*>*>(pevent)->arg;
-            hidx->m_key_event_queue.clear();
+            // USB may have become accessible after the timer was started.
+            if ( !hidx->m_is_usb_accessible )
+                hidx->m_key_event_queue.clear();
         },
         this  // .arg
     };
 
-    // Submit the current packet frame (report) to the host.
+    // Submit the current packet frame (report) to the host. The report is staged in
+    // m_report and copied to in_buf, which stays intact while it is being transmitted.
     void submit_report();
 
     // Called after a packet frame is delivered to the host — whether delivery succeeded,
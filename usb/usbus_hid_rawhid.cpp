@@ -0,0 +1,508 @@
+#include <cstddef>              // for offsetof()
+#include <cstring>              // for strnlen()
+
+#include "cpu.h"                // for HSRAM_ADDR, HSRAM_SIZE
+#include "log.h"
+#include "riotboot/hdr.h"       // for RIOTBOOT_MAGIC
+#include "riotboot/slot.h"      // for riotboot_slot_get_hdr(), riotboot_slot_size()
+#include "seeprom.h"            // for seeprom_bkswrst()
+#include "ztimer.h"             // for ztimer_now(), ztimer_set(), ztimer_remove()
+
+#include "config.hpp"           // for RAW_HID_INTERVAL_MS, RAW_HID_UPLOAD_TIMEOUT_MS
+#include "lua.hpp"              // for lua::global_lua_state::validate_bytecode()
+#include "main_thread.hpp"      // for main_thread::is_dfu_mode(), ...
+#include "matrix_thread.hpp"    // for matrix_thread::enable/disable()
+#include "persistent.hpp"       // for persistent::set()
+#include "usbus_hid_rawhid.hpp"
+
+
+
+void usbus_hid_rawhid_t::usb_init(usbus_t* usbus)
+{
+    iface._class = USB_CLASS_HID;
+    // Configure generic HID device interface, choosing NONE for subclass and protocol
+    // in order to represent a generic I/O device.
+    iface.subclass = USB_HID_SUBCLASS_NONE;
+    iface.protocol = USB_HID_PROTOCOL_NONE;
+    iface.descr_gen = &hid_descr;
+    iface.handler = &handler_ctrl;
+
+    // on_reset() arms the OUT endpoint.
+    usbus_handler_set_flag(&handler_ctrl, USBUS_HANDLER_FLAG_RESET);
+
+    // IN endpoint to send responses to host
+    ep_in = usbus_add_endpoint(usbus, &iface,
+                               USB_EP_TYPE_INTERRUPT,
+                               USB_EP_DIR_IN,
+                               RAW_HID_REPORT_SIZE);
+    ep_in->interval = RAW_HID_INTERVAL_MS;
+    usbus_enable_endpoint(ep_in);
+
+    // OUT endpoint to receive requests from host
+    ep_out = usbus_add_endpoint(usbus, &iface,
+                                USB_EP_TYPE_INTERRUPT,
+                                USB_EP_DIR_OUT,
+                                RAW_HID_REPORT_SIZE);
+    ep_out->interval = RAW_HID_INTERVAL_MS;
+    usbus_enable_endpoint(ep_out);
+
+    usbus_add_interface(usbus, &iface);
+}
+
+void usbus_hid_rawhid_t::on_reset()
+{
+    m_is_transmitting = false;
+
+    // Signal that the interrupt OUT endpoint is ready to receive data.
+    usbdev_ep_xmit(ep_out->ep, out_buf, 0);
+}
+
+void usbus_hid_rawhid_t::_hdlr_receive_data(
+    usbus_hid_device_t* hid, uint8_t* data, size_t len)
+{
+    usbus_hid_rawhid_t* const hidx = static_cast<usbus_hid_rawhid_t*>(hid);
+
+    if ( len < offsetof(rpc_packet_t, payload) )
+        return;
+
+    hidx->m_requests++;
+    // The host is expected to wait for each response, so this happens only when the
+    // host gives up on a response (e.g. timeout) and sends a new request.
+    if ( hidx->m_is_transmitting ) {
+        LOG_WARNING("RAW_HID: request dropped while responding");
+        hidx->m_dropped++;
+        return;
+    }
+
+    // Copy the request since a SET_REPORT request may deliver a short packet.
+    rpc_packet_t request {};
+    __builtin_memcpy(&request, data, len < sizeof(request) ? len : sizeof(request));
+    if ( request.length > sizeof(request.payload) )
+        request.length = sizeof(request.payload);
+
+    rpc_packet_t& response = *reinterpret_cast<rpc_packet_t*>(hidx->in_buf);
+    __builtin_memset(&response, 0, sizeof(response));
+    response.command = request.command;
+    response.seq = request.seq;
+    response.status = hidx->execute(request, response);
+    if ( response.status != STATUS_OK )
+        hidx->m_errors++;
+
+    hidx->occupied = RAW_HID_REPORT_SIZE;
+    hidx->m_is_transmitting = true;
+    hidx->transmit();
+}
+
+uint8_t usbus_hid_rawhid_t::execute(const rpc_packet_t& request, rpc_packet_t& response)
+{
+    switch ( request.command ) {
+        case RPC_PING:
+            __builtin_memcpy(response.payload, request.payload, request.length);
+            response.length = request.length;
+            return STATUS_OK;
+
+        case RPC_READ_STATS: {
+            const rpc_stats_t stats = {
+                .uptime_ms = ztimer_now(ZTIMER_MSEC),
+                .requests = m_requests,
+                .errors = m_errors,
+                .dropped = m_dropped,
+                .is_dfu_mode = main_thread::is_dfu_mode(),
+            };
+            __builtin_memcpy(response.payload, &stats, sizeof(stats));
+            response.length = sizeof(stats);
+            return STATUS_OK;
+        }
+
+        case RPC_NVM_SET:
+            return rpc_nvm_set(request);
+
+        case RPC_UPLOAD_BEGIN:
+            return rpc_upload_begin();
+
+        case RPC_UPLOAD_CHUNK:
+            return rpc_upload_chunk(request);
+
+        case RPC_UPLOAD_END:
+            return rpc_upload_end();
+
+        case RPC_STAGE_BEGIN:
+            return rpc_stage_begin(request);
+
+        case RPC_STAGE_CHUNK:
+            return rpc_stage_chunk(request);
+
+        case RPC_STAGE_END:
+            return rpc_stage_end();
+
+        case RPC_STAGE_SWAP:
+            return rpc_stage_swap();
+
+        default:
+            LOG_WARNING("RAW_HID: unknown command 0x%x", request.command);
+            return STATUS_UNKNOWN;
+    }
+}
+
+// payload: value_type (1 byte) + name (null-terminated) + value
+uint8_t usbus_hid_rawhid_t::rpc_nvm_set(const rpc_packet_t& request)
+{
+    const char* const name = (const char*)&request.payload[1];
+    if ( request.length < 2 )
+        return STATUS_INVALID;
+    const size_t name_size = strnlen(name, request.length - 1) + 1;
+    if ( request.length < 1 + name_size )
+        return STATUS_INVALID;
+
+    const uint8_t* const value = &request.payload[1 + name_size];
+    const size_t value_size = request.length - 1 - name_size;
+
+    bool success;
+    switch ( request.payload[0] ) {
+        case NVM_INTEGER: {
+            int integer;
+            if ( value_size != sizeof(integer) )
+                return STATUS_INVALID;
+            __builtin_memcpy(&integer, value, sizeof(integer));
+            success = persistent::set(name, integer);
+            break;
+        }
+
+        case NVM_FLOAT: {
+            float number;
+            if ( value_size != sizeof(number) )
+                return STATUS_INVALID;
+            __builtin_memcpy(&number, value, sizeof(number));
+            success = persistent::set(name, number);
+            break;
+        }
+
+        case NVM_STRING:
+            if ( value_size == 0 || value[value_size - 1] != '\0' )
+                return STATUS_INVALID;
+            success = persistent::set(name, (const char*)value);
+            break;
+
+        default:
+            return STATUS_INVALID;
+    }
+
+    LOG_DEBUG("RAW_HID: set nvm[\"%s\"] (%s)", name, success ? "ok" : "failed");
+    return success ? STATUS_OK : STATUS_FAILED;
+}
+
+// Both the upload and the staging write into slot 0, i.e. the opposite bank.
+static const uint32_t* _slot0()
+{
+    return (const uint32_t*)riotboot_slot_get_hdr(0);
+}
+
+static void _begin_slot0(nvm_stream_t* stream)
+{
+    nvm_stream_begin(stream, (uint32_t)_slot0(), riotboot_slot_size(0));
+}
+
+// Return true if slot 0 still holds the Lua keymap, i.e. nothing has been written yet.
+static bool _is_slot0_intact()
+{
+    return riotboot_slot_validate(0) == 0
+        && lua::global_lua_state::validate_bytecode(SLOT0_OFFSET + RIOTBOOT_HDR_LEN);
+}
+
+// The upload follows the same sequence as the DFU download of Lua bytecode: leave
+// normal mode, write the image into slot 0, and enter normal mode again, which reloads
+// the keymap module from the new image.
+uint8_t usbus_hid_rawhid_t::rpc_upload_begin()
+{
+    LOG_DEBUG("RAW_HID: upload start");
+    // Disable matrix_thread to prevent key events.
+    matrix_thread::disable();
+    if ( !main_thread::is_dfu_mode() )
+        main_thread::signal_mode_toggle();
+
+    // The upload replaces any staged image.
+    nvm_stream_abort(&m_stream);
+    m_stage_state = STAGE_NONE;
+
+    m_is_uploading = true;
+    m_upload_offset = 0;
+    ztimer_set(ZTIMER_MSEC, &m_upload_timer, RAW_HID_UPLOAD_TIMEOUT_MS);
+    return STATUS_OK;
+}
+
+void usbus_hid_rawhid_t::_tmo_upload(void* arg)
+{
+    usbus_hid_rawhid_t* const hidx = static_cast<usbus_hid_rawhid_t*>(arg);
+    usbus_event_post(hidx->usbus, &hidx->m_event_upload_timeout);
+}
+
+void usbus_hid_rawhid_t::on_upload_timeout()
+{
+    // The upload may have ended while the event was pending.
+    if ( m_is_uploading ) {
+        LOG_WARNING("RAW_HID: upload timed out");
+        abort_upload();
+    }
+}
+
+// Give up the upload and let the keys work again. If nothing has been written yet,
+// main_thread returns to normal mode with the Lua keymap in slot 0. Otherwise, it stays
+// in DFU mode until the Lua keymap is downloaded again.
+void usbus_hid_rawhid_t::abort_upload()
+{
+    ztimer_remove(ZTIMER_MSEC, &m_upload_timer);
+    nvm_stream_abort(&m_stream);
+    m_is_uploading = false;
+    matrix_thread::enable();
+
+    if ( _is_slot0_intact() ) {
+        if ( main_thread::is_dfu_mode() )
+            main_thread::signal_mode_toggle();
+    }
+    else
+        LOG_WARNING("RAW_HID: upload aborted; download the Lua keymap again");
+}
+
+uint8_t usbus_hid_rawhid_t::rpc_upload_chunk(const rpc_packet_t& request)
+{
+    if ( !m_is_uploading || request.length < sizeof(uint32_t) )
+        return STATUS_INVALID;
+    ztimer_set(ZTIMER_MSEC, &m_upload_timer, RAW_HID_UPLOAD_TIMEOUT_MS);
+
+    // Keep the host waiting until main_thread enters DFU mode.
+    if ( !main_thread::is_dfu_mode() )
+        return STATUS_BUSY;
+
+    uint32_t offset;
+    __builtin_memcpy(&offset, request.payload, sizeof(offset));
+    if ( offset != m_upload_offset )
+        return STATUS_INVALID;
+
+    const uint8_t* const data = &request.payload[sizeof(offset)];
+    const size_t data_size = request.length - sizeof(offset);
+
+    if ( offset == 0 ) {
+        // Only Lua bytecode images with a slot header are accepted. Firmware should be
+        // flashed through DFU or staged.
+        uint32_t magic = 0;
+        if ( data_size >= sizeof(magic) )
+            __builtin_memcpy(&magic, data, sizeof(magic));
+        if ( magic != RIOTBOOT_MAGIC ) {
+            abort_upload();
+            return STATUS_INVALID;
+        }
+
+        // The magic number ("RIOT") in the slot header is written last by
+        // nvm_stream_finish().
+        _begin_slot0(&m_stream);
+    }
+
+    if ( nvm_stream_write(&m_stream, data, data_size) != 0 ) {
+        abort_upload();
+        return STATUS_FAILED;
+    }
+
+    m_upload_offset += data_size;
+    return STATUS_OK;
+}
+
+uint8_t usbus_hid_rawhid_t::rpc_upload_end()
+{
+    if ( !m_is_uploading || m_upload_offset == 0 )
+        return STATUS_INVALID;
+
+    ztimer_remove(ZTIMER_MSEC, &m_upload_timer);
+    m_is_uploading = false;
+    const bool success = nvm_stream_finish(&m_stream) == 0;
+    LOG_DEBUG("RAW_HID: upload end (%d bytes)", m_upload_offset);
+
+    matrix_thread::enable();
+    if ( !success )
+        // Stay in DFU mode, as slot 0 does not hold a valid image now.
+        return STATUS_FAILED;
+
+    // Let main_thread enter the normal mode with the new Lua bytecode.
+    if ( main_thread::is_dfu_mode() )
+        main_thread::signal_mode_toggle();
+    return STATUS_OK;
+}
+
+// Staging writes a firmware image into the opposite bank while the keyboard stays in
+// use, typing with FALLBACK_KEYMAP (See main_thread::signal_staging()), and the banks
+// are swapped later at the user's request. Since usb_thread runs at the highest
+// priority, it should not wait for the NVM here, which would hold off matrix scanning
+// and HID reports. The host is asked to retry (STATUS_BUSY) instead.
+
+// Number of bytes verified per RPC_STAGE_END request (~0.4 ms)
+constexpr size_t STAGE_VERIFY_SIZE = 4096;
+
+// Delay for the response to RPC_STAGE_SWAP to reach the host before the reset
+constexpr uint32_t STAGE_SWAP_DELAY_MS = 50;
+
+// Sanity check of the vector table on top of the CRC: the initial stack pointer should
+// point into the RAM, and the reset handler into the image once it runs from bank A.
+static bool _is_valid_firmware(const uint32_t* vectors, size_t size)
+{
+    return vectors[0] > HSRAM_ADDR && vectors[0] <= HSRAM_ADDR + HSRAM_SIZE
+        && (vectors[1] & 1) != 0 && vectors[1] < size;
+}
+
+// Give up the staging. If nothing has been written yet, the Lua keymap in slot 0 is
+// intact and main_thread returns to normal mode. Otherwise, it keeps typing with
+// FALLBACK_KEYMAP until the Lua keymap is downloaded again (e.g. `./dadownload`), which
+// also returns it to normal mode, or the staging is retried.
+void usbus_hid_rawhid_t::abort_staging()
+{
+    nvm_stream_abort(&m_stream);
+    m_stage_state = STAGE_NONE;
+
+    if ( _is_slot0_intact() ) {
+        if ( main_thread::is_dfu_mode() )
+            main_thread::signal_mode_toggle();
+    }
+    else
+        LOG_WARNING("RAW_HID: staging failed; download the Lua keymap again");
+}
+
+uint8_t usbus_hid_rawhid_t::rpc_stage_begin(const rpc_packet_t& request)
+{
+    uint32_t size, crc;
+    if ( m_is_uploading || request.length != sizeof(size) + sizeof(crc) )
+        return STATUS_INVALID;
+    __builtin_memcpy(&size, &request.payload[0], sizeof(size));
+    __builtin_memcpy(&crc, &request.payload[sizeof(size)], sizeof(crc));
+    if ( size < 2 * sizeof(uint32_t) || size > riotboot_slot_size(0) )
+        return STATUS_INVALID;
+
+    LOG_DEBUG("RAW_HID: stage start (%lu bytes)", size);
+    nvm_stream_abort(&m_stream);
+    // The Lua keymap stops running as the opposite bank gets overwritten, but the keys
+    // keep working.
+    matrix_thread::enable();
+    main_thread::signal_staging();
+
+    m_stage_state = STAGE_RECEIVING;
+    m_stage_offset = 0;
+    m_stage_size = size;
+    m_stage_crc = crc;
+    return STATUS_OK;
+}
+
+uint8_t usbus_hid_rawhid_t::rpc_stage_chunk(const rpc_packet_t& request)
+{
+    if ( m_stage_state != STAGE_RECEIVING || request.length < sizeof(uint32_t) )
+        return STATUS_INVALID;
+
+    // Keep the host waiting until main_thread leaves the Lua keymap.
+    if ( !main_thread::is_dfu_mode() )
+        return STATUS_BUSY;
+
+    uint32_t offset;
+    __builtin_memcpy(&offset, request.payload, sizeof(offset));
+    const uint8_t* const data = &request.payload[sizeof(offset)];
+    const size_t data_size = request.length - sizeof(offset);
+    if ( offset != m_stage_offset || data_size > m_stage_size - offset )
+        return STATUS_INVALID;
+
+    if ( offset == 0 ) {
+        // Only headerless firmware images are accepted.
+        uint32_t magic = RIOTBOOT_MAGIC;
+        if ( data_size >= sizeof(magic) )
+            __builtin_memcpy(&magic, data, sizeof(magic));
+        if ( magic == RIOTBOOT_MAGIC ) {
+            abort_staging();
+            return STATUS_INVALID;
+        }
+
+        _begin_slot0(&m_stream);
+    }
+
+    // Throttle the writing to the pace of the NVM.
+    if ( nvm_stream_poll(&m_stream) == 0 ) {
+        if ( nvm_stream_would_block(&m_stream, data_size) )
+            return STATUS_BUSY;
+        if ( nvm_stream_write(&m_stream, data, data_size) == 0 ) {
+            m_stage_offset += data_size;
+            return STATUS_OK;
+        }
+    }
+
+    abort_staging();
+    return STATUS_FAILED;
+}
+
+// The image is verified piecemeal too, STAGE_VERIFY_SIZE bytes per request, answering
+// STATUS_BUSY until done. The first quad-word (the initial stack pointer and the reset
+// vector) is written only after the verification passes, so that a failed image never
+// looks valid in the flash. Even then, it takes effect only through RPC_STAGE_SWAP.
+uint8_t usbus_hid_rawhid_t::rpc_stage_end()
+{
+    switch ( m_stage_state ) {
+        case STAGE_RECEIVING:
+            if ( m_stage_offset != m_stage_size )
+                return STATUS_INVALID;
+            // This waits for the last page to be written, which takes ~1 ms.
+            if ( nvm_stream_flush(&m_stream) != 0 ) {
+                abort_staging();
+                return STATUS_FAILED;
+            }
+            m_stage_state = STAGE_VERIFYING;
+            m_stage_offset = 0;
+            m_stage_actual_crc = 0;
+            return STATUS_BUSY;
+
+        case STAGE_VERIFYING: {
+            size_t size = m_stage_size - m_stage_offset;
+            if ( size > STAGE_VERIFY_SIZE )
+                size = STAGE_VERIFY_SIZE;
+
+            // The first quad-word is still held by m_stream.
+            size_t head = 0;
+            if ( m_stage_offset == 0 ) {
+                head = size < NVM_STREAM_QWORD_SIZE ? size : NVM_STREAM_QWORD_SIZE;
+                m_stage_actual_crc = nvm_stream_crc32(0, m_stream.first_qword, head);
+            }
+            m_stage_actual_crc = nvm_stream_crc32(m_stage_actual_crc,
+                (const uint8_t*)_slot0() + m_stage_offset + head, size - head);
+            m_stage_offset += size;
+            if ( m_stage_offset < m_stage_size )
+                return STATUS_BUSY;
+
+            const bool success = m_stage_actual_crc == m_stage_crc
+                && _is_valid_firmware(m_stream.first_qword, m_stage_size)
+                && nvm_stream_commit(&m_stream) == 0;
+            LOG_DEBUG("RAW_HID: stage end (%s)", success ? "verified" : "failed");
+            if ( !success ) {
+                abort_staging();
+                return STATUS_FAILED;
+            }
+            m_stage_state = STAGE_STAGED;
+            return STATUS_OK;
+        }
+
+        case STAGE_STAGED:
+            return STATUS_OK;
+
+        default:
+            return STATUS_INVALID;
+    }
+}
+
+uint8_t usbus_hid_rawhid_t::rpc_stage_swap()
+{
+    if ( m_stage_state != STAGE_STAGED || !_is_valid_firmware(_slot0(), m_stage_size) )
+        return STATUS_INVALID;
+
+    LOG_DEBUG("RAW_HID: swap banks");
+    // seeprom_bkswrst() flushes the SEEPROM, which logs and waits for the NVM, so it
+    // runs in usb_thread instead of the ztimer callback in ISR context.
+    static event_t _event = { nullptr,  // .list_node
+        [](event_t*) { seeprom_bkswrst(); }  // .handler
+    };
+    m_swap_timer.callback = [](void* arg) {
+        usbus_event_post(static_cast<usbus_hid_rawhid_t*>(arg)->usbus, &_event);
+    };
+    m_swap_timer.arg = this;
+    ztimer_set(ZTIMER_MSEC, &m_swap_timer, STAGE_SWAP_DELAY_MS);
+    return STATUS_OK;
+}
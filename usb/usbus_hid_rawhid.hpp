@@ -0,0 +1,152 @@
+#pragma once
+
+#include "nvm_stream.h"         // for nvm_stream_t
+#include "ztimer.h"             // for ztimer_t
+
+#include "event_ext.hpp"        // for event_ext_t<>
+#include "usb_descriptor.hpp"   // for RawHidReportDescriptor, RAW_HID_REPORT_SIZE
+#include "usbus_hid_device.hpp"
+
+
+
+// Vendor-defined raw HID interface serving a compact RPC protocol for host tooling
+// (See ./darpc for the host-side client).
+//
+// Each request is a 64-byte OUT report from the host, and is answered by exactly one
+// 64-byte IN report, so one round trip takes one polling interval (1 ms by default).
+// The host should wait for the response before sending the next request.
+//   byte     |0       |1       |2       |3       |4 ... 63
+//   ---------+--------+--------+--------+--------+------------
+//   request  |command |seq     |length  |0       |payload[length]
+//   response |command |seq     |length  |status  |payload[length]
+// `seq` is echoed back unchanged so that the host can match responses to requests.
+class usbus_hid_rawhid_t: public usbus_hid_device_ext_t {
+public:
+    usbus_hid_rawhid_t(usbus_t* usbus)
+    : usbus_hid_device_ext_t(
+        usbus, report_desc.data(), report_desc.size(), _hdlr_receive_data)
+    {}
+
+    void usb_init(usbus_t* usbus) override;
+
+    void on_reset() override;
+
+    enum : uint8_t {
+        RPC_PING            = 0x01,  // Echo the payload back.
+        RPC_READ_STATS      = 0x02,  // Return rpc_stats_t.
+        RPC_NVM_SET         = 0x03,  // Set an NVM entry. See rpc_nvm_set().
+        RPC_UPLOAD_BEGIN    = 0x10,  // Start uploading a Lua bytecode image into slot 0.
+        RPC_UPLOAD_CHUNK    = 0x11,  // payload: offset (4 bytes) + data
+        RPC_UPLOAD_END      = 0x12,  // Finalize the image and return to normal mode.
+        RPC_STAGE_BEGIN     = 0x20,  // Start staging a firmware image into the opposite
+                                     // bank. payload: size (4 bytes) + CRC-32 (4 bytes)
+        RPC_STAGE_CHUNK     = 0x21,  // payload: offset (4 bytes) + data
+        RPC_STAGE_END       = 0x22,  // Finalize and verify the image.
+        RPC_STAGE_SWAP      = 0x23,  // Swap the banks, rebooting into the staged image.
+    };
+
+    enum : uint8_t {
+        STATUS_OK           = 0,
+        STATUS_BUSY         = 1,     // Not ready yet; the host should retry.
+        STATUS_INVALID      = 2,     // Malformed request or out-of-order chunk
+        STATUS_FAILED       = 3,     // The request was valid but could not complete.
+        STATUS_UNKNOWN      = 4,     // Unknown command
+    };
+
+    // Value types for RPC_NVM_SET
+    enum : uint8_t {
+        NVM_INTEGER         = 0,     // 4-byte little-endian integer
+        NVM_FLOAT           = 1,     // 4-byte IEEE 754 single
+        NVM_STRING          = 2,     // null-terminated string
+    };
+
+private:
+    static inline const auto report_desc = array_of(RawHidReportDescriptor);
+
+    struct __attribute__((packed)) rpc_packet_t {
+        uint8_t command;
+        uint8_t seq;
+        uint8_t length;
+        uint8_t status;
+        uint8_t payload[RAW_HID_REPORT_SIZE - 4];
+    };
+    static_assert( sizeof(rpc_packet_t) == RAW_HID_REPORT_SIZE );
+
+    struct __attribute__((packed)) rpc_stats_t {
+        uint32_t uptime_ms;
+        uint32_t requests;      // number of requests received
+        uint32_t errors;        // number of requests not answered with STATUS_OK
+        uint32_t dropped;       // number of requests dropped while responding
+        uint8_t is_dfu_mode;
+    };
+    static_assert( sizeof(rpc_stats_t) <= sizeof(rpc_packet_t::payload) );
+
+    // Indicates that the response is being transmitted, so in_buf is in use.
+    bool m_is_transmitting = false;
+
+    uint32_t m_requests = 0;
+    uint32_t m_errors = 0;
+    uint32_t m_dropped = 0;
+
+    // Upload state, similar to the DFU download of Lua bytecode.
+    bool m_is_uploading = false;
+    size_t m_upload_offset = 0;
+
+    // Restarted by each upload request, and aborts the upload on expiry.
+    ztimer_t m_upload_timer = { .callback = _tmo_upload, .arg = this };
+    static void _tmo_upload(void* arg);
+
+    event_ext_t<usbus_hid_rawhid_t*> m_event_upload_timeout = {
+        nullptr,  // .list_node
+        [](event_t* pevent) {  // .handler
+            static_cast<event_ext_t<usbus_hid_rawhid_t*>*>(pevent)->arg
+                ->on_upload_timeout();
+        },
+        this  // .arg
+    };
+
+    // Staging state (See rpc_stage_begin())
+    enum : uint8_t {
+        STAGE_NONE,
+        STAGE_RECEIVING,
+        STAGE_VERIFYING,
+        STAGE_STAGED,
+    };
+    uint8_t m_stage_state = STAGE_NONE;
+    size_t m_stage_offset = 0;          // number of bytes received, or verified
+    size_t m_stage_size = 0;
+    uint32_t m_stage_crc = 0;           // CRC-32 given by the host
+    uint32_t m_stage_actual_crc = 0;    // CRC-32 of the bytes verified so far
+    ztimer_t m_swap_timer {};
+
+    // Writer for both the upload and the staging
+    nvm_stream_t m_stream {};
+
+    // in_buf is released only when the host acknowledges the response, or by on_reset().
+    // If tx_timer expires first, the IN endpoint is still armed with the response, which
+    // the host reads (and skips by its seq) when it polls again.
+    void on_transfer_complete(bool was_successful) override {
+        if ( was_successful )
+            m_is_transmitting = false;
+    }
+
+    // Execute the request and fill in the response payload, returning the status.
+    uint8_t execute(const rpc_packet_t& request, rpc_packet_t& response);
+
+    uint8_t rpc_nvm_set(const rpc_packet_t& request);
+    uint8_t rpc_upload_begin();
+    uint8_t rpc_upload_chunk(const rpc_packet_t& request);
+    uint8_t rpc_upload_end();
+    uint8_t rpc_stage_begin(const rpc_packet_t& request);
+    uint8_t rpc_stage_chunk(const rpc_packet_t& request);
+    uint8_t rpc_stage_end();
+    uint8_t rpc_stage_swap();
+
+    void on_upload_timeout();
+    void abort_upload();
+    void abort_staging();
+
+    // Handle a data packet received from the host within the usb_thread context, either
+    // from the interrupt OUT endpoint or a SET_REPORT request.
+    static void _hdlr_receive_data(usbus_hid_device_t* hid, uint8_t* data, size_t len);
+};
@@ -118,6 +118,86 @@ function Lit:on_release()
     fw.send_key(self.m_keycode, false)
 end
 
+-------- Action
+-- Action.lower(keymaps) lowers the keymaps that the firmware can execute natively into
+-- its action table (See action_table.hpp): Lit(), Pseudo() and ModIf() whose maps are
+-- all lowered as well. The firmware handles the slots occupied by them without calling
+-- into Lua, except in defer mode.
+--
+-- The state of a lowered keymap (e.g. m_press_count) lives in the action table, so that
+-- it stays consistent whichever way its events take. The keymap instance remains in Lua
+-- for the other keymaps referring to it, with its class replaced by a subclass of
+-- Action, which forwards _press(), _release() and is_pressed() to the firmware.
+Action = Class()
+
+-- Class variables
+Action.c_classes = {}  -- Lowered subclass for each keymap class
+
+function Action:_press()
+    fw.action_press(self.m_action)
+end
+
+function Action:_release()
+    fw.action_release(self.m_action)
+end
+
+function Action:is_pressed()
+    return fw.action_is_pressed(self.m_action)
+end
+
+-- Return the table of {[slot_index] = action_index} for the lowered slots.
+function Action.lower(keymaps)
+    local actions = {}  -- keymap -> action_index, or false if not lowered
+
+    local function lower(map)
+        if actions[map] ~= nil then
+            return actions[map]
+        end
+
+        -- A keymap customized with its own methods is left to Lua.
+        for _, value in pairs(map) do
+            if type(value) == "function" then
+                actions[map] = false
+                return false
+            end
+        end
+
+        -- Maps are lowered before the keymap referring to them, so an action refers
+        -- only to the actions preceding it in the table.
+        local cls = getmetatable(map)
+        local action
+        if cls == Lit then
+            action = fw.action_lit(map.m_keycode)
+        elseif cls == Pseudo then
+            action = fw.action_pseudo()
+        elseif cls == ModIf then
+            local modifier = lower(map.m_map_modifier)
+            local modified = lower(map.m_map_modified)
+            local original = lower(map.m_map_original)
+            if modifier and modified and original then
+                action = fw.action_modif(modifier, modified, original, map.m_flavor)
+            end
+        end
+
+        -- The action table may be full.
+        actions[map] = action or false
+        if action then
+            if not Action.c_classes[cls] then
+                Action.c_classes[cls] = Class(Action, cls)
+            end
+            setmetatable(map, Action.c_classes[cls])
+            map.m_action = action
+        end
+        return actions[map]
+    end
+
+    local slot_actions = {}
+    for i, keymap in ipairs(keymaps) do
+        slot_actions[i] = lower(keymap) or nil
+    end
+    return slot_actions
+end
+
 -------- Function
 -- Function(func1 [, func2]) creates a keymap instance that calls func1() on press and
 -- optionally func2() on release.
@@ -403,10 +483,10 @@ end
 Timer = Class()
 
 function Timer:init()
-    -- m_ctimer holds a userdata instance of the internal C++ class `_timer_t`.
-    self.m_ctimer = fw.timer_create()
-    -- Closure used as the timer callback; captures `self` for invoking on_timeout().
-    self.m_callback = function(time_now) return self:on_timeout(time_now) end
+    -- m_ctimer holds a userdata instance of the internal C++ class `_timer_t`, bound to
+    -- a closure that captures `self` for invoking on_timeout().
+    self.m_ctimer = fw.timer_create(
+        function(time_now) return self:on_timeout(time_now) end)
 end
 
 -- Callback that is invoked on timer expiration.
@@ -422,7 +502,7 @@ function Timer:on_timeout() end
 -- initial elapsed time since the epoch.
 function Timer:start_timer(timeout_ms, repeated)
     assert( timeout_ms % 1 == 0 and timeout_ms > 0, "timeout_ms not a positive integer" )
-    return fw.timer_start(self.m_ctimer, self.m_callback, timeout_ms, repeated)
+    return fw.timer_start(self.m_ctimer, timeout_ms, repeated)
 end
 
 -- Stop the timer; returns true if the timer is active, or false if the timer was
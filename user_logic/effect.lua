@@ -81,11 +81,10 @@ function Solid:init(...)
     Effect.init(self)
 
     self.m_hsv = {...}
-    for slot_index = 1, KEY_LED_COUNT do
-        fw.led_set_hsv(slot_index, ...)
-        -- Or fw.led_set_hsv(slot_index, fw.unpack(self.m_hsv))
-    end
-    fw.led_refresh()
+    -- The frame is needed only here, and left to be garbage-collected.
+    local frame = fw.frame_create(KEY_LED_COUNT)
+    fw.frame_fill(frame, ...)
+    fw.frame_show(frame)
 end
 
 function Solid:on_lamp_active(slot_index)
@@ -101,6 +100,20 @@ function Solid:on_lamp_inactive(slot_index)
     fw.led_refresh()
 end
 
+-------- "Hardware Breathing"
+HwBreathing = Class(Solid)
+
+-- Solid color LEDs breathing by themselves in the LED drivers (See fw.led_abm_*()),
+-- which takes no Lua code or I2C traffic per frame. `ramp` and `hold` are the timing
+-- codes of fw.led_abm_configure() for rising/falling and for staying on/off.
+function HwBreathing:init(ramp, hold, ...)
+    Solid.init(self, ...)
+
+    fw.led_abm_configure(1, ramp, hold, ramp, hold)
+    fw.led_abm_assign(1, 1, KEY_LED_COUNT)
+    fw.led_abm_start()
+end
+
 -------- "Finger Tracer"
 FingerTracer = Class(Solid, Timer)
 
@@ -150,3 +163,34 @@ function FingerTracer:on_timeout(time_now_ms)
         self:stop_timer()
     end
 end
+
+-------- "Native Effect"
+NativeEffect = Class(Effect)
+
+-- Native effect rendered by the firmware (See fw.effect_start()), which takes no Lua
+-- code per frame or per key event. `name` is one of "breathing", "rainbow", "ripple",
+-- "solid" and "trace", and `arg` is optional. Check is_running() to fall back to an
+-- effect in Lua, as the firmware may be built without ENABLE_NATIVE_EFFECTS.
+function NativeEffect:init(name, h, s, v, arg)
+    Effect.init(self)
+
+    self.m_hsv = {h, s, v}
+    self.m_is_running = fw.effect_start(name, h, s, v, arg)
+    if not self.m_is_running then
+        fw.log("NativeEffect: %s not available", name)
+    end
+end
+
+function NativeEffect:is_running()
+    return self.m_is_running
+end
+
+function NativeEffect:on_lamp_active(slot_index)
+    -- If slot_index <= KEY_LED_COUNT, turn it off. Otherwise, turn it on.
+    fw.effect_override(slot_index, self.m_hsv[1], self.m_hsv[2],
+        slot_index <= KEY_LED_COUNT and 0 or self.m_hsv[3])
+end
+
+function NativeEffect:on_lamp_inactive(slot_index)
+    fw.effect_override(slot_index)
+end
@@ -60,6 +60,20 @@ local function handle_key_event(slot_index, is_press)
     end
 end
 
+-- Effect driver for the key events that the firmware handled natively (See Action),
+-- called with a batch of (slot_index, is_press) pairs.
+local function handle_effect_events(...)
+    local effect = Effect.c_active_effect
+    for i = 1, select("#", ...), 2 do
+        local slot_index, is_press = select(i, ...)
+        if is_press then
+            effect:_press(slot_index)
+        else
+            effect:_release(slot_index)
+        end
+    end
+end
+
 -- Driver for keyboard indicator lamps, responsible for managing their on/off states.
 local function handle_lamp_state(lamp_state)
     -- Compute the difference between the old and new states.
@@ -94,5 +108,7 @@ end
 
 
 
--- Return a module table with the keymap and lamp drivers.
-return {handle_key_event, handle_lamp_state}
+-- Return a module table with the keymap, lamp and effect drivers, followed by the table
+-- of lowered slots ({[slot_index] = action_index}), which the firmware copies.
+return {handle_key_event, handle_lamp_state, handle_effect_events,
+    Action.lower(Base.c_keymap_table)}
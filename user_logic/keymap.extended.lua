@@ -166,7 +166,12 @@ local MildYellow  = 60  * HSV_HUE_STEPS // 360
 -- local SpringGreen = 90  * HSV_HUE_STEPS // 360
 -- local MildGreen   = 120 * HSV_HUE_STEPS // 360
 -- Effect.c_active_effect = Solid(SpringGreen, 255, 255)
-Effect.c_active_effect = FingerTracer(8000, MildYellow, 255, 255)
+-- Effect.c_active_effect = HwBreathing(4, 1, MildYellow, 255, 255)  -- 3.4 s up/down
+-- The native effect needs ENABLE_NATIVE_EFFECTS; otherwise, trace the fingers in Lua.
+Effect.c_active_effect = NativeEffect("trace", MildYellow, 255, 255, 8000)
+if not Effect.c_active_effect:is_running() then
+    Effect.c_active_effect = FingerTracer(8000, MildYellow, 255, 255)
+end
 
 -- For debugging, expose _ENV so we can inspect module entries:
 -- $ dalua -e 'for k,v in pairs(env) do; print(k, v); end' |sort
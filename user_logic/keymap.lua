@@ -117,4 +117,8 @@ Base.c_keymap_table = layout {
 -- Register user-defined RGB effect.
 -- https://stackoverflow.com/questions/21737613/image-of-hsv-color-wheel-for-opencv
 local MildYellow  = 60  * HSV_HUE_STEPS // 360
-Effect.c_active_effect = FingerTracer(8000, MildYellow, 255, 255)
+-- The native effect needs ENABLE_NATIVE_EFFECTS; otherwise, trace the fingers in Lua.
+Effect.c_active_effect = NativeEffect("trace", MildYellow, 255, 255, 8000)
+if not Effect.c_active_effect:is_running() then
+    Effect.c_active_effect = FingerTracer(8000, MildYellow, 255, 255)
+end